@@ -59,6 +59,13 @@ typedef struct {
     double cursor_scale;           /* カーソル画像のスケール（0.0-1.0） */
 } DisplayOptions;
 
+/* スクロールバックオプション設定 */
+typedef struct {
+    int lines;                     /* メモリに置く履歴の行数 (--scrollback) */
+    bool spill;                    /* あふれた行を一時ファイルに退避する（--no-scrollback-spillで無効） */
+    uint64_t bytes;                /* 履歴の使用バイト数の上限（--scrollback-bytes、0で無制限） */
+} ScrollbackOptions;
+
 /* ターミナル状態 */
 typedef struct {
     int rows;           /* ターミナルの行数 */
@@ -81,6 +88,9 @@ extern ColorOptions g_color_options;
 /* 表示オプション設定 */
 extern DisplayOptions g_display_options;
 
+/* スクロールバックオプション設定 */
+extern ScrollbackOptions g_scrollback_options;
+
 /* 関数プロトタイプ（後で各モジュールで実装） */
 
 /* main.c */
@@ -102,7 +112,7 @@ int pty_resize(int rows, int cols);
 bool pty_is_child_running(void);
 
 /* terminal.c */
-int terminal_init(int rows, int cols);
+int terminal_init(int rows, int cols, int scrollback_lines, bool scrollback_spill);
 void terminal_cleanup(void);
 void terminal_clear(void);
 
@@ -0,0 +1,203 @@
+/*
+ * koteiterm - Attribute Table Module
+ * セル属性のインターンと参照カウント
+ */
+
+#include "attr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 初期容量（2の累乗） */
+#define ATTR_TABLE_INITIAL_CAPACITY 64
+
+/* デフォルト属性 */
+static const CellAttr g_default_attr = {
+    .fg_color = 7,  /* 白 */
+    .bg_color = 0,  /* 黒 */
+    .flags = 0
+};
+
+/* 使わない色フィールドを0にそろえる（同じ見た目の属性を同じIDにまとめるため） */
+static CellAttr normalize_attr(const CellAttr *attr)
+{
+    CellAttr norm = *attr;
+    if (!(norm.flags & ATTR_FG_TRUECOLOR)) {
+        norm.fg_rgb = 0;
+    }
+    if (!(norm.flags & ATTR_BG_TRUECOLOR)) {
+        norm.bg_rgb = 0;
+    }
+    return norm;
+}
+
+/* 属性が等しいか */
+static bool attr_equal(const CellAttr *a, const CellAttr *b)
+{
+    return a->fg_color == b->fg_color &&
+           a->bg_color == b->bg_color &&
+           a->flags == b->flags &&
+           a->fg_rgb == b->fg_rgb &&
+           a->bg_rgb == b->bg_rgb;
+}
+
+/* 属性のハッシュ値 */
+static uint32_t attr_hash(const CellAttr *attr)
+{
+    uint32_t h = attr->fg_color | (attr->bg_color << 8) | ((uint32_t)attr->flags << 16);
+    h = (h ^ attr->fg_rgb) * 0x9E3779B1u;
+    h = (h ^ attr->bg_rgb) * 0x85EBCA77u;
+    return h ^ (h >> 15);
+}
+
+/* ID配列を拡張する */
+static int grow_entries(AttrTable *table)
+{
+    uint32_t new_capacity = table->capacity * 2;
+
+    CellAttr *attrs = realloc(table->attrs, new_capacity * sizeof(CellAttr));
+    if (!attrs) {
+        return -1;
+    }
+    table->attrs = attrs;
+
+    uint32_t *refcount = realloc(table->refcount, new_capacity * sizeof(uint32_t));
+    if (!refcount) {
+        return -1;
+    }
+    table->refcount = refcount;
+
+    uint32_t *next = realloc(table->next, new_capacity * sizeof(uint32_t));
+    if (!next) {
+        return -1;
+    }
+    table->next = next;
+
+    table->capacity = new_capacity;
+    return 0;
+}
+
+/* バケット数を倍にして使用中のIDを入れ直す */
+static void grow_buckets(AttrTable *table)
+{
+    uint32_t new_count = table->bucket_count * 2;
+    uint32_t *buckets = calloc(new_count, sizeof(uint32_t));
+    if (!buckets) {
+        return;  /* チェーンが長くなるだけなので続行 */
+    }
+
+    for (uint32_t id = 1; id < table->high_water; id++) {
+        if (table->refcount[id] == 0) {
+            continue;  /* 空きID */
+        }
+        uint32_t h = attr_hash(&table->attrs[id]) & (new_count - 1);
+        table->next[id] = buckets[h];
+        buckets[h] = id;
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = new_count;
+}
+
+/**
+ * 属性テーブルを初期化する
+ */
+int attr_table_init(AttrTable *table)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->capacity = ATTR_TABLE_INITIAL_CAPACITY;
+    table->bucket_count = ATTR_TABLE_INITIAL_CAPACITY;
+    table->attrs = malloc(table->capacity * sizeof(CellAttr));
+    table->refcount = calloc(table->capacity, sizeof(uint32_t));
+    table->next = calloc(table->capacity, sizeof(uint32_t));
+    table->buckets = calloc(table->bucket_count, sizeof(uint32_t));
+    if (!table->attrs || !table->refcount || !table->next || !table->buckets) {
+        fprintf(stderr, "エラー: 属性テーブルのメモリ確保に失敗しました\n");
+        attr_table_free(table);
+        return -1;
+    }
+
+    /* ID 0 はデフォルト属性（ハッシュには入れず、インターン時に直接判定する） */
+    table->attrs[ATTR_DEFAULT_ID] = g_default_attr;
+    table->used = 1;
+    table->high_water = 1;
+    return 0;
+}
+
+/**
+ * 属性テーブルを解放する
+ */
+void attr_table_free(AttrTable *table)
+{
+    free(table->attrs);
+    free(table->refcount);
+    free(table->next);
+    free(table->buckets);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * 属性をインターンしてIDを返す
+ */
+uint32_t attr_table_intern(AttrTable *table, const CellAttr *attr)
+{
+    CellAttr norm = normalize_attr(attr);
+    if (attr_equal(&norm, &g_default_attr)) {
+        return ATTR_DEFAULT_ID;
+    }
+
+    /* 既存のIDを探す */
+    uint32_t h = attr_hash(&norm) & (table->bucket_count - 1);
+    for (uint32_t id = table->buckets[h]; id != 0; id = table->next[id]) {
+        if (attr_equal(&table->attrs[id], &norm)) {
+            table->refcount[id]++;
+            return id;
+        }
+    }
+
+    /* 新しいIDを割り当てる（空きIDを優先） */
+    uint32_t id;
+    if (table->free_head != 0) {
+        id = table->free_head;
+        table->free_head = table->next[id];
+    } else {
+        if (table->high_water == table->capacity && grow_entries(table) < 0) {
+            fprintf(stderr, "警告: 属性テーブルを拡張できません（デフォルト属性で代用します）\n");
+            return ATTR_DEFAULT_ID;
+        }
+        id = table->high_water++;
+    }
+
+    table->attrs[id] = norm;
+    table->refcount[id] = 1;
+    table->next[id] = table->buckets[h];
+    table->buckets[h] = id;
+    table->used++;
+
+    /* 負荷率が1を超えたらバケットを増やす */
+    if (table->used > table->bucket_count) {
+        grow_buckets(table);
+    }
+    return id;
+}
+
+/**
+ * 参照数が0になったIDをハッシュから外して空きリストに戻す
+ */
+void attr_table_recycle(AttrTable *table, uint32_t id)
+{
+    uint32_t h = attr_hash(&table->attrs[id]) & (table->bucket_count - 1);
+    uint32_t *link = &table->buckets[h];
+    while (*link != 0 && *link != id) {
+        link = &table->next[*link];
+    }
+    if (*link == id) {
+        *link = table->next[id];
+    }
+
+    table->next[id] = table->free_head;
+    table->free_head = id;
+    table->used--;
+}
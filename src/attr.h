@@ -0,0 +1,136 @@
+#ifndef ATTR_H
+#define ATTR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* セル属性 */
+typedef struct {
+    uint8_t fg_color;       /* 前景色（0-255: 256色パレットインデックス） */
+    uint8_t bg_color;       /* 背景色（0-255: 256色パレットインデックス） */
+    uint8_t flags;          /* 属性フラグ */
+    uint32_t fg_rgb;        /* 24-bit RGB前景色（0x00RRGGBB） */
+    uint32_t bg_rgb;        /* 24-bit RGB背景色（0x00RRGGBB） */
+} CellAttr;
+
+/* 属性フラグ */
+#define ATTR_BOLD      (1 << 0)
+#define ATTR_ITALIC    (1 << 1)
+#define ATTR_UNDERLINE (1 << 2)
+#define ATTR_REVERSE   (1 << 3)
+#define ATTR_FG_TRUECOLOR (1 << 4)  /* 前景色が24-bit RGB */
+#define ATTR_BG_TRUECOLOR (1 << 5)  /* 背景色が24-bit RGB */
+
+/* デフォルト属性（前景7・背景0・フラグなし）のID。常に存在し、参照カウントしない */
+#define ATTR_DEFAULT_ID 0
+
+/*
+ * 属性テーブル
+ * セルは属性そのものではなくテーブルのIDを持つ。同じ属性は同じIDにまとめ（インターン）、
+ * 参照しているセルの数を数えて、どこからも参照されなくなったIDは再利用する。
+ */
+typedef struct {
+    CellAttr *attrs;        /* ID → 属性 */
+    uint32_t *refcount;     /* ID → 参照数 */
+    uint32_t *next;         /* ハッシュチェーン（空きIDは空きリスト）の次のID、0で終端 */
+    uint32_t *buckets;      /* ハッシュ値 → チェーン先頭のID、0で空 */
+    uint32_t capacity;      /* attrs等の要素数 */
+    uint32_t bucket_count;  /* バケット数（2の累乗） */
+    uint32_t used;          /* 使用中のID数（デフォルトを含む） */
+    uint32_t free_head;     /* 空きリストの先頭、0で空 */
+    uint32_t high_water;    /* 一度でも使ったIDの上限 */
+} AttrTable;
+
+/* 関数プロトタイプ */
+
+/**
+ * 属性テーブルを初期化する
+ * @param table 属性テーブル
+ * @return 成功時0、失敗時-1
+ */
+int attr_table_init(AttrTable *table);
+
+/**
+ * 属性テーブルを解放する
+ * @param table 属性テーブル
+ */
+void attr_table_free(AttrTable *table);
+
+/**
+ * 属性をインターンしてIDを返す（参照数を1増やす）
+ * 使わない色フィールド（TRUECOLORフラグのないRGB値）は無視して比較する。
+ * @param table 属性テーブル
+ * @param attr 属性
+ * @return 属性ID（メモリ確保に失敗した場合はATTR_DEFAULT_ID）
+ */
+uint32_t attr_table_intern(AttrTable *table, const CellAttr *attr);
+
+/**
+ * 参照数が0になったIDをハッシュから外して空きリストに戻す（attr_table_unrefから呼ばれる）
+ * @param table 属性テーブル
+ * @param id 属性ID
+ */
+void attr_table_recycle(AttrTable *table, uint32_t id);
+
+/**
+ * IDの参照数を1増やす
+ * @param table 属性テーブル
+ * @param id 属性ID
+ */
+static inline void attr_table_ref(AttrTable *table, uint32_t id)
+{
+    if (id != ATTR_DEFAULT_ID) {
+        table->refcount[id]++;
+    }
+}
+
+/**
+ * IDの参照数をまとめて増やす（同じ属性でセルの区間を埋めたとき）
+ * @param table 属性テーブル
+ * @param id 属性ID
+ * @param count 増やす数
+ */
+static inline void attr_table_ref_n(AttrTable *table, uint32_t id, uint32_t count)
+{
+    if (id != ATTR_DEFAULT_ID) {
+        table->refcount[id] += count;
+    }
+}
+
+/**
+ * IDの参照数を1減らす
+ * @param table 属性テーブル
+ * @param id 属性ID
+ */
+static inline void attr_table_unref(AttrTable *table, uint32_t id)
+{
+    if (id != ATTR_DEFAULT_ID && --table->refcount[id] == 0) {
+        attr_table_recycle(table, id);
+    }
+}
+
+/**
+ * IDの参照数をまとめて減らす（同じ属性のセルの区間を捨てたとき）
+ * @param table 属性テーブル
+ * @param id 属性ID
+ * @param count 減らす数
+ */
+static inline void attr_table_unref_n(AttrTable *table, uint32_t id, uint32_t count)
+{
+    if (id != ATTR_DEFAULT_ID && count > 0 && (table->refcount[id] -= count) == 0) {
+        attr_table_recycle(table, id);
+    }
+}
+
+/**
+ * IDから属性を取得する
+ * @param table 属性テーブル
+ * @param id 属性ID
+ * @return 属性へのポインタ
+ */
+static inline const CellAttr *attr_table_get(const AttrTable *table, uint32_t id)
+{
+    return &table->attrs[id];
+}
+
+#endif /* ATTR_H */
@@ -0,0 +1,15 @@
+#ifndef CELL_H
+#define CELL_H
+
+#include <stdint.h>
+
+/* 特殊文字コード */
+#define WIDE_CHAR_CONTINUATION 0xFFFFFFFE  /* 全角文字の2セル目 */
+
+/* 文字セル（8バイト） */
+typedef struct {
+    uint32_t ch;            /* Unicode文字 */
+    uint32_t attr;          /* 属性ID（g_terminal.attrsのインデックス） */
+} Cell;
+
+#endif /* CELL_H */
@@ -0,0 +1,141 @@
+/*
+ * koteiterm - Combining Sequence Module
+ * 結合文字を基底文字のセルに結び付けるためのテーブル
+ */
+
+#include "combining.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* 1チャンクの結合文字列数（登録済みの並びが動かないようにチャンク単位で確保する） */
+#define COMBINING_CHUNK_SHIFT 10
+#define COMBINING_CHUNK_SIZE (1 << COMBINING_CHUNK_SHIFT)
+#define COMBINING_MAX_CHUNKS (COMBINING_MAX_SEQUENCES / COMBINING_CHUNK_SIZE)
+
+/* インターン用ハッシュ表のスロット数（登録数の上限の2倍、2の累乗） */
+#define COMBINING_HASH_SLOTS (COMBINING_MAX_SEQUENCES * 2)
+
+/* 結合文字列（基底文字＋結合文字） */
+typedef struct {
+    uint32_t cps[COMBINING_MAX_CODEPOINTS];
+    uint8_t len;
+} CombiningSequence;
+
+static struct {
+    CombiningSequence *chunks[COMBINING_MAX_CHUNKS];
+    uint32_t *slots;        /* ハッシュ表（結合文字列の番号+1、0は空き） */
+    atomic_uint count;      /* 登録済みの結合文字列数（並びを書いてから増やす） */
+    bool warned;            /* 一杯になった警告を出したか */
+} g_combining;
+
+/* 登録済みの結合文字列の番号ならtrue */
+static inline bool is_registered(uint32_t ch)
+{
+    return combining_is_sequence(ch) &&
+           ch - COMBINING_BASE < atomic_load_explicit(&g_combining.count, memory_order_acquire);
+}
+
+/* 番号から結合文字列を引く */
+static inline const CombiningSequence *sequence_at(uint32_t id)
+{
+    return &g_combining.chunks[id >> COMBINING_CHUNK_SHIFT][id & (COMBINING_CHUNK_SIZE - 1)];
+}
+
+/* コードポイント列のハッシュ値 */
+static uint32_t sequence_hash(const uint32_t *cps, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ cps[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/** 結合文字を1つ加えたセルの値を返す */
+uint32_t combining_attach(uint32_t ch, uint32_t mark)
+{
+    uint32_t cps[COMBINING_MAX_CODEPOINTS];
+    int len = combining_expand(ch, cps);
+    if (len >= COMBINING_MAX_CODEPOINTS) {
+        return ch;
+    }
+    cps[len++] = mark;
+
+    if (!g_combining.slots) {
+        g_combining.slots = calloc(COMBINING_HASH_SLOTS, sizeof(uint32_t));
+        if (!g_combining.slots) {
+            return ch;
+        }
+    }
+
+    /* 同じ並びが登録済みならその値を使う */
+    uint32_t mask = COMBINING_HASH_SLOTS - 1;
+    uint32_t slot = sequence_hash(cps, len) & mask;
+    while (g_combining.slots[slot] != 0) {
+        uint32_t id = g_combining.slots[slot] - 1;
+        const CombiningSequence *seq = sequence_at(id);
+        if (seq->len == len && memcmp(seq->cps, cps, len * sizeof(uint32_t)) == 0) {
+            return COMBINING_BASE + id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    uint32_t id = atomic_load_explicit(&g_combining.count, memory_order_relaxed);
+    if (id >= COMBINING_MAX_SEQUENCES) {
+        if (!g_combining.warned) {
+            fprintf(stderr, "警告: 結合文字列のテーブルが一杯です。以降の新しい結合文字は表示しません\n");
+            g_combining.warned = true;
+        }
+        return ch;
+    }
+
+    CombiningSequence **chunk = &g_combining.chunks[id >> COMBINING_CHUNK_SHIFT];
+    if (!*chunk) {
+        *chunk = malloc(COMBINING_CHUNK_SIZE * sizeof(CombiningSequence));
+        if (!*chunk) {
+            return ch;
+        }
+    }
+    CombiningSequence *seq = &(*chunk)[id & (COMBINING_CHUNK_SIZE - 1)];
+    memcpy(seq->cps, cps, len * sizeof(uint32_t));
+    seq->len = (uint8_t)len;
+    g_combining.slots[slot] = id + 1;
+    atomic_store_explicit(&g_combining.count, id + 1, memory_order_release);
+    return COMBINING_BASE + id;
+}
+
+/** セルの値をコードポイント列に展開する */
+int combining_expand(uint32_t ch, uint32_t *out)
+{
+    if (!is_registered(ch)) {
+        out[0] = ch;
+        return 1;
+    }
+    const CombiningSequence *seq = sequence_at(ch - COMBINING_BASE);
+    memcpy(out, seq->cps, seq->len * sizeof(uint32_t));
+    return seq->len;
+}
+
+/** セルの値の基底文字を返す */
+uint32_t combining_base(uint32_t ch)
+{
+    if (!is_registered(ch)) {
+        return ch;
+    }
+    return sequence_at(ch - COMBINING_BASE)->cps[0];
+}
+
+/** テーブルを解放する */
+void combining_cleanup(void)
+{
+    for (int i = 0; i < COMBINING_MAX_CHUNKS; i++) {
+        free(g_combining.chunks[i]);
+    }
+    free(g_combining.slots);
+    memset(g_combining.chunks, 0, sizeof(g_combining.chunks));
+    g_combining.slots = NULL;
+    atomic_store(&g_combining.count, 0);
+    g_combining.warned = false;
+}
@@ -0,0 +1,66 @@
+#ifndef COMBINING_H
+#define COMBINING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * 結合文字列のテーブル
+ * 幅0の文字（結合文字・ZWJ・異体字セレクタなど）は直前のセルに結び付ける。
+ * 結合文字を持つセルには、Unicodeの範囲外（COMBINING_BASE以上）の値を入れ、
+ * その値で基底文字と結合文字の並びをこのテーブルから引く。
+ * 同じ並びは同じ値にまとめ（インターン）、一度登録した並びは終了まで消さない。
+ * そのためセルの値はスクロールバックにそのまま保存できる。
+ */
+
+/* 結合文字列を表すセル値の先頭 */
+#define COMBINING_BASE 0x110000u
+
+/* 登録できる結合文字列の数（これを超えた結合文字は捨てる） */
+#define COMBINING_MAX_SEQUENCES 65536
+
+/* 1セルに結び付けるコードポイント数の上限（基底文字を含む。超えた結合文字は捨てる） */
+#define COMBINING_MAX_CODEPOINTS 8
+
+/**
+ * セルの値が結合文字列か判定する
+ * @param ch セルの値
+ * @return 結合文字列ならtrue
+ */
+static inline bool combining_is_sequence(uint32_t ch)
+{
+    return ch - COMBINING_BASE < COMBINING_MAX_SEQUENCES;
+}
+
+/**
+ * セルの値に結合文字を1つ加えた値を返す
+ * テーブルが一杯の場合や上限に達している場合は結合文字を捨て、元の値を返す。
+ * メインスレッドからだけ呼ぶ。
+ * @param ch セルの値（結合文字列でもよい）
+ * @param mark 加える幅0の文字
+ * @return 新しいセルの値
+ */
+uint32_t combining_attach(uint32_t ch, uint32_t mark);
+
+/**
+ * セルの値をコードポイント列に展開する
+ * 登録済みの並びは変わらないため、セルを受け取ったワーカースレッドからも呼べる。
+ * @param ch セルの値
+ * @param out 出力先（COMBINING_MAX_CODEPOINTS個）
+ * @return コードポイント数（結合文字列でなければ1）
+ */
+int combining_expand(uint32_t ch, uint32_t *out);
+
+/**
+ * セルの値の基底文字を返す
+ * @param ch セルの値
+ * @return 基底文字（結合文字列でなければchそのもの）
+ */
+uint32_t combining_base(uint32_t ch);
+
+/**
+ * テーブルを解放する
+ */
+void combining_cleanup(void);
+
+#endif /* COMBINING_H */
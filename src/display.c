@@ -9,6 +9,8 @@
 #include "input.h"
 #include "pty.h"
 #include "color.h"
+#include "search.h"
+#include "combining.h"
 #include "koteiterm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -109,8 +111,177 @@ static XftColor *get_color(uint8_t idx)
     return &xft_color_cache[idx];
 }
 
+/* Truecolor色キャッシュ（24-bit RGB → XftColor、あふれたら最も古く使った色を解放） */
+#define RGB_COLOR_CACHE_SIZE 1024   /* キャッシュする色の数 */
+#define RGB_COLOR_HASH_SIZE 2048    /* ハッシュのバケット数（2の累乗） */
+
+typedef struct {
+    uint32_t rgb;        /* RGB値（0x00RRGGBB） */
+    XftColor color;      /* 割り当て済みの色 */
+    int hash_next;       /* 同じバケットの次のエントリ（番号+1、0で終端） */
+    int lru_prev;        /* 1つ新しく使ったエントリ（番号+1、0で先頭） */
+    int lru_next;        /* 1つ古く使ったエントリ（番号+1、0で末尾） */
+} RgbColorEntry;
+
+static RgbColorEntry rgb_color_cache[RGB_COLOR_CACHE_SIZE];
+static int rgb_color_buckets[RGB_COLOR_HASH_SIZE];  /* バケット → 先頭のエントリ（番号+1、0で空） */
+static int rgb_color_count = 0;                     /* 使用中のエントリ数 */
+static int rgb_lru_head = 0;                        /* 最も新しく使ったエントリ（番号+1） */
+static int rgb_lru_tail = 0;                        /* 最も古く使ったエントリ（番号+1） */
+
+/* LRUから追い出した色（積んだ背景区間がまだそのピクセル値を使っているので、塗り終えてから解放する） */
+static XftColor *rgb_deferred_frees = NULL;
+static int rgb_deferred_count = 0;
+static int rgb_deferred_capacity = 0;
+
+/* TrueColorビジュアルならピクセル値をマスクから直接組み立てる */
+static struct {
+    bool initialized;
+    bool direct;                 /* TrueColorビジュアルか */
+    int red_shift, red_len;
+    int green_shift, green_len;
+    int blue_shift, blue_len;
+    unsigned long alpha_mask;    /* 深さ32のビジュアルで不透明にするビット */
+} rgb_visual;
+
+/* マスクからシフト量とビット数を求める */
+static void mask_to_shift_len(unsigned long mask, int *shift, int *len)
+{
+    int s = 0;
+    int l = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        s++;
+    }
+    while (mask & 1) {
+        mask >>= 1;
+        l++;
+    }
+    *shift = s;
+    *len = l;
+}
+
+/* デフォルトビジュアルを調べる */
+static void init_rgb_visual(void)
+{
+    Visual *visual = DefaultVisual(g_display.display, g_display.screen);
+    int depth = DefaultDepth(g_display.display, g_display.screen);
+
+    rgb_visual.direct = (visual->class == TrueColor);
+    if (rgb_visual.direct) {
+        mask_to_shift_len(visual->red_mask, &rgb_visual.red_shift, &rgb_visual.red_len);
+        mask_to_shift_len(visual->green_mask, &rgb_visual.green_shift, &rgb_visual.green_len);
+        mask_to_shift_len(visual->blue_mask, &rgb_visual.blue_shift, &rgb_visual.blue_len);
+        rgb_visual.alpha_mask = 0;
+        if (depth == 32) {
+            rgb_visual.alpha_mask = 0xffffffffUL & ~(visual->red_mask | visual->green_mask | visual->blue_mask);
+        }
+    }
+    rgb_visual.initialized = true;
+}
+
+/* RGB値のハッシュ */
+static inline uint32_t rgb_color_hash(uint32_t rgb)
+{
+    return (rgb * 2654435761u) >> 21;  /* 上位11ビット（RGB_COLOR_HASH_SIZE = 2^11） */
+}
+
+/* エントリをLRUリストから外す */
+static void rgb_lru_unlink(int idx)
+{
+    RgbColorEntry *e = &rgb_color_cache[idx];
+    if (e->lru_prev) {
+        rgb_color_cache[e->lru_prev - 1].lru_next = e->lru_next;
+    } else {
+        rgb_lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        rgb_color_cache[e->lru_next - 1].lru_prev = e->lru_prev;
+    } else {
+        rgb_lru_tail = e->lru_prev;
+    }
+}
+
+/* エントリをLRUリストの先頭（最も新しい）に入れる */
+static void rgb_lru_push_front(int idx)
+{
+    RgbColorEntry *e = &rgb_color_cache[idx];
+    e->lru_prev = 0;
+    e->lru_next = rgb_lru_head;
+    if (rgb_lru_head) {
+        rgb_color_cache[rgb_lru_head - 1].lru_prev = idx + 1;
+    } else {
+        rgb_lru_tail = idx + 1;
+    }
+    rgb_lru_head = idx + 1;
+}
+
+/* エントリをハッシュチェーンから外す */
+static void rgb_hash_unlink(int idx)
+{
+    int *link = &rgb_color_buckets[rgb_color_hash(rgb_color_cache[idx].rgb)];
+    while (*link && *link != idx + 1) {
+        link = &rgb_color_cache[*link - 1].hash_next;
+    }
+    if (*link) {
+        *link = rgb_color_cache[idx].hash_next;
+    }
+}
+
+/* 追い出した色の解放を背景区間を塗り終えるまで遅らせる（記録できなければすぐに解放する） */
+static void defer_color_free(const XftColor *color)
+{
+    if (rgb_deferred_count == rgb_deferred_capacity) {
+        int capacity = rgb_deferred_capacity ? rgb_deferred_capacity * 2 : 64;
+        XftColor *frees = realloc(rgb_deferred_frees, capacity * sizeof(XftColor));
+        if (!frees) {
+            Visual *visual = DefaultVisual(g_display.display, g_display.screen);
+            Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
+            XftColorFree(g_display.display, visual, colormap, (XftColor *)color);
+            return;
+        }
+        rgb_deferred_frees = frees;
+        rgb_deferred_capacity = capacity;
+    }
+    rgb_deferred_frees[rgb_deferred_count++] = *color;
+}
+
+/* 遅らせていた色を解放する */
+static void release_deferred_colors(void)
+{
+    Visual *visual = DefaultVisual(g_display.display, g_display.screen);
+    Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
+
+    for (int i = 0; i < rgb_deferred_count; i++) {
+        XftColorFree(g_display.display, visual, colormap, &rgb_deferred_frees[i]);
+    }
+    rgb_deferred_count = 0;
+}
+
+/* キャッシュした色をすべて解放する */
+static void free_rgb_color_cache(void)
+{
+    Visual *visual = DefaultVisual(g_display.display, g_display.screen);
+    Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
+
+    release_deferred_colors();
+    free(rgb_deferred_frees);
+    rgb_deferred_frees = NULL;
+    rgb_deferred_capacity = 0;
+
+    for (int i = 0; i < rgb_color_count; i++) {
+        XftColorFree(g_display.display, visual, colormap, &rgb_color_cache[i].color);
+    }
+    memset(rgb_color_buckets, 0, sizeof(rgb_color_buckets));
+    rgb_color_count = 0;
+    rgb_lru_head = 0;
+    rgb_lru_tail = 0;
+    rgb_visual.initialized = false;
+}
+
 /**
  * 24-bit RGB値からXftColorを作成（Truecolorモード用）
+ * TrueColorビジュアルではピクセル値を直接計算し、それ以外では割り当てた色をキャッシュする。
  * @param rgb RGB値（0x00RRGGBB形式）
  * @param xft_color 出力先XftColor
  */
@@ -121,10 +292,60 @@ static void get_rgb_color(uint32_t rgb, XftColor *xft_color)
     unsigned short b = (rgb & 0xFF) * 257;
 
     XRenderColor xr_color = {r, g, b, 0xffff};
+
+    if (!rgb_visual.initialized) {
+        init_rgb_visual();
+    }
+
+    if (rgb_visual.direct) {
+        xft_color->color = xr_color;
+        xft_color->pixel = ((unsigned long)(r >> (16 - rgb_visual.red_len)) << rgb_visual.red_shift) |
+                           ((unsigned long)(g >> (16 - rgb_visual.green_len)) << rgb_visual.green_shift) |
+                           ((unsigned long)(b >> (16 - rgb_visual.blue_len)) << rgb_visual.blue_shift) |
+                           rgb_visual.alpha_mask;
+        return;
+    }
+
+    /* キャッシュを引く */
+    uint32_t h = rgb_color_hash(rgb);
+    for (int e = rgb_color_buckets[h]; e; e = rgb_color_cache[e - 1].hash_next) {
+        if (rgb_color_cache[e - 1].rgb == rgb) {
+            if (rgb_lru_head != e) {
+                rgb_lru_unlink(e - 1);
+                rgb_lru_push_front(e - 1);
+            }
+            *xft_color = rgb_color_cache[e - 1].color;
+            return;
+        }
+    }
+
     Visual *visual = DefaultVisual(g_display.display, g_display.screen);
     Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
 
-    XftColorAllocValue(g_display.display, visual, colormap, &xr_color, xft_color);
+    if (!XftColorAllocValue(g_display.display, visual, colormap, &xr_color, xft_color)) {
+        /* カラーマップが埋まっている */
+        xft_color->color = xr_color;
+        xft_color->pixel = BlackPixel(g_display.display, g_display.screen);
+        return;
+    }
+
+    /* 空きがなければ最も古く使った色を追い出して使う（解放は積んだ背景区間を塗り終えてから） */
+    int idx;
+    if (rgb_color_count < RGB_COLOR_CACHE_SIZE) {
+        idx = rgb_color_count++;
+    } else {
+        idx = rgb_lru_tail - 1;
+        rgb_lru_unlink(idx);
+        rgb_hash_unlink(idx);
+        defer_color_free(&rgb_color_cache[idx].color);
+    }
+
+    RgbColorEntry *entry = &rgb_color_cache[idx];
+    entry->rgb = rgb;
+    entry->color = *xft_color;
+    entry->hash_next = rgb_color_buckets[h];
+    rgb_color_buckets[h] = idx + 1;
+    rgb_lru_push_front(idx);
 }
 
 /**
@@ -170,37 +391,6 @@ static bool parse_and_alloc_color(const char *color_str,
     return XftColorAllocValue(g_display.display, visual, colormap, &xr_color, xft_color) != 0;
 }
 
-/* UTF-8エンコード関数 */
-static int utf8_encode(uint32_t codepoint, char *utf8)
-{
-    if (codepoint < 0x80) {
-        /* 1バイト */
-        utf8[0] = (char)codepoint;
-        return 1;
-    } else if (codepoint < 0x800) {
-        /* 2バイト */
-        utf8[0] = 0xC0 | ((codepoint >> 6) & 0x1F);
-        utf8[1] = 0x80 | (codepoint & 0x3F);
-        return 2;
-    } else if (codepoint < 0x10000) {
-        /* 3バイト */
-        utf8[0] = 0xE0 | ((codepoint >> 12) & 0x0F);
-        utf8[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-        utf8[2] = 0x80 | (codepoint & 0x3F);
-        return 3;
-    } else if (codepoint < 0x110000) {
-        /* 4バイト */
-        utf8[0] = 0xF0 | ((codepoint >> 18) & 0x07);
-        utf8[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-        utf8[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-        utf8[3] = 0x80 | (codepoint & 0x3F);
-        return 4;
-    }
-    /* 不正なコードポイント */
-    utf8[0] = '?';
-    return 1;
-}
-
 /**
  * GIFアニメーションを読み込む
  * @param path GIFファイルのパス
@@ -389,6 +579,52 @@ static int load_gif_animation(const char *path)
     return 0;
 }
 
+/* バックバッファの矩形をウィンドウへ転送する */
+static void present_area(int x, int y, int width, int height)
+{
+    XCopyArea(g_display.display, g_display.back_buffer, g_display.window, g_display.gc,
+              x, y, width, height, x, y);
+}
+
+/* バックバッファの矩形を背景色（ウィンドウの背景と同じ黒）で塗りつぶす */
+static void clear_back_buffer_area(int x, int y, int width, int height)
+{
+    XSetForeground(g_display.display, g_display.gc, BlackPixel(g_display.display, g_display.screen));
+    XFillRectangle(g_display.display, g_display.back_buffer, g_display.gc, x, y, width, height);
+}
+
+/* ウィンドウサイズのバックバッファを（作り直して）XftDrawの描画先にする */
+static int create_back_buffer(int width, int height)
+{
+    Pixmap buffer = XCreatePixmap(g_display.display, g_display.window, width, height,
+                                  DefaultDepth(g_display.display, g_display.screen));
+
+    if (g_display.xft_draw) {
+        XftDrawChange(g_display.xft_draw, buffer);
+    } else {
+        Visual *visual = DefaultVisual(g_display.display, g_display.screen);
+        Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
+        g_display.xft_draw = XftDrawCreate(g_display.display, buffer, visual, colormap);
+        if (!g_display.xft_draw) {
+            fprintf(stderr, "エラー: XftDraw の作成に失敗しました\n");
+            XFreePixmap(g_display.display, buffer);
+            return -1;
+        }
+    }
+
+    if (g_display.back_buffer) {
+        XFreePixmap(g_display.display, g_display.back_buffer);
+    }
+    g_display.back_buffer = buffer;
+    g_display.back_width = width;
+    g_display.back_height = height;
+
+    /* 新しいバッファは中身が不定なので塗りつぶし、次の描画で全体を描き直す */
+    clear_back_buffer_area(0, 0, width, height);
+    g_display.last_cursor_valid = false;
+    return 0;
+}
+
 /**
  * ディスプレイを初期化する
  */
@@ -436,8 +672,10 @@ int display_init(int width, int height)
                  ButtonPressMask | ButtonReleaseMask |
                  PointerMotionMask | StructureNotifyMask);
 
-    /* グラフィックスコンテキストを作成 */
-    g_display.gc = XCreateGC(g_display.display, g_display.window, 0, NULL);
+    /* グラフィックスコンテキストを作成（バックバッファからのコピーでNoExposeイベントを出さない） */
+    XGCValues gc_values = {0};
+    gc_values.graphics_exposures = False;
+    g_display.gc = XCreateGC(g_display.display, g_display.window, GCGraphicsExposures, &gc_values);
     XSetForeground(g_display.display, g_display.gc, white);
     XSetBackground(g_display.display, g_display.gc, black);
 
@@ -449,10 +687,7 @@ int display_init(int width, int height)
     Visual *visual = DefaultVisual(g_display.display, g_display.screen);
     Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
 
-    g_display.xft_draw = XftDrawCreate(g_display.display, g_display.window,
-                                       visual, colormap);
-    if (!g_display.xft_draw) {
-        fprintf(stderr, "エラー: XftDraw の作成に失敗しました\n");
+    if (create_back_buffer(width, height) < 0) {
         XDestroyWindow(g_display.display, g_display.window);
         XCloseDisplay(g_display.display);
         return -1;
@@ -465,6 +700,8 @@ int display_init(int width, int height)
     parse_and_alloc_color(g_color_options.sel_bg, 0x5c5c, 0x5c5c, 0x5c5c, &g_display.xft_sel_bg);  /* デフォルト: グレー */
     parse_and_alloc_color(g_color_options.sel_fg, 0xffff, 0xffff, 0xffff, &g_display.xft_sel_fg);  /* デフォルト: 白 */
     parse_and_alloc_color(g_color_options.underline, 0xffff, 0xffff, 0xffff, &g_display.xft_underline);  /* デフォルト: 白 */
+    parse_and_alloc_color(NULL, 0xc0c0, 0xa0a0, 0x0000, &g_display.xft_match_bg);  /* 検索の一致: 黄土色 */
+    parse_and_alloc_color(NULL, 0x0000, 0x0000, 0x0000, &g_display.xft_match_fg);  /* 検索の一致: 黒 */
 
     /* ANSI 16色を初期化 */
     for (int i = 0; i < 16; i++) {
@@ -622,10 +859,21 @@ void display_cleanup(void)
         g_display.xim = NULL;
     }
 
+    /* 差分描画用の作業配列を解放 */
+    free(g_display.damage);
+    free(g_display.glyph_specs);
+    free(g_display.underline_segs);
+    free(g_display.bg_runs);
+    free(g_display.bg_rects);
+    free(g_display.search_marks);
+
     /* Xft リソースをクリーンアップ */
     if (g_display.xft_draw) {
         XftDrawDestroy(g_display.xft_draw);
     }
+    if (g_display.back_buffer) {
+        XFreePixmap(g_display.display, g_display.back_buffer);
+    }
 
     Visual *visual = DefaultVisual(g_display.display, g_display.screen);
     Colormap colormap = DefaultColormap(g_display.display, g_display.screen);
@@ -634,6 +882,8 @@ void display_cleanup(void)
     XftColorFree(g_display.display, visual, colormap, &g_display.xft_cursor);
     XftColorFree(g_display.display, visual, colormap, &g_display.xft_sel_bg);
     XftColorFree(g_display.display, visual, colormap, &g_display.xft_sel_fg);
+    XftColorFree(g_display.display, visual, colormap, &g_display.xft_match_bg);
+    XftColorFree(g_display.display, visual, colormap, &g_display.xft_match_fg);
     XftColorFree(g_display.display, visual, colormap, &g_display.xft_underline);
 
     /* 初期化済みの色を解放 */
@@ -643,6 +893,7 @@ void display_cleanup(void)
             color_initialized[i] = false;
         }
     }
+    free_rgb_color_cache();
 
     /* Imlib2画像リソースを解放 */
     if (g_display.cursor_image) {
@@ -729,11 +980,9 @@ bool display_handle_events(void)
         switch (event.type) {
             case Expose:
                 /* 再描画が必要 */
-                if (event.xexpose.count == 0) {
-                    /* 最後のExposeイベントの時だけ再描画 */
-                    display_clear();
-                    display_flush();
-                }
+                /* 前回のフレームがバックバッファに残っているので、露出した範囲を転送するだけ */
+                present_area(event.xexpose.x, event.xexpose.y,
+                             event.xexpose.width, event.xexpose.height);
                 break;
 
             case ClientMessage:
@@ -752,6 +1001,10 @@ bool display_handle_events(void)
                     event.xconfigure.height != g_display.height) {
                     g_display.width = event.xconfigure.width;
                     g_display.height = event.xconfigure.height;
+
+                    /* バックバッファを新しいサイズで作り直す */
+                    create_back_buffer(g_display.width, g_display.height);
+                    terminal_mark_all_dirty();
                     if (g_debug) {
                         printf("ウィンドウサイズ変更: %dx%d\n",
                                g_display.width, g_display.height);
@@ -771,7 +1024,7 @@ bool display_handle_events(void)
                                 /* PTYをリサイズ */
                                 pty_resize(new_rows, new_cols);
 
-                                /* 再描画 */
+                                /* 再描画（リサイズで全体が変更済みになっている） */
                                 display_clear();
                                 display_render_terminal();
                                 display_flush();
@@ -1040,12 +1293,17 @@ bool display_handle_events(void)
  */
 void display_clear(void)
 {
-    if (!g_display.display || !g_display.window) {
+    if (!g_display.display || !g_display.back_buffer) {
         return;
     }
 
-    /* ウィンドウ全体を背景色で塗りつぶす */
-    XClearWindow(g_display.display, g_display.window);
+    /* バックバッファ全体を背景色で塗りつぶしてウィンドウへ転送 */
+    clear_back_buffer_area(0, 0, g_display.back_width, g_display.back_height);
+    present_area(0, 0, g_display.back_width, g_display.back_height);
+
+    /* 消した内容は次の描画で描き直す */
+    g_display.last_cursor_valid = false;
+    terminal_mark_all_dirty();
 }
 
 /**
@@ -1060,277 +1318,748 @@ void display_flush(void)
     XFlush(g_display.display);
 }
 
-/**
- * ターミナルバッファの内容を描画する
- */
-void display_render_terminal(void)
+/* 表示位置 (x, y) のセルを取得する（スクロールオフセットを考慮） */
+static Cell *get_display_cell(int x, int y, int scroll_offset)
 {
-    if (!g_display.display || !g_display.xft_draw) {
-        return;
+    extern TerminalBuffer g_terminal;
+
+    if (scroll_offset <= 0) {
+        /* スクロールオフセットなし：通常バッファから */
+        return terminal_get_cell(x, y);
     }
 
-    extern FontState g_font;
-    extern TerminalBuffer g_terminal;
+    /* スクロールバックバッファから取得 */
+    int scrollback_line_idx = g_terminal.scrollback.count - scroll_offset + y;
 
-    if (!g_font.xft_font) {
-        return;
+    if (scrollback_line_idx >= 0 && scrollback_line_idx < g_terminal.scrollback.count) {
+        /* スクロールバックバッファから */
+        ScrollbackLine line;
+        if (terminal_get_scrollback_line(scrollback_line_idx, &line) && x < line.cols) {
+            return &line.cells[x];
+        }
+    } else if (scrollback_line_idx >= g_terminal.scrollback.count) {
+        /* 通常バッファから */
+        int buffer_y = scrollback_line_idx - g_terminal.scrollback.count;
+        if (buffer_y >= 0 && buffer_y < g_terminal.rows) {
+            return terminal_get_cell(x, buffer_y);
+        }
+    }
+    return NULL;
+}
+
+/* 表示位置 (x, y) の検索の一致の印（検索モード中でなければSEARCH_MARK_NONE） */
+static inline uint8_t get_search_mark(int x, int y)
+{
+    if (g_display.search_marks_cols == 0) {
+        return SEARCH_MARK_NONE;
+    }
+    return g_display.search_marks[y * g_display.search_marks_cols + x];
+}
+
+/* 2つのXftColorが同じ色か（Truecolorは呼び出しごとに一時カラーを作るので値で比べる） */
+static bool xft_color_equal(const XftColor *a, const XftColor *b)
+{
+    return a->pixel == b->pixel &&
+           a->color.red == b->color.red &&
+           a->color.green == b->color.green &&
+           a->color.blue == b->color.blue &&
+           a->color.alpha == b->color.alpha;
+}
+
+/* 同じ前景色のグリフと下線をまとめてバックバッファに描く */
+static void flush_glyph_run(XftColor *color, const XftGlyphFontSpec *specs, int nspecs,
+                            XSegment *segs, int nsegs)
+{
+    if (nspecs > 0) {
+        XftDrawGlyphFontSpec(g_display.xft_draw, color, specs, nspecs);
+    }
+    if (nsegs > 0) {
+        XSetForeground(g_display.display, g_display.gc, color->pixel);
+        XDrawSegments(g_display.display, g_display.back_buffer, g_display.gc, segs, nsegs);
+    }
+}
+
+/* 背景区間をフレームの一覧に積む（配列を伸ばせなければその場で塗る） */
+static void add_background_run(unsigned long pixel, int x, int y, int width, int height)
+{
+    if (g_display.bg_run_count == g_display.bg_run_capacity) {
+        int capacity = g_display.bg_run_capacity ? g_display.bg_run_capacity * 2 : 256;
+        BackgroundRun *runs = realloc(g_display.bg_runs, capacity * sizeof(BackgroundRun));
+        if (runs) {
+            g_display.bg_runs = runs;
+        }
+        XRectangle *rects = realloc(g_display.bg_rects, capacity * sizeof(XRectangle));
+        if (rects) {
+            g_display.bg_rects = rects;
+        }
+        if (!runs || !rects) {
+            XSetForeground(g_display.display, g_display.gc, pixel);
+            XFillRectangle(g_display.display, g_display.back_buffer, g_display.gc, x, y, width, height);
+            return;
+        }
+        g_display.bg_run_capacity = capacity;
     }
 
+    BackgroundRun *run = &g_display.bg_runs[g_display.bg_run_count++];
+    run->pixel = pixel;
+    run->rect.x = x;
+    run->rect.y = y;
+    run->rect.width = width;
+    run->rect.height = height;
+}
+
+/* qsort用: 背景区間を色で並べる */
+static int compare_background_runs(const void *a, const void *b)
+{
+    unsigned long pa = ((const BackgroundRun *)a)->pixel;
+    unsigned long pb = ((const BackgroundRun *)b)->pixel;
+    return (pa > pb) - (pa < pb);
+}
+
+/* 積んだ背景区間を色ごとに1回のXFillRectanglesで塗り、塗り終えてからLRUから追い出した色を解放する */
+static void flush_background_runs(void)
+{
+    int count = g_display.bg_run_count;
+
+    /* 区間同士は重ならないので、並べ替えても描画結果は変わらない */
+    if (count > 0) {
+        qsort(g_display.bg_runs, count, sizeof(BackgroundRun), compare_background_runs);
+    }
+
+    for (int i = 0; i < count; ) {
+        unsigned long pixel = g_display.bg_runs[i].pixel;
+        int n = 0;
+        while (i < count && g_display.bg_runs[i].pixel == pixel) {
+            g_display.bg_rects[n++] = g_display.bg_runs[i++].rect;
+        }
+        XSetForeground(g_display.display, g_display.gc, pixel);
+        XFillRectangles(g_display.display, g_display.back_buffer, g_display.gc, g_display.bg_rects, n);
+    }
+
+    g_display.bg_run_count = 0;
+    release_deferred_colors();
+}
+
+/*
+ * 行の区間の背景を、同じ色が続くセルをまとめて背景区間として積む（範囲のクリアも兼ねる）
+ * 全角文字の途中から始まる・途中で終わる区間は文字全体を含むように広げる。
+ * 行末まで届く区間はウィンドウ右端の余白を、最下行の区間は下端の余白もクリアする
+ */
+static void collect_row_background(int y, RowDamage *span, int scroll_offset)
+{
+    extern TerminalBuffer g_terminal;
+
     int char_width = font_get_char_width();
     int char_height = font_get_char_height();
 
-    int scroll_offset = terminal_get_scroll_offset();
+    /* 全角文字の途中で切れないように範囲を広げる */
+    Cell *first = get_display_cell(span->x0, y, scroll_offset);
+    if (span->x0 > 0 && first && first->ch == WIDE_CHAR_CONTINUATION) {
+        span->x0--;
+    }
+    Cell *next = get_display_cell(span->x1, y, scroll_offset);
+    if (next && next->ch == WIDE_CHAR_CONTINUATION) {
+        span->x1++;
+    }
+    int x0 = span->x0;
+    int x1 = span->x1;
 
-    /* パス1: 全ての背景を描画 */
-    for (int y = 0; y < g_terminal.rows; y++) {
-        for (int x = 0; x < g_terminal.cols; x++) {
-            Cell *cell = NULL;
-
-            /* スクロールオフセットを考慮してセルを取得 */
-            if (scroll_offset > 0) {
-                /* スクロールバックバッファから取得 */
-                int scrollback_line_idx = g_terminal.scrollback.count - scroll_offset + y;
-
-                if (scrollback_line_idx >= 0 && scrollback_line_idx < g_terminal.scrollback.count) {
-                    /* スクロールバックバッファから */
-                    ScrollbackLine *line = terminal_get_scrollback_line(scrollback_line_idx);
-                    if (line && line->cells && x < line->cols) {
-                        cell = &line->cells[x];
-                    }
-                } else if (scrollback_line_idx >= g_terminal.scrollback.count) {
-                    /* 通常バッファから */
-                    int buffer_y = scrollback_line_idx - g_terminal.scrollback.count;
-                    if (buffer_y >= 0 && buffer_y < g_terminal.rows) {
-                        cell = terminal_get_cell(x, buffer_y);
-                    }
-                }
-            } else {
-                /* スクロールオフセットなし：通常バッファから */
-                cell = terminal_get_cell(x, y);
-            }
+    int py = y * char_height;
+    unsigned long clear_pixel = BlackPixel(g_display.display, g_display.screen);
+    unsigned long run_pixel = clear_pixel;
+    int run_start = x0;
 
-            if (!cell) {
-                continue;
-            }
+    for (int x = x0; x < x1; x++) {
+        /* 背景を塗らないセルはウィンドウの背景と同じ黒でクリアする */
+        unsigned long pixel = clear_pixel;
 
-            /* 描画位置を計算 */
-            int px = x * char_width;
-            int py = y * char_height;
+        Cell *cell = get_display_cell(x, y, scroll_offset);
+        if (cell) {
+            const CellAttr *attr = terminal_cell_attr(cell);
 
             /* 色を取得（256色対応） */
-            uint8_t fg_idx = cell->attr.fg_color;
-            uint8_t bg_idx = cell->attr.bg_color;
+            uint8_t fg_idx = attr->fg_color;
+            uint8_t bg_idx = attr->bg_color;
 
-            /* 選択範囲のハイライト */
+            /* 選択範囲と検索の一致のハイライト（現在の一致は選択範囲と同じ色） */
             bool is_selected = terminal_is_selected(x, y);
+            uint8_t mark = get_search_mark(x, y);
 
             /* 反転属性を適用 */
-            if (cell->attr.flags & ATTR_REVERSE) {
+            if (attr->flags & ATTR_REVERSE) {
                 uint8_t tmp = fg_idx;
                 fg_idx = bg_idx;
                 bg_idx = tmp;
             }
 
-            /* 背景色を決定 */
-            XftColor *bg_color = NULL;
-            XftColor temp_bg_color;  /* Truecolorモード用の一時カラー */
-
-            if (is_selected) {
-                /* 選択範囲は設定色を使用 */
-                bg_color = &g_display.xft_sel_bg;
-            } else {
-                /* 背景色を決定 */
-                if (cell->attr.flags & ATTR_BG_TRUECOLOR) {
+            /* 選択範囲、または背景色がデフォルト以外、またはTruecolor背景、またはカスタム背景色が設定されている場合に描画 */
+            if (is_selected || mark != SEARCH_MARK_NONE || bg_idx != 0 ||
+                (attr->flags & ATTR_BG_TRUECOLOR) || g_color_options.background != NULL) {
+                XftColor temp_bg_color;  /* Truecolorモード用の一時カラー */
+
+                if (is_selected || mark == SEARCH_MARK_CURRENT) {
+                    /* 選択範囲は設定色を使用 */
+                    pixel = g_display.xft_sel_bg.pixel;
+                } else if (mark == SEARCH_MARK_MATCH) {
+                    pixel = g_display.xft_match_bg.pixel;
+                } else if (attr->flags & ATTR_BG_TRUECOLOR) {
                     /* Truecolor背景色 */
-                    get_rgb_color(cell->attr.bg_rgb, &temp_bg_color);
-                    bg_color = &temp_bg_color;
+                    get_rgb_color(attr->bg_rgb, &temp_bg_color);
+                    pixel = temp_bg_color.pixel;
                 } else if (bg_idx == 0) {
                     /* デフォルト黒はカスタム色を使用 */
-                    bg_color = &g_display.xft_bg;
+                    pixel = g_display.xft_bg.pixel;
                 } else {
                     /* 256色パレット */
-                    bg_color = get_color(bg_idx);
+                    pixel = get_color(bg_idx)->pixel;
                 }
             }
+        }
 
-            /* 背景色を描画 */
-            /* 選択範囲、または背景色がデフォルト以外、またはTruecolor背景、またはカスタム背景色が設定されている場合に描画 */
-            if (is_selected || bg_idx != 0 || (cell->attr.flags & ATTR_BG_TRUECOLOR) || g_color_options.background != NULL) {
-                XSetForeground(g_display.display, g_display.gc, bg_color->pixel);
-                XFillRectangle(g_display.display, g_display.window, g_display.gc,
-                              px, py, char_width, char_height);
+        /* 色が変わったら、それまでの区間を積む */
+        if (pixel != run_pixel) {
+            if (x > run_start) {
+                add_background_run(run_pixel, run_start * char_width, py,
+                                   (x - run_start) * char_width, char_height);
             }
+            run_pixel = pixel;
+            run_start = x;
         }
     }
 
-    /* パス2: 全ての文字を描画 */
-    for (int y = 0; y < g_terminal.rows; y++) {
-        for (int x = 0; x < g_terminal.cols; x++) {
-            Cell *cell = NULL;
-
-            /* スクロールオフセットを考慮してセルを取得 */
-            if (scroll_offset > 0) {
-                /* スクロールバックバッファから取得 */
-                int scrollback_line_idx = g_terminal.scrollback.count - scroll_offset + y;
-
-                if (scrollback_line_idx >= 0 && scrollback_line_idx < g_terminal.scrollback.count) {
-                    /* スクロールバックバッファから */
-                    ScrollbackLine *line = terminal_get_scrollback_line(scrollback_line_idx);
-                    if (line && line->cells && x < line->cols) {
-                        cell = &line->cells[x];
-                    }
-                } else if (scrollback_line_idx >= g_terminal.scrollback.count) {
-                    /* 通常バッファから */
-                    int buffer_y = scrollback_line_idx - g_terminal.scrollback.count;
-                    if (buffer_y >= 0 && buffer_y < g_terminal.rows) {
-                        cell = terminal_get_cell(x, buffer_y);
-                    }
-                }
-            } else {
-                /* スクロールオフセットなし：通常バッファから */
-                cell = terminal_get_cell(x, y);
-            }
+    if (x1 > run_start) {
+        add_background_run(run_pixel, run_start * char_width, py,
+                           (x1 - run_start) * char_width, char_height);
+    }
 
-            if (!cell) {
-                continue;
-            }
+    /* 余白には全幅アンダーラインや端で切れた画像カーソルの跡が残るので、黒でクリアする */
+    int px_end = x1 * char_width;
+    if (x1 >= g_terminal.cols) {
+        if (g_display.back_width > px_end) {
+            add_background_run(clear_pixel, px_end, py, g_display.back_width - px_end, char_height);
+        }
+        px_end = g_display.back_width;
+    }
+    int bottom = py + char_height;
+    if (y == g_terminal.rows - 1 && g_display.back_height > bottom) {
+        add_background_run(clear_pixel, x0 * char_width, bottom, px_end - x0 * char_width,
+                           g_display.back_height - bottom);
+    }
+}
 
-            /* WIDE_CHAR_CONTINUATIONは文字描画をスキップ（全角文字の2セル目） */
-            if (cell->ch == WIDE_CHAR_CONTINUATION) {
-                continue;
-            }
+/* 行の区間の文字と下線をバックバッファに描く（背景は塗り終わっていること） */
+static void render_row_glyphs(int y, const RowDamage *span, int scroll_offset)
+{
+    extern FontState g_font;
 
-            /* 描画位置を計算 */
-            int px = x * char_width;
-            int py = y * char_height;
+    int char_width = font_get_char_width();
+    int char_height = font_get_char_height();
+    int x0 = span->x0;
+    int x1 = span->x1;
+    int py = y * char_height;
+
+    /* 同じ前景色が続く区間のグリフをまとめて1回で送る */
+    XftGlyphFontSpec *specs = g_display.glyph_specs;
+    XSegment *segs = g_display.underline_segs;
+    int nspecs = 0;
+    int nsegs = 0;
+    XftColor run_color;
+
+    for (int x = x0; x < x1; x++) {
+        Cell *cell = get_display_cell(x, y, scroll_offset);
+        if (!cell) {
+            continue;
+        }
+        const CellAttr *attr = terminal_cell_attr(cell);
 
-            /* 色を取得（256色対応） */
-            uint8_t fg_idx = cell->attr.fg_color;
-            uint8_t bg_idx = cell->attr.bg_color;
+        /* WIDE_CHAR_CONTINUATIONは文字描画をスキップ（全角文字の2セル目） */
+        if (cell->ch == WIDE_CHAR_CONTINUATION) {
+            continue;
+        }
 
-            /* 選択範囲のハイライト */
-            bool is_selected = terminal_is_selected(x, y);
+        /* 空白は何も描かない */
+        if (cell->ch == ' ' || cell->ch == 0) {
+            continue;
+        }
 
-            /* 反転属性を適用 */
-            if (cell->attr.flags & ATTR_REVERSE) {
-                uint8_t tmp = fg_idx;
-                fg_idx = bg_idx;
-                bg_idx = tmp;
-            }
+        /* 描画位置を計算 */
+        int px = x * char_width;
 
-            /* 前景色を決定 */
-            XftColor *fg_color = NULL;
-            XftColor temp_fg_color;  /* Truecolorモード用の一時カラー */
+        /* 色を取得（256色対応） */
+        uint8_t fg_idx = attr->fg_color;
+        uint8_t bg_idx = attr->bg_color;
+
+        /* 選択範囲と検索の一致のハイライト */
+        bool is_selected = terminal_is_selected(x, y);
+        uint8_t mark = get_search_mark(x, y);
+
+        /* 反転属性を適用 */
+        if (attr->flags & ATTR_REVERSE) {
+            uint8_t tmp = fg_idx;
+            fg_idx = bg_idx;
+            bg_idx = tmp;
+        }
+
+        /* 前景色を決定 */
+        XftColor *fg_color = NULL;
+        XftColor temp_fg_color;  /* Truecolorモード用の一時カラー */
 
-            if (is_selected) {
-                /* 選択範囲は設定色を使用 */
-                fg_color = &g_display.xft_sel_fg;
+        if (is_selected || mark == SEARCH_MARK_CURRENT) {
+            /* 選択範囲は設定色を使用 */
+            fg_color = &g_display.xft_sel_fg;
+        } else if (mark == SEARCH_MARK_MATCH) {
+            fg_color = &g_display.xft_match_fg;
+        } else {
+            /* 前景色を決定 */
+            if (attr->flags & ATTR_FG_TRUECOLOR) {
+                /* Truecolor前景色 */
+                get_rgb_color(attr->fg_rgb, &temp_fg_color);
+                fg_color = &temp_fg_color;
+            } else if (fg_idx == 7) {
+                /* デフォルト白はカスタム色を使用 */
+                fg_color = &g_display.xft_fg;
             } else {
-                /* 前景色を決定 */
-                if (cell->attr.flags & ATTR_FG_TRUECOLOR) {
-                    /* Truecolor前景色 */
-                    get_rgb_color(cell->attr.fg_rgb, &temp_fg_color);
-                    fg_color = &temp_fg_color;
-                } else if (fg_idx == 7) {
-                    /* デフォルト白はカスタム色を使用 */
-                    fg_color = &g_display.xft_fg;
-                } else {
-                    /* 256色パレット */
-                    fg_color = get_color(fg_idx);
-                }
+                /* 256色パレット */
+                fg_color = get_color(fg_idx);
             }
+        }
 
-            /* 文字を描画 */
-            if (cell->ch != ' ' && cell->ch != 0) {
-                char utf8[5];
-                int len;
-
-                /* Unicode を UTF-8 に変換 */
-                len = utf8_encode(cell->ch, utf8);
-                utf8[len] = '\0';
-
-                /* 文字を描画 */
-                XftDrawStringUtf8(g_display.xft_draw, fg_color,
-                                 g_font.xft_font, px, py + g_font.ascent,
-                                 (FcChar8 *)utf8, len);
-
-                /* 下線を描画 */
-                if (cell->attr.flags & ATTR_UNDERLINE) {
-                    int uy = py + g_font.ascent + 1;
-                    XSetForeground(g_display.display, g_display.gc, fg_color->pixel);
-                    XDrawLine(g_display.display, g_display.window, g_display.gc,
-                             px, uy, px + char_width - 1, uy);
-                }
+        /* 色が変わったら、それまでの区間を送る */
+        if ((nspecs > 0 || nsegs > 0) && !xft_color_equal(&run_color, fg_color)) {
+            flush_glyph_run(&run_color, specs, nspecs, segs, nsegs);
+            nspecs = 0;
+            nsegs = 0;
+        }
+        run_color = *fg_color;
+
+        /* グリフ番号を引いて区間に積む（結合文字は基底文字と同じ位置に重ねる） */
+        uint32_t cps[COMBINING_MAX_CODEPOINTS];
+        int ncps = combining_expand(cell->ch, cps);
+        for (int k = 0; k < ncps; k++) {
+            specs[nspecs].font = g_font.xft_font;
+            specs[nspecs].glyph = XftCharIndex(g_display.display, g_font.xft_font, cps[k]);
+            specs[nspecs].x = px;
+            specs[nspecs].y = py + g_font.ascent;
+            nspecs++;
+        }
+
+        /* 下線を積む（直前のセルの下線と隣接していれば延ばす） */
+        if (attr->flags & ATTR_UNDERLINE) {
+            int uy = py + g_font.ascent + 1;
+            if (nsegs > 0 && segs[nsegs - 1].x2 == px - 1) {
+                segs[nsegs - 1].x2 = px + char_width - 1;
+            } else {
+                segs[nsegs].x1 = px;
+                segs[nsegs].y1 = uy;
+                segs[nsegs].x2 = px + char_width - 1;
+                segs[nsegs].y2 = uy;
+                nsegs++;
             }
         }
     }
 
+    if (nspecs > 0 || nsegs > 0) {
+        flush_glyph_run(&run_color, specs, nspecs, segs, nsegs);
+    }
+}
+
+/* カーソル（と全幅アンダーライン）が覆うセル範囲を求める。描画しない場合false */
+static bool cursor_cell_bounds(const DrawnCursor *cursor, int *x0, int *y0, int *x1, int *y1)
+{
+    extern TerminalBuffer g_terminal;
+
+    if (!cursor->visible && !g_display_options.show_underline) {
+        return false;
+    }
+
+    *x0 = cursor->x;
+    *x1 = cursor->x + 1;
+    *y0 = cursor->y;
+    *y1 = cursor->y + 1;
+
+    if (g_display_options.show_underline) {
+        /* 全幅アンダーラインは行全体にかかる */
+        *x0 = 0;
+        *x1 = g_terminal.cols;
+    }
+
+    if (cursor->visible && g_display_options.cursor_shape == TERM_CURSOR_IMAGE && cursor->pixmap) {
+        /* 画像カーソルはオフセットと画像サイズの分だけはみ出す */
+        int char_width = font_get_char_width();
+        int char_height = font_get_char_height();
+        int img_x = cursor->x * char_width + g_display_options.cursor_offset_x;
+        int img_y = cursor->y * char_height + char_height - g_display.cursor_image_height +
+                    g_display_options.cursor_offset_y;
+        int ix0 = img_x / char_width;
+        int iy0 = img_y / char_height;
+        int ix1 = (img_x + g_display.cursor_image_width + char_width - 1) / char_width;
+        int iy1 = (img_y + g_display.cursor_image_height + char_height - 1) / char_height;
+        if (ix0 < *x0) *x0 = ix0;
+        if (iy0 < *y0) *y0 = iy0;
+        if (ix1 > *x1) *x1 = ix1;
+        if (iy1 > *y1) *y1 = iy1;
+    }
+
+    /* 画面内に収める */
+    if (*x0 < 0) *x0 = 0;
+    if (*y0 < 0) *y0 = 0;
+    if (*x1 > g_terminal.cols) *x1 = g_terminal.cols;
+    if (*y1 > g_terminal.rows) *y1 = g_terminal.rows;
+    return *x0 < *x1 && *y0 < *y1;
+}
+
+/* カーソルが覆うセル範囲を描画し直す範囲に加える */
+static void add_cursor_damage(const DrawnCursor *cursor, RowDamage *spans)
+{
+    int x0, y0, x1, y1;
+    if (!cursor_cell_bounds(cursor, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    for (int y = y0; y < y1; y++) {
+        if (x0 < spans[y].x0) spans[y].x0 = x0;
+        if (x1 > spans[y].x1) spans[y].x1 = x1;
+    }
+}
+
+/* スクロールで画素と一緒に動いた前回のカーソルを、描画し直す範囲に加える */
+static void add_scrolled_cursor_damage(const DrawnCursor *cursor, int top, int bottom, int lines,
+                                       RowDamage *spans)
+{
+    int x0, y0, x1, y1;
+    if (!cursor_cell_bounds(cursor, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    for (int y = y0; y < y1; y++) {
+        int dst = y - lines;
+        if (y < top || y > bottom || dst < top || dst > bottom) {
+            continue;
+        }
+        if (x0 < spans[dst].x0) spans[dst].x0 = x0;
+        if (x1 > spans[dst].x1) spans[dst].x1 = x1;
+    }
+}
+
+/* バックバッファの行 [top, bottom] の画素をlines行ずらす（正で上、負で下） */
+static void scroll_back_buffer(int top, int bottom, int lines)
+{
+    int char_height = font_get_char_height();
+    int src_row = (lines > 0) ? top + lines : top;
+    int dst_row = (lines > 0) ? top : top - lines;
+    int rows = bottom - top + 1 - abs(lines);
+
+    /* 右端の余白（全幅アンダーラインの跡など）も行と一緒にずらす */
+    XCopyArea(g_display.display, g_display.back_buffer, g_display.back_buffer, g_display.gc,
+              0, src_row * char_height, g_display.back_width, rows * char_height,
+              0, dst_row * char_height);
+}
+
+/* 全幅アンダーラインとカーソルを描画する */
+static void draw_cursor(const DrawnCursor *cursor)
+{
+    int char_width = font_get_char_width();
+    int char_height = font_get_char_height();
+
     /* 全幅アンダーラインを描画 */
-    if (g_display_options.show_underline && g_terminal.cursor_y >= 0 && g_terminal.cursor_y < g_terminal.rows) {
-        int uly = g_terminal.cursor_y * char_height + char_height - 1;
+    if (g_display_options.show_underline) {
+        int uly = cursor->y * char_height + char_height - 1;
         XSetForeground(g_display.display, g_display.gc, g_display.xft_underline.pixel);
-        XDrawLine(g_display.display, g_display.window, g_display.gc,
+        XDrawLine(g_display.display, g_display.back_buffer, g_display.gc,
                  0, uly, g_display.width, uly);
     }
 
     /* カーソルを描画 */
-    if (g_terminal.cursor_visible) {
-        int cx = g_terminal.cursor_x * char_width;
-        int cy = g_terminal.cursor_y * char_height;
+    if (!cursor->visible) {
+        return;
+    }
 
-        XSetForeground(g_display.display, g_display.gc, g_display.xft_cursor.pixel);
+    int cx = cursor->x * char_width;
+    int cy = cursor->y * char_height;
+
+    XSetForeground(g_display.display, g_display.gc, g_display.xft_cursor.pixel);
+
+    switch (g_display_options.cursor_shape) {
+        case TERM_CURSOR_UNDERLINE:
+            /* 短いアンダーライン（文字セルの下部） */
+            XFillRectangle(g_display.display, g_display.back_buffer, g_display.gc,
+                          cx, cy + char_height - 2, char_width, 2);
+            break;
+
+        case TERM_CURSOR_BAR:
+            /* 左縦線 */
+            XFillRectangle(g_display.display, g_display.back_buffer, g_display.gc,
+                          cx, cy, 2, char_height);
+            break;
+
+        case TERM_CURSOR_HOLLOW_BLOCK:
+            /* 中抜き四角 */
+            XDrawRectangle(g_display.display, g_display.back_buffer, g_display.gc,
+                          cx, cy, char_width - 1, char_height - 1);
+            break;
+
+        case TERM_CURSOR_BLOCK:
+            /* 中埋め四角 */
+            XFillRectangle(g_display.display, g_display.back_buffer, g_display.gc,
+                          cx, cy, char_width, char_height);
+            break;
+
+        case TERM_CURSOR_IMAGE:
+            /* 画像カーソル */
+            if (cursor->pixmap) {
+                /* 画像描画位置を計算（左下基準でオフセット適用） */
+                int img_x = cx + g_display_options.cursor_offset_x;
+                int img_y = cy + char_height - g_display.cursor_image_height + g_display_options.cursor_offset_y;
+
+                if (cursor->mask) {
+                    /* マスクを使って透過描画 */
+                    XSetClipMask(g_display.display, g_display.gc, cursor->mask);
+                    XSetClipOrigin(g_display.display, g_display.gc, img_x, img_y);
+                }
 
-        switch (g_display_options.cursor_shape) {
-            case TERM_CURSOR_UNDERLINE:
-                /* 短いアンダーライン（文字セルの下部） */
-                XFillRectangle(g_display.display, g_display.window, g_display.gc,
-                              cx, cy + char_height - 2, char_width, 2);
-                break;
+                /* Pixmapをコピー */
+                XCopyArea(g_display.display, cursor->pixmap, g_display.back_buffer,
+                          g_display.gc, 0, 0, g_display.cursor_image_width,
+                          g_display.cursor_image_height, img_x, img_y);
 
-            case TERM_CURSOR_BAR:
-                /* 左縦線 */
-                XFillRectangle(g_display.display, g_display.window, g_display.gc,
-                              cx, cy, 2, char_height);
-                break;
+                if (cursor->mask) {
+                    /* クリップマスクをリセット */
+                    XSetClipMask(g_display.display, g_display.gc, None);
+                }
+            }
+            break;
+    }
+}
 
-            case TERM_CURSOR_HOLLOW_BLOCK:
-                /* 中抜き四角 */
-                XDrawRectangle(g_display.display, g_display.window, g_display.gc,
-                              cx, cy, char_width - 1, char_height - 1);
-                break;
+/* 描き直す行の検索の一致の印を求める（検索モード中でなければ印を使わない） */
+static void update_search_marks(const RowDamage *spans, int scroll_offset)
+{
+    extern TerminalBuffer g_terminal;
 
-            case TERM_CURSOR_BLOCK:
-                /* 中埋め四角 */
-                XFillRectangle(g_display.display, g_display.window, g_display.gc,
-                              cx, cy, char_width, char_height);
-                break;
+    g_display.search_marks_cols = 0;
+    if (!search_is_active()) {
+        return;
+    }
 
-            case TERM_CURSOR_IMAGE:
-                /* 画像カーソル */
-                if (g_display.cursor_pixmap) {
-                    /* 画像描画位置を計算（左下基準でオフセット適用） */
-                    int img_x = cx + g_display_options.cursor_offset_x;
-                    int img_y = cy + char_height - g_display.cursor_image_height + g_display_options.cursor_offset_y;
-
-                    if (g_display.cursor_mask) {
-                        /* マスクを使って透過描画 */
-                        XSetClipMask(g_display.display, g_display.gc, g_display.cursor_mask);
-                        XSetClipOrigin(g_display.display, g_display.gc, img_x, img_y);
-                    }
+    int size = g_terminal.rows * g_terminal.cols;
+    if (g_display.search_marks_size < size) {
+        uint8_t *marks = realloc(g_display.search_marks, size);
+        if (!marks) {
+            return;
+        }
+        g_display.search_marks = marks;
+        g_display.search_marks_size = size;
+    }
 
-                    /* Pixmapをコピー */
-                    XCopyArea(g_display.display, g_display.cursor_pixmap, g_display.window,
-                              g_display.gc, 0, 0, g_display.cursor_image_width,
-                              g_display.cursor_image_height, img_x, img_y);
+    /* 画面の行yの履歴の行インデックス（get_display_cellと同じ対応） */
+    int top = g_terminal.scrollback.count - (scroll_offset > 0 ? scroll_offset : 0);
+    for (int y = 0; y < g_terminal.rows; y++) {
+        if (spans[y].x0 < spans[y].x1) {
+            search_mark_line(top + y, &g_display.search_marks[y * g_terminal.cols], g_terminal.cols);
+        }
+    }
+    g_display.search_marks_cols = g_terminal.cols;
+}
 
-                    if (g_display.cursor_mask) {
-                        /* クリップマスクをリセット */
-                        XSetClipMask(g_display.display, g_display.gc, None);
-                    }
-                }
-                break;
+/* 最下行に検索文字列の入力欄を描く（画面の内容の上に重ねる） */
+static void draw_search_prompt(void)
+{
+    extern FontState g_font;
+    extern TerminalBuffer g_terminal;
+
+    const char *label = search_is_regex() ? "正規表現: " : "検索: ";
+    char status[64];
+    search_get_status(status, sizeof(status));
+
+    int char_height = font_get_char_height();
+    int width = g_terminal.cols * font_get_char_width();
+    int py = (g_terminal.rows - 1) * char_height;
+    int baseline = py + g_font.ascent;
+
+    /* 入力欄は端末の桁の範囲に収める（右端の余白に色や文字がはみ出すと検索終了後も残るため） */
+    XRectangle clip = { 0, py, width, char_height };
+    XftDrawSetClipRectangles(g_display.xft_draw, 0, 0, &clip, 1);
+    XftDrawRect(g_display.xft_draw, &g_display.xft_sel_bg, 0, py, width, char_height);
+
+    XGlyphInfo extents;
+    int px = 0;
+    XftDrawStringUtf8(g_display.xft_draw, &g_display.xft_sel_fg, g_font.xft_font, px, baseline,
+                      (const FcChar8 *)label, strlen(label));
+    XftTextExtentsUtf8(g_display.display, g_font.xft_font, (const FcChar8 *)label, strlen(label), &extents);
+    px += extents.xOff;
+
+    int len;
+    const uint32_t *query = search_get_query(&len);
+    if (len > 0) {
+        XftDrawString32(g_display.xft_draw, &g_display.xft_sel_fg, g_font.xft_font, px, baseline,
+                        (const FcChar32 *)query, len);
+        XftTextExtents32(g_display.display, g_font.xft_font, (const FcChar32 *)query, len, &extents);
+        px += extents.xOff;
+    }
+
+    if (status[0]) {
+        XftDrawStringUtf8(g_display.xft_draw, &g_display.xft_sel_fg, g_font.xft_font, px, baseline,
+                          (const FcChar8 *)status, strlen(status));
+    }
+    XftDrawSetClip(g_display.xft_draw, None);
+}
+
+/**
+ * ターミナルバッファの内容を描画する
+ */
+void display_render_terminal(void)
+{
+    if (!g_display.display || !g_display.xft_draw) {
+        return;
+    }
+
+    extern FontState g_font;
+    extern TerminalBuffer g_terminal;
+
+    if (!g_font.xft_font) {
+        return;
+    }
+
+    int scroll_offset = terminal_get_scroll_offset();
+
+    /* 今回描画するカーソルの状態 */
+    DrawnCursor cursor = {
+        .x = g_terminal.cursor_x,
+        .y = g_terminal.cursor_y,
+        .visible = g_terminal.cursor_visible,
+        .pixmap = g_display.cursor_pixmap,
+        .mask = g_display.cursor_mask,
+    };
+    bool cursor_changed = !g_display.last_cursor_valid ||
+                          cursor.x != g_display.last_cursor.x ||
+                          cursor.y != g_display.last_cursor.y ||
+                          cursor.visible != g_display.last_cursor.visible ||
+                          cursor.pixmap != g_display.last_cursor.pixmap;
+
+    if (!terminal_is_dirty() && !cursor_changed) {
+        return;  /* 変更なし */
+    }
+
+    bool searching = search_is_active();
+    if ((scroll_offset > 0 || searching) && terminal_is_dirty()) {
+        /* ダメージは画面の行で記録されているので、履歴表示中は全体を描き直す。
+         * 検索モード中は最下行の入力欄を画素ごとずらさないように全体を描き直す */
+        terminal_mark_all_dirty();
+    }
+
+    /* 描画範囲を集める（端末のダメージ + 前回と今回のカーソル位置） */
+    if (g_display.damage_rows < g_terminal.rows) {
+        RowDamage *spans = realloc(g_display.damage, g_terminal.rows * sizeof(RowDamage));
+        if (!spans) {
+            return;
+        }
+        g_display.damage = spans;
+        g_display.damage_rows = g_terminal.rows;
+    }
+    if (g_display.glyph_capacity < g_terminal.cols) {
+        /* グリフは1セルに結合文字を含めて最大COMBINING_MAX_CODEPOINTS個 */
+        XftGlyphFontSpec *specs = realloc(g_display.glyph_specs,
+                                          g_terminal.cols * COMBINING_MAX_CODEPOINTS * sizeof(XftGlyphFontSpec));
+        if (specs) {
+            g_display.glyph_specs = specs;
+        }
+        XSegment *segs = realloc(g_display.underline_segs, g_terminal.cols * sizeof(XSegment));
+        if (segs) {
+            g_display.underline_segs = segs;
+        }
+        if (!specs || !segs) {
+            return;
+        }
+        g_display.glyph_capacity = g_terminal.cols;
+    }
+    RowDamage *spans = g_display.damage;
+    for (int y = 0; y < g_terminal.rows; y++) {
+        if (!terminal_get_row_damage(y, &spans[y].x0, &spans[y].x1)) {
+            spans[y].x0 = g_terminal.cols;
+            spans[y].x1 = 0;
+        }
+    }
+    if (g_display.last_cursor_valid) {
+        add_cursor_damage(&g_display.last_cursor, spans);
+    }
+    add_cursor_damage(&cursor, spans);
+    if (searching) {
+        /* 入力欄は毎回描き直す */
+        spans[g_terminal.rows - 1].x0 = 0;
+        spans[g_terminal.rows - 1].x1 = g_terminal.cols;
+    }
+    update_search_marks(spans, scroll_offset);
+
+    /* スクロールした範囲は前のフレームの画素をずらして使う（空いた行は変更範囲に入っている） */
+    int scroll_top = 0, scroll_bottom = -1, scroll_lines = 0;
+    bool scrolled = scroll_offset == 0 &&
+                    terminal_get_scroll_damage(&scroll_top, &scroll_bottom, &scroll_lines);
+    if (scrolled) {
+        scroll_back_buffer(scroll_top, scroll_bottom, scroll_lines);
+        if (g_display.last_cursor_valid) {
+            add_scrolled_cursor_damage(&g_display.last_cursor, scroll_top, scroll_bottom, scroll_lines, spans);
+        }
+    }
+
+    /* パス1: 全範囲の背景を集めて色ごとにまとめて塗る */
+    for (int y = 0; y < g_terminal.rows; y++) {
+        if (spans[y].x0 < spans[y].x1) {
+            collect_row_background(y, &spans[y], scroll_offset);
         }
     }
+    flush_background_runs();
+
+    /* パス2: 文字を描画 */
+    for (int y = 0; y < g_terminal.rows; y++) {
+        if (spans[y].x0 < spans[y].x1) {
+            render_row_glyphs(y, &spans[y], scroll_offset);
+        }
+    }
+
+    draw_cursor(&cursor);
+    g_display.last_cursor = cursor;
+    g_display.last_cursor_valid = true;
+    if (searching) {
+        draw_search_prompt();
+    }
+
+    /* 描き直した範囲だけをウィンドウへ転送（同じ範囲が続く行はまとめて1回で）。
+     * スクロールした範囲は画素が全体に動いたので丸ごと転送する */
+    int char_width = font_get_char_width();
+    int char_height = font_get_char_height();
+    if (scrolled) {
+        present_area(0, scroll_top * char_height, g_display.back_width,
+                     (scroll_bottom - scroll_top + 1) * char_height);
+    }
+    for (int y = 0; y < g_terminal.rows; ) {
+        if (spans[y].x0 >= spans[y].x1 || (y >= scroll_top && y <= scroll_bottom)) {
+            y++;
+            continue;
+        }
+        int y_end = y + 1;
+        while (y_end < g_terminal.rows && !(y_end >= scroll_top && y_end <= scroll_bottom) &&
+               spans[y_end].x0 == spans[y].x0 && spans[y_end].x1 == spans[y].x1) {
+            y_end++;
+        }
+        int px = spans[y].x0 * char_width;
+        /* 行末まで届く範囲はウィンドウ右端の余白（全幅アンダーライン）も含める */
+        int px_end = (spans[y].x1 >= g_terminal.cols) ? g_display.back_width : spans[y].x1 * char_width;
+        /* 最下行を含む範囲はウィンドウ下端の余白も含める */
+        int height = (y_end == g_terminal.rows) ? g_display.back_height - y * char_height
+                                                 : (y_end - y) * char_height;
+        present_area(px, y * char_height, px_end - px, height);
+        y = y_end;
+    }
+
+    terminal_reset_damage();
+}
+
+/**
+ * 定期的な再描画が必要か（アニメーションGIFカーソルを表示中か）を返す
+ */
+bool display_is_animating(void)
+{
+    extern TerminalBuffer g_terminal;
+    return g_display.cursor_gif_frames && g_display.cursor_gif_frame_count > 1 &&
+           g_display_options.cursor_shape == TERM_CURSOR_IMAGE && g_terminal.cursor_visible;
 }
 
 /**
@@ -7,6 +7,21 @@
 #include <Imlib2.h>
 #include <stdbool.h>
 #include <time.h>
+#include "terminal.h"
+
+/* 描画済みのカーソルの状態（次の描画で消す位置を知るため） */
+typedef struct {
+    int x, y;                /* カーソル位置 */
+    bool visible;            /* 表示していたか */
+    Pixmap pixmap;           /* 画像カーソルのフレーム */
+    Pixmap mask;             /* 画像カーソルのマスク */
+} DrawnCursor;
+
+/* 背景の塗りつぶし区間（同じ色のセルが横に続く範囲） */
+typedef struct {
+    unsigned long pixel;     /* 塗る色 */
+    XRectangle rect;         /* 塗る矩形（ピクセル座標） */
+} BackgroundRun;
 
 /* ディスプレイ状態 */
 typedef struct {
@@ -18,12 +33,17 @@ typedef struct {
     int height;              /* ウィンドウ高さ */
     Atom wm_delete_window;   /* ウィンドウ削除メッセージ */
     Atom clipboard_atom;     /* CLIPBOARDアトム */
-    XftDraw *xft_draw;       /* Xft描画コンテキスト */
+    XftDraw *xft_draw;       /* Xft描画コンテキスト（バックバッファに描く） */
+    Pixmap back_buffer;      /* バックバッファ（前回のフレームを保持し、変更範囲だけウィンドウへ転送する） */
+    int back_width;          /* バックバッファの幅 */
+    int back_height;         /* バックバッファの高さ */
     XftColor xft_fg;         /* 前景色 */
     XftColor xft_bg;         /* 背景色 */
     XftColor xft_cursor;     /* カーソル色 */
     XftColor xft_sel_bg;     /* 選択背景色 */
     XftColor xft_sel_fg;     /* 選択前景色 */
+    XftColor xft_match_bg;   /* 検索の一致の背景色 */
+    XftColor xft_match_fg;   /* 検索の一致の前景色 */
     XftColor xft_underline;  /* アンダーライン色 */
     XIM xim;                 /* Input Method */
     XIC xic;                 /* Input Context */
@@ -39,6 +59,22 @@ typedef struct {
     int cursor_gif_frame_count;      /* フレーム数 */
     int cursor_gif_current_frame;    /* 現在のフレームインデックス */
     struct timespec cursor_gif_last_update;  /* 最後のフレーム更新時刻 */
+    /* 差分描画用 */
+    DrawnCursor last_cursor;         /* 前回描画したカーソル */
+    bool last_cursor_valid;          /* last_cursorが画面に描かれているか */
+    RowDamage *damage;               /* 描画範囲の作業用配列 */
+    int damage_rows;                 /* damageの要素数 */
+    XftGlyphFontSpec *glyph_specs;   /* 1行分のグリフをまとめて送る作業用配列 */
+    XSegment *underline_segs;        /* 1行分の下線をまとめて引く作業用配列 */
+    int glyph_capacity;              /* glyph_specs/underline_segsの要素数 */
+    BackgroundRun *bg_runs;          /* 1フレーム分の背景区間（色ごとにまとめて塗る） */
+    XRectangle *bg_rects;            /* XFillRectanglesに渡す作業用配列 */
+    int bg_run_count;                /* bg_runsの使用数 */
+    int bg_run_capacity;             /* bg_runs/bg_rectsの要素数 */
+    /* 検索の強調表示用 */
+    uint8_t *search_marks;           /* 描き直す行のセルごとの一致の印（SEARCH_MARK_*、rows×cols） */
+    int search_marks_size;           /* search_marksの要素数 */
+    int search_marks_cols;           /* search_marksの1行の要素数（検索モード中でなければ0） */
 } DisplayState;
 
 /* グローバルディスプレイ状態 */
@@ -69,7 +105,7 @@ void display_cleanup(void);
 bool display_handle_events(void);
 
 /**
- * 画面をクリアする
+ * 画面をクリアする（バックバッファを背景色で塗りつぶしてウィンドウへ転送し、次の描画で全体を描き直す）
  */
 void display_clear(void);
 
@@ -80,9 +116,17 @@ void display_flush(void);
 
 /**
  * ターミナルバッファの内容を描画する
+ * 前回の描画以降に変更された範囲とカーソルの移動前後の位置だけを描き直し、
+ * 変更がなければ何もしない
  */
 void display_render_terminal(void);
 
+/**
+ * 定期的な再描画が必要か（アニメーションGIFカーソルを表示中か）を返す
+ * @return 必要ならtrue
+ */
+bool display_is_animating(void);
+
 /**
  * GIFアニメーションカーソルを更新する
  * メインループから定期的に呼び出される
@@ -7,19 +7,88 @@
 #include "display.h"
 #include "koteiterm.h"
 #include "terminal.h"
+#include "search.h"
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/Xutil.h>
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * 検索のキーを処理する（Ctrl+Shift+Fで検索モードの開始・終了、検索モード中はキーを検索に使う）
+ * textは入力された文字列（なければNULL）。処理した場合true
+ */
+static bool handle_search_key(XKeyEvent *event, KeySym keysym, const char *text, int len)
+{
+    if ((event->state & ControlMask) && (event->state & ShiftMask) &&
+        (keysym == XK_F || keysym == XK_f)) {
+        if (search_is_active()) {
+            search_end();
+        } else {
+            search_begin();
+        }
+        return true;
+    }
+
+    if (!search_is_active()) {
+        return false;
+    }
+
+    /* Ctrl+R: 正規表現モードの切り替え */
+    if ((event->state & ControlMask) && (keysym == XK_r || keysym == XK_R)) {
+        search_toggle_regex();
+        return true;
+    }
+
+    switch (keysym) {
+        case XK_Return:
+        case XK_KP_Enter:
+            /* Enter: 古い方の一致、Shift+Enter: 新しい方の一致 */
+            search_next((event->state & ShiftMask) ? SEARCH_NEWER : SEARCH_OLDER);
+            return true;
+
+        case XK_Up:
+        case XK_KP_Up:
+            search_next(SEARCH_OLDER);
+            return true;
+
+        case XK_Down:
+        case XK_KP_Down:
+            search_next(SEARCH_NEWER);
+            return true;
+
+        case XK_BackSpace:
+            search_backspace();
+            return true;
+
+        case XK_Escape:
+            search_end();
+            return true;
+
+        case XK_Page_Up:
+        case XK_KP_Page_Up:
+        case XK_Page_Down:
+        case XK_KP_Page_Down:
+            /* Shift+PageUp/PageDownのスクロールは検索中も使える */
+            return !(event->state & ShiftMask);
+
+        default:
+            /* 制御文字以外の文字を検索文字列に加える（それ以外のキーは端末に送らない） */
+            if (text && len > 0 && !(event->state & ControlMask) &&
+                (unsigned char)text[0] >= 0x20 && text[0] != 0x7F) {
+                search_input(text, len);
+            }
+            return true;
+    }
+}
+
 /**
  * キーイベントを処理する
  */
 bool input_handle_key(XKeyEvent *event)
 {
     char buf[32];
-    KeySym keysym;
+    KeySym keysym = NoSymbol;
     int len;
     Status status;
 
@@ -51,7 +120,15 @@ bool input_handle_key(XKeyEvent *event)
             return false;
         }
 
-        if (status == XLookupChars || status == XLookupBoth) {
+        bool has_chars = (status == XLookupChars || status == XLookupBoth) && len > 0;
+        if (status == XLookupChars) {
+            keysym = NoSymbol;  /* 文字だけが返された場合keysymは不定 */
+        }
+        if (handle_search_key(event, keysym, has_chars ? buf : NULL, has_chars ? len : 0)) {
+            return true;
+        }
+
+        if (has_chars) {
             /* 文字が入力された */
             if (len > 0) {
                 buf[len] = '\0';
@@ -68,6 +145,10 @@ bool input_handle_key(XKeyEvent *event)
         /* XICがない場合は従来のXLookupStringを使用 */
         len = XLookupString(event, buf, sizeof(buf) - 1, &keysym, NULL);
 
+        if (handle_search_key(event, keysym, len > 0 ? buf : NULL, len)) {
+            return true;
+        }
+
         if (len > 0) {
             /* 通常の文字入力 */
             buf[len] = '\0';
@@ -51,6 +51,13 @@ DisplayOptions g_display_options = {
     .cursor_scale = 1.0
 };
 
+/* スクロールバックオプション設定 */
+ScrollbackOptions g_scrollback_options = {
+    .lines = DEFAULT_SCROLLBACK,
+    .spill = true,
+    .bytes = 0
+};
+
 /* シグナルハンドラ */
 static void signal_handler(int sig)
 {
@@ -108,12 +115,15 @@ static int init(void)
     }
 
     /* ターミナルバッファの初期化 */
-    if (terminal_init(g_term.rows, g_term.cols) != 0) {
+    if (terminal_init(g_term.rows, g_term.cols, g_scrollback_options.lines, g_scrollback_options.spill) != 0) {
         fprintf(stderr, "ターミナルバッファの初期化に失敗しました\n");
         font_cleanup(g_display.display);
         display_cleanup();
         return -1;
     }
+    if (g_scrollback_options.bytes > 0) {
+        terminal_set_scrollback_limit(g_scrollback_options.bytes);
+    }
 
     /* PTYの初期化とシェル起動 */
     if (pty_init(g_term.rows, g_term.cols) != 0) {
@@ -236,15 +246,34 @@ static void main_loop(bool stdin_enabled)
         FD_SET(pty_fd, &readfds);
         if (pty_fd > max_fd) max_fd = pty_fd;
 
+        /* 正規表現検索のワーカーの起床用fdを監視 */
+        int search_fd = search_wakeup_fd();
+        if (search_fd >= 0) {
+            FD_SET(search_fd, &readfds);
+            if (search_fd > max_fd) max_fd = search_fd;
+        }
+
         /* stdinのfdを監視（stdin入力モードの場合） */
         if (stdin_enabled) {
             FD_SET(STDIN_FILENO, &readfds);
             if (STDIN_FILENO > max_fd) max_fd = STDIN_FILENO;
         }
 
-        /* タイムアウト設定（約60 FPS） */
-        tv.tv_sec = 0;
-        tv.tv_usec = 16666;
+        /* タイムアウト設定 */
+        if (XPending(g_display.display) > 0 || search_is_scanning()) {
+            /* Xlibのキューに読み込み済みのイベントがあるか、検索の続きがあれば待たない */
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+        } else if (display_is_animating() || g_terminal.synchronized_update ||
+                   (stdin_enabled && g_stdin_buffer_pos < g_stdin_buffer_len)) {
+            /* アニメーション・同期出力の期限・stdinの送信待ちがあるときは約60 FPSで回す */
+            tv.tv_sec = 0;
+            tv.tv_usec = 16666;
+        } else {
+            /* 何も起きなければ描画することもないので、入力が来るまで待つ（子プロセスの確認のため上限あり） */
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        }
 
         int ret = select(max_fd + 1, &readfds, NULL, NULL, &tv);
         if (ret < 0) {
@@ -273,6 +302,11 @@ static void main_loop(bool stdin_enabled)
             }
         }
 
+        /* 固定文字列の検索の続きを調べ、正規表現検索の一致を受け取る（ワーカーは別スレッドで動くので待たない） */
+        if ((search_fd >= 0 && FD_ISSET(search_fd, &readfds)) || search_is_scanning()) {
+            search_poll();
+        }
+
         /* stdinからデータを読み取る */
         if (stdin_enabled && FD_ISSET(STDIN_FILENO, &readfds)) {
             /* バッファに空きがあれば読み取る */
@@ -426,10 +460,11 @@ static void main_loop(bool stdin_enabled)
         /* GIFアニメーションカーソルを更新 */
         display_update_gif_cursor();
 
-        /* 描画処理 */
-        display_clear();
-        display_render_terminal();
-        display_flush();
+        /* 描画処理（変更された範囲だけ。同期出力中は前回のフレームを表示したまま保留） */
+        if (!terminal_is_synchronized_update()) {
+            display_render_terminal();
+            display_flush();
+        }
     }
 }
 
@@ -472,9 +507,16 @@ static void print_usage(const char *prog_name)
     printf("    scale: スケール  （0.0-1.0、 デフォルト1.0）\n");
     printf("  --underline      行全体にアンダーラインを表示\n");
     printf("\n");
+    printf("スクロールバック:\n");
+    printf("  --scrollback <N>       メモリに置く履歴の行数（デフォルト%d）\n", DEFAULT_SCROLLBACK);
+    printf("  --no-scrollback-spill  あふれた履歴を一時ファイルに退避せず捨てる\n");
+    printf("  --scrollback-bytes <N> 履歴の使用バイト数の上限（K/M/G可、超えたら古い行から捨てる）\n");
+    printf("    実行中の変更: printf '\\033]7770;64M\\033\\\\'  問い合わせ: printf '\\033]7770;?\\033\\\\'\n");
+    printf("\n");
     printf("キーボード操作:\n");
     printf("  Shift+PageUp       上にスクロール（1画面分）\n");
     printf("  Shift+PageDown     下にスクロール（1画面分）\n");
+    printf("  Ctrl+Shift+F       スクロールバック履歴の検索（Enter/↑: 古い方へ、Shift+Enter/↓: 新しい方へ、Ctrl+R: 正規表現、Esc: 終了）\n");
     printf("  矢印キー           カーソル移動\n");
     printf("  Ctrl+C             割り込み\n");
     printf("  Ctrl+D             EOF（終了）\n");
@@ -494,7 +536,7 @@ static void print_usage(const char *prog_name)
     printf("  - 24-bit Truecolor対応（デフォルト、または--256colorで256色モード）\n");
     printf("  - UTF-8/日本語表示\n");
     printf("  - 全角文字対応（2セル幅）\n");
-    printf("  - スクロールバック履歴（1000行）\n");
+    printf("  - スクロールバック履歴（あふれた行は一時ファイルに退避して無制限）\n");
     printf("  - 代替スクリーンバッファ（vim、less等に対応）\n");
     printf("  - マウス選択とクリップボード連携\n");
     printf("\n");
@@ -614,6 +656,29 @@ int main(int argc, char *argv[])
             }
         } else if (strcmp(argv[i], "--underline") == 0) {
             g_display_options.show_underline = true;
+        } else if (strcmp(argv[i], "--scrollback") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "エラー: --scrollback オプションには行数の指定が必要です\n");
+                return 1;
+            }
+            char *end;
+            long lines = strtol(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || lines < 1 || lines > 10000000) {
+                fprintf(stderr, "エラー: 不正なスクロールバック行数: %s（1〜10000000）\n", argv[i]);
+                return 1;
+            }
+            g_scrollback_options.lines = (int)lines;
+        } else if (strcmp(argv[i], "--no-scrollback-spill") == 0) {
+            g_scrollback_options.spill = false;
+        } else if (strcmp(argv[i], "--scrollback-bytes") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "エラー: --scrollback-bytes オプションにはバイト数の指定が必要です\n");
+                return 1;
+            }
+            if (!scrollback_parse_bytes(argv[++i], &g_scrollback_options.bytes)) {
+                fprintf(stderr, "エラー: 不正なバイト数: %s（例: 1048576, 512K, 64M, 1G）\n", argv[i]);
+                return 1;
+            }
         } else {
             fprintf(stderr, "不明なオプション: %s\n", argv[i]);
             print_usage(argv[0]);
@@ -0,0 +1,1088 @@
+/*
+ * koteiterm - Scrollback Module
+ * スラブに詰めて保存するスクロールバック履歴
+ */
+
+#define _GNU_SOURCE  /* fallocate */
+#include "scrollback.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <lz4.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 初期のスラブ配列の要素数 */
+#define SCROLLBACK_INITIAL_SLABS 4
+
+/* 1行に保存する最大の列数（全セルが別々の属性区間になってもスラブに収まる幅） */
+#define SCROLLBACK_MAX_COLS \
+    ((int)((SCROLLBACK_SLAB_SIZE - sizeof(HotLineHeader)) / (sizeof(uint32_t) + sizeof(ScrollbackRun))))
+
+/* コールド層のブロック索引の初期要素数 */
+#define SCROLLBACK_INITIAL_BLOCKS 64
+
+/* 書き込み中のブロックの初期の大きさ（足りなければ倍々に広げる） */
+#define SCROLLBACK_INITIAL_BLOCK_BUFFER (128 * 1024)
+
+/* ブロックの先頭にある行の位置の表の大きさ */
+#define SCROLLBACK_BLOCK_TABLE_SIZE (SCROLLBACK_BLOCK_LINES * sizeof(uint32_t))
+
+/* ホット層のスラブに書く行の先頭（スナップショットがスラブを先頭から辿るため） */
+typedef struct {
+    uint16_t text_len;      /* 文字列の長さ */
+    uint16_t run_count;     /* 属性区間の数 */
+} HotLineHeader;
+
+/* コールド層のファイルに書く行の先頭 */
+typedef struct {
+    uint16_t cols;          /* この行の列数 */
+    uint16_t text_len;      /* 文字列の長さ */
+    uint16_t run_count;     /* 属性区間の数 */
+    uint16_t reserved;
+} ColdLineHeader;
+
+/* コールド層の属性区間（属性IDは使い回されるので属性を値で持つ） */
+typedef struct {
+    uint16_t start;         /* 開始列 */
+    uint16_t length;        /* 列数 */
+    CellAttr attr;          /* 属性 */
+} ColdRun;
+
+/* 通し番号のスラブを返す */
+static inline ScrollbackSlab *slab_at(const ScrollbackBuffer *sb, uint32_t seq)
+{
+    return sb->slabs[(sb->slab_head + (int)(seq - sb->slab_head_seq)) % sb->slab_capacity];
+}
+
+/* スラブの参照を手放す（最後の参照なら解放する。スナップショットを読むスレッドからも呼ばれる） */
+static void slab_unref(ScrollbackSlab *slab)
+{
+    if (slab && atomic_fetch_sub(&slab->refs, 1) == 1) {
+        free(slab);
+    }
+}
+
+/* 行の文字列（コードポイント列）を返す。属性区間はその直後に続く */
+static inline uint32_t *record_text(const ScrollbackBuffer *sb, const ScrollbackRecord *rec)
+{
+    return (uint32_t *)(slab_at(sb, rec->slab)->data + rec->offset);
+}
+
+/* 行の属性区間の配列を返す */
+static inline ScrollbackRun *record_runs(const ScrollbackBuffer *sb, const ScrollbackRecord *rec)
+{
+    return (ScrollbackRun *)(record_text(sb, rec) + rec->text_len);
+}
+
+/* 行がスラブで使うバイト数を返す（見出しを含む） */
+static inline uint32_t record_bytes(const ScrollbackRecord *rec)
+{
+    return sizeof(HotLineHeader) + rec->text_len * sizeof(uint32_t) + rec->run_count * sizeof(ScrollbackRun);
+}
+
+/* 末尾に続くデフォルト属性の空白を除いた長さを返す */
+static int trimmed_length(const Cell *cells, int len)
+{
+#ifdef __SSE2__
+    /* 空白セル2個分（16バイト）ずつ後ろから比べる */
+    const __m128i blank = _mm_set_epi32(ATTR_DEFAULT_ID, ' ', ATTR_DEFAULT_ID, ' ');
+    while (len >= 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&cells[len - 2]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, blank)) != 0xFFFF) {
+            break;
+        }
+        len -= 2;
+    }
+#endif
+    while (len > 0 && cells[len - 1].ch == ' ' && cells[len - 1].attr == ATTR_DEFAULT_ID) {
+        len--;
+    }
+    return len;
+}
+
+/* デフォルト以外の属性を持つセルがあるか */
+static bool has_attrs(const Cell *cells, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    /* セル4個（32バイト）ずつ属性IDの論理和をとる */
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 4 <= len; x += 4) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&cells[x]));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)&cells[x + 2]));
+    }
+    /* 奇数番目の32ビット（属性ID）だけを見る */
+    acc = _mm_and_si128(acc, _mm_set_epi32(-1, 0, -1, 0));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, _mm_setzero_si128())) != 0xFFFF) {
+        return true;
+    }
+#endif
+    for (; x < len; x++) {
+        if (cells[x].attr != ATTR_DEFAULT_ID) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* セルの文字だけをコードポイント列に写す */
+static void copy_text(uint32_t *text, const Cell *cells, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    /* セル4個から文字を取り出して16バイトずつ書く */
+    for (; x + 4 <= len; x += 4) {
+        __m128 a = _mm_loadu_ps((const float *)&cells[x]);
+        __m128 b = _mm_loadu_ps((const float *)&cells[x + 2]);
+        _mm_storeu_ps((float *)&text[x], _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+#endif
+    for (; x < len; x++) {
+        text[x] = cells[x].ch;
+    }
+}
+
+/* キャッシュの行を無効にする（コールド層から展開した行なら属性の参照を手放す） */
+static void release_cache_entry(ScrollbackBuffer *sb, ScrollbackCacheEntry *entry)
+{
+    if (entry->valid && entry->owns_refs) {
+        for (int x = 0; x < entry->cols; x++) {
+            attr_table_unref(sb->attrs, entry->cells[x].attr);
+        }
+    }
+    entry->valid = false;
+    entry->owns_refs = false;
+}
+
+/* 通し番号がend_seqより前の行をキャッシュから外す（履歴から落とした行） */
+static void release_cached_lines(ScrollbackBuffer *sb, uint64_t end_seq)
+{
+    if (!sb->cache) {
+        return;
+    }
+    for (int i = 0; i < SCROLLBACK_CACHE_SIZE; i++) {
+        ScrollbackCacheEntry *entry = &sb->cache[i];
+        if (entry->valid && entry->seq < end_seq) {
+            release_cache_entry(sb, entry);
+        }
+    }
+}
+
+/* コールド層を捨てる（一時ファイルを閉じ、退避した行を履歴から落とす） */
+static void drop_cold_tier(ScrollbackBuffer *sb)
+{
+    if (sb->cold_map) {
+        munmap(sb->cold_map, sb->cold_map_size);
+        sb->cold_map = NULL;
+        sb->cold_map_size = 0;
+    }
+    if (sb->cold_fd >= 0) {
+        close(sb->cold_fd);
+        sb->cold_fd = -1;
+    }
+    release_cached_lines(sb, sb->first_seq + sb->cold_count);
+    for (int i = 0; i < SCROLLBACK_INFLATED_BLOCKS; i++) {
+        sb->inflated[i].block = -1;
+    }
+    sb->first_seq += sb->cold_count;
+    sb->count -= sb->cold_count;
+    sb->cold_count = 0;
+    sb->cold_size = 0;
+    sb->cold_bytes = 0;
+    sb->block_count = 0;
+    sb->first_block = 0;
+    sb->block_buf_len = 0;
+    sb->spill = false;
+}
+
+/* 一時ファイルを作って、すぐにunlinkする（プロセスが終われば消える） */
+static int open_cold_file(ScrollbackBuffer *sb)
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/koteiterm-scrollback-XXXXXX", dir);
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "警告: スクロールバックの一時ファイルを作成できません: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    sb->cold_fd = fd;
+    return 0;
+}
+
+/* バッファを必要な大きさまで広げる */
+static int reserve_buffer(uint8_t **buf, uint32_t *capacity, uint32_t needed)
+{
+    if (needed <= *capacity) {
+        return 0;
+    }
+    uint32_t new_capacity = *capacity ? *capacity : SCROLLBACK_INITIAL_BLOCK_BUFFER;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    uint8_t *p = realloc(*buf, new_capacity);
+    if (!p) {
+        return -1;
+    }
+    *buf = p;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* 一時ファイルの末尾に書く */
+static int append_cold_file(ScrollbackBuffer *sb, const uint8_t *data, uint32_t len)
+{
+    uint32_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(sb->cold_fd, data + done, len - done, (off_t)(sb->cold_size + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "警告: スクロールバックの一時ファイルに書き込めません: %s\n", strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+    sb->cold_size += len;
+    return 0;
+}
+
+/* 埋まったブロックをLZ4で圧縮してファイルに書き、次のブロックを始める（縮まなければそのまま書く） */
+static int seal_block(ScrollbackBuffer *sb)
+{
+    if (sb->block_count == sb->block_capacity) {
+        int new_capacity = sb->block_capacity ? sb->block_capacity * 2 : SCROLLBACK_INITIAL_BLOCKS;
+        ScrollbackBlock *blocks = realloc(sb->blocks, new_capacity * sizeof(ScrollbackBlock));
+        if (!blocks) {
+            return -1;
+        }
+        sb->blocks = blocks;
+        sb->block_capacity = new_capacity;
+    }
+
+    uint32_t raw_size = sb->block_buf_len;
+    const uint8_t *stored = sb->block_buf;
+    uint32_t stored_size = raw_size;
+    if (reserve_buffer(&sb->compress_buf, &sb->compress_buf_capacity,
+                       LZ4_compressBound((int)raw_size)) == 0) {
+        int n = LZ4_compress_default((const char *)sb->block_buf, (char *)sb->compress_buf,
+                                     (int)raw_size, (int)sb->compress_buf_capacity);
+        if (n > 0 && (uint32_t)n < raw_size) {
+            stored = sb->compress_buf;
+            stored_size = n;
+        }
+    }
+
+    ScrollbackBlock *block = &sb->blocks[sb->block_count];
+    block->offset = sb->cold_size;
+    block->stored_size = stored_size;
+    block->raw_size = raw_size;
+    if (append_cold_file(sb, stored, stored_size) < 0) {
+        return -1;
+    }
+    sb->block_count++;
+    sb->cold_bytes += stored_size;
+    sb->block_buf_len = SCROLLBACK_BLOCK_TABLE_SIZE;
+    return 0;
+}
+
+/* ホット層の行をコールド層の書き込み中のブロックに書く */
+static int spill_line(ScrollbackBuffer *sb, const ScrollbackRecord *rec)
+{
+    if (sb->cold_fd < 0 && open_cold_file(sb) < 0) {
+        return -1;
+    }
+    int line = (sb->first_block - sb->block_count) * SCROLLBACK_BLOCK_LINES + sb->cold_count;
+    if (line == SCROLLBACK_BLOCK_LINES) {
+        if (seal_block(sb) < 0) {
+            return -1;
+        }
+        line = 0;
+    }
+    if (sb->block_buf_len == 0) {
+        sb->block_buf_len = SCROLLBACK_BLOCK_TABLE_SIZE;
+    }
+
+    uint32_t bytes = sizeof(ColdLineHeader) + rec->text_len * sizeof(uint32_t) +
+                     rec->run_count * sizeof(ColdRun);
+    if (reserve_buffer(&sb->block_buf, &sb->block_buf_capacity, sb->block_buf_len + bytes) < 0) {
+        return -1;
+    }
+
+    uint8_t *p = sb->block_buf + sb->block_buf_len;
+    ColdLineHeader header;
+    memset(&header, 0, sizeof(header));
+    header.cols = rec->cols;
+    header.text_len = rec->text_len;
+    header.run_count = rec->run_count;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, record_text(sb, rec), rec->text_len * sizeof(uint32_t));
+    p += rec->text_len * sizeof(uint32_t);
+
+    const ScrollbackRun *runs = record_runs(sb, rec);
+    for (int i = 0; i < rec->run_count; i++) {
+        ColdRun run;
+        memset(&run, 0, sizeof(run));
+        run.start = runs[i].start;
+        run.length = runs[i].length;
+        run.attr = *attr_table_get(sb->attrs, runs[i].attr);
+        memcpy(p, &run, sizeof(run));
+        p += sizeof(run);
+    }
+
+    ((uint32_t *)sb->block_buf)[line] = sb->block_buf_len;
+    sb->block_buf_len += bytes;
+    sb->cold_count++;
+    return 0;
+}
+
+/* 書き終えたブロックを展開して返す（展開済みならLRUから、なければ最も古いものに展開する） */
+static const uint8_t *inflate_block(ScrollbackBuffer *sb, int index)
+{
+    ScrollbackInflatedBlock *slot = &sb->inflated[0];
+    for (int i = 0; i < SCROLLBACK_INFLATED_BLOCKS; i++) {
+        ScrollbackInflatedBlock *b = &sb->inflated[i];
+        if (b->block == index && b->data) {
+            b->last_used = ++sb->inflate_clock;
+            return b->data;
+        }
+        if (b->last_used < slot->last_used) {
+            slot = b;
+        }
+    }
+
+    const ScrollbackBlock *block = &sb->blocks[index];
+    if (block->offset + block->stored_size > sb->cold_map_size) {
+        if (sb->cold_map) {
+            munmap(sb->cold_map, sb->cold_map_size);
+            sb->cold_map = NULL;
+            sb->cold_map_size = 0;
+        }
+        void *map = mmap(NULL, sb->cold_size, PROT_READ, MAP_SHARED, sb->cold_fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "警告: スクロールバックの一時ファイルをmmapできません: %s\n", strerror(errno));
+            return NULL;
+        }
+        sb->cold_map = map;
+        sb->cold_map_size = sb->cold_size;
+    }
+
+    slot->block = -1;
+    if (reserve_buffer(&slot->data, &slot->capacity, block->raw_size) < 0) {
+        return NULL;
+    }
+    const uint8_t *stored = sb->cold_map + block->offset;
+    if (block->stored_size == block->raw_size) {
+        memcpy(slot->data, stored, block->raw_size);
+    } else if (LZ4_decompress_safe((const char *)stored, (char *)slot->data, (int)block->stored_size,
+                                   (int)block->raw_size) != (int)block->raw_size) {
+        fprintf(stderr, "警告: スクロールバックのブロックを展開できません\n");
+        return NULL;
+    }
+    slot->block = index;
+    slot->last_used = ++sb->inflate_clock;
+    return slot->data;
+}
+
+/* コールド層の行の先頭を返す（書き込み中のブロックならそのまま、書き終えたブロックは展開して読む） */
+static const uint8_t *cold_line_at(ScrollbackBuffer *sb, int index)
+{
+    int block = sb->first_block + index / SCROLLBACK_BLOCK_LINES;
+    const uint8_t *data = block < sb->block_count ? inflate_block(sb, block) : sb->block_buf;
+    if (!data) {
+        return NULL;
+    }
+    uint32_t offset;
+    memcpy(&offset, data + (index % SCROLLBACK_BLOCK_LINES) * sizeof(uint32_t), sizeof(offset));
+    return data + offset;
+}
+
+/* 最古の行をホット層から出す（spillならコールド層へ退避し、そうでなければ捨てる。属性の参照は手放す） */
+static void evict_oldest(ScrollbackBuffer *sb, bool spill)
+{
+    ScrollbackRecord *rec = &sb->records[sb->head];
+    uint64_t seq = sb->first_seq + sb->cold_count;
+
+    spill = spill && sb->spill;
+    if (spill && spill_line(sb, rec) < 0) {
+        drop_cold_tier(sb);
+        spill = false;
+    }
+    if (!spill) {
+        sb->first_seq++;
+        sb->count--;
+    }
+    sb->hot_bytes -= record_bytes(rec) + sizeof(ScrollbackRecord);
+    slab_at(sb, rec->slab)->evicted++;
+    if (rec->run_count > 0) {
+        ScrollbackRun *runs = record_runs(sb, rec);
+        for (int i = 0; i < rec->run_count; i++) {
+            attr_table_unref_n(sb->attrs, runs[i].attr, runs[i].length);
+        }
+        /* 展開済みのセルが持つ属性IDは使い回されうるので、キャッシュから外す */
+        if (sb->cache) {
+            ScrollbackCacheEntry *entry = &sb->cache[seq % SCROLLBACK_CACHE_SIZE];
+            if (entry->valid && entry->seq == seq) {
+                entry->valid = false;
+            }
+        }
+    }
+    sb->head = (sb->head + 1) % sb->capacity;
+    sb->hot_count--;
+}
+
+/* コールド層の最古のブロックを捨てる（ファイルの領域も穴にして返す） */
+static void drop_oldest_block(ScrollbackBuffer *sb)
+{
+    const ScrollbackBlock *block = &sb->blocks[sb->first_block];
+#ifdef FALLOC_FL_PUNCH_HOLE
+    fallocate(sb->cold_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)block->offset, (off_t)block->stored_size);
+#endif
+    for (int i = 0; i < SCROLLBACK_INFLATED_BLOCKS; i++) {
+        if (sb->inflated[i].block == sb->first_block) {
+            sb->inflated[i].block = -1;
+        }
+    }
+    sb->cold_bytes -= block->stored_size;
+    sb->first_block++;
+
+    release_cached_lines(sb, sb->first_seq + SCROLLBACK_BLOCK_LINES);
+    sb->first_seq += SCROLLBACK_BLOCK_LINES;
+    sb->count -= SCROLLBACK_BLOCK_LINES;
+    sb->cold_count -= SCROLLBACK_BLOCK_LINES;
+}
+
+/* 書き込み中のブロックの行を捨てる（書き終えたブロックがないとき） */
+static void drop_open_block(ScrollbackBuffer *sb)
+{
+    release_cached_lines(sb, sb->first_seq + sb->cold_count);
+    sb->first_seq += sb->cold_count;
+    sb->count -= sb->cold_count;
+    sb->cold_count = 0;
+    sb->block_buf_len = 0;
+}
+
+/* 生きている行のない最古のスラブを解放する（書き込み中のスラブは残す） */
+static void release_empty_slabs(ScrollbackBuffer *sb)
+{
+    while (sb->slab_used > 1 &&
+           (sb->hot_count == 0 || sb->records[sb->head].slab != sb->slab_head_seq)) {
+        slab_unref(sb->slabs[sb->slab_head]);
+        sb->slabs[sb->slab_head] = NULL;
+        sb->slab_head = (sb->slab_head + 1) % sb->slab_capacity;
+        sb->slab_head_seq++;
+        sb->slab_used--;
+    }
+}
+
+/* 使用量が上限を超えていれば最古の行から捨てる */
+static void enforce_byte_limit(ScrollbackBuffer *sb)
+{
+    bool dropped_hot = false;
+    while (sb->byte_limit > 0 && scrollback_byte_usage(sb) > sb->byte_limit && sb->count > 0) {
+        if (sb->first_block < sb->block_count) {
+            drop_oldest_block(sb);
+        } else if (sb->cold_count > 0) {
+            drop_open_block(sb);
+        } else {
+            evict_oldest(sb, false);
+            dropped_hot = true;
+        }
+    }
+    if (dropped_hot) {
+        release_empty_slabs(sb);
+    }
+}
+
+/* スラブ配列を広げる（使用中のスラブを先頭から並べ直す） */
+static int grow_slab_ring(ScrollbackBuffer *sb)
+{
+    int new_capacity = sb->slab_capacity ? sb->slab_capacity * 2 : SCROLLBACK_INITIAL_SLABS;
+    ScrollbackSlab **slabs = malloc(new_capacity * sizeof(ScrollbackSlab *));
+    if (!slabs) {
+        return -1;
+    }
+    for (int i = 0; i < sb->slab_used; i++) {
+        slabs[i] = sb->slabs[(sb->slab_head + i) % sb->slab_capacity];
+    }
+    free(sb->slabs);
+    sb->slabs = slabs;
+    sb->slab_capacity = new_capacity;
+    sb->slab_head = 0;
+    return 0;
+}
+
+/* 次の書き込み先のスラブを用意する（最古のスラブが空なら使い回し、なければ新しく確保） */
+static int next_slab(ScrollbackBuffer *sb)
+{
+    ScrollbackSlab *slab = NULL;
+
+    bool head_empty = sb->hot_count == 0 || sb->records[sb->head].slab != sb->slab_head_seq;
+    if (sb->slab_used > 0 && head_empty) {
+        /* 生きている行のない最古のスラブを末尾へ回す（スナップショットが読んでいれば手放すだけ） */
+        ScrollbackSlab *head = sb->slabs[sb->slab_head];
+        sb->slabs[sb->slab_head] = NULL;
+        sb->slab_head = (sb->slab_head + 1) % sb->slab_capacity;
+        sb->slab_head_seq++;
+        sb->slab_used--;
+        if (atomic_load(&head->refs) == 1) {
+            slab = head;
+        } else {
+            slab_unref(head);
+        }
+    } else if (sb->slab_used == sb->slab_capacity && grow_slab_ring(sb) < 0) {
+        return -1;
+    }
+    if (!slab) {
+        slab = malloc(sizeof(ScrollbackSlab));
+        if (!slab) {
+            return -1;
+        }
+        atomic_init(&slab->refs, 1);
+    }
+    slab->lines = 0;
+    slab->evicted = 0;
+
+    sb->slabs[(sb->slab_head + sb->slab_used) % sb->slab_capacity] = slab;
+    sb->slab_used++;
+    sb->write_offset = 0;
+    return 0;
+}
+
+/**
+ * スクロールバックバッファを初期化する
+ */
+int scrollback_init(ScrollbackBuffer *sb, int capacity, bool spill, AttrTable *attrs)
+{
+    memset(sb, 0, sizeof(*sb));
+    sb->cold_fd = -1;
+    sb->records = calloc(capacity, sizeof(ScrollbackRecord));
+    if (!sb->records) {
+        return -1;
+    }
+    for (int i = 0; i < SCROLLBACK_INFLATED_BLOCKS; i++) {
+        sb->inflated[i].block = -1;
+    }
+    sb->capacity = capacity;
+    sb->spill = spill;
+    sb->attrs = attrs;
+    return 0;
+}
+
+/**
+ * スクロールバックバッファを解放する
+ */
+void scrollback_free(ScrollbackBuffer *sb)
+{
+    for (int i = 0; i < sb->slab_used; i++) {
+        slab_unref(sb->slabs[(sb->slab_head + i) % sb->slab_capacity]);
+    }
+    if (sb->cache) {
+        for (int i = 0; i < SCROLLBACK_CACHE_SIZE; i++) {
+            free(sb->cache[i].cells);
+        }
+    }
+    free(sb->cache);
+    free(sb->slabs);
+    free(sb->records);
+    if (sb->cold_map) {
+        munmap(sb->cold_map, sb->cold_map_size);
+    }
+    if (sb->cold_fd >= 0) {
+        close(sb->cold_fd);
+    }
+    free(sb->block_buf);
+    free(sb->compress_buf);
+    free(sb->blocks);
+    for (int i = 0; i < SCROLLBACK_INFLATED_BLOCKS; i++) {
+        free(sb->inflated[i].data);
+    }
+    memset(sb, 0, sizeof(*sb));
+    sb->cold_fd = -1;
+}
+
+/**
+ * 行を末尾に追加する
+ */
+bool scrollback_push(ScrollbackBuffer *sb, const Cell *cells, int cols)
+{
+    if (!sb->records || sb->capacity <= 0) {
+        return false;
+    }
+
+    /* 保存しきれない幅の行は収まる分だけ保存する */
+    int stored_cols = cols < SCROLLBACK_MAX_COLS ? cols : SCROLLBACK_MAX_COLS;
+
+    /* 末尾のデフォルト属性の空白は落とす */
+    int text_len = trimmed_length(cells, stored_cols);
+
+    /* デフォルト以外の属性区間を数える */
+    int run_count = 0;
+    if (has_attrs(cells, text_len)) {
+        for (int x = 0; x < text_len; x++) {
+            if (cells[x].attr != ATTR_DEFAULT_ID && (x == 0 || cells[x - 1].attr != cells[x].attr)) {
+                run_count++;
+            }
+        }
+    }
+
+    uint32_t bytes = sizeof(HotLineHeader) + text_len * sizeof(uint32_t) + run_count * sizeof(ScrollbackRun);
+
+    if (sb->hot_count == sb->capacity) {
+        evict_oldest(sb, true);
+    }
+    if (sb->slab_used == 0 || sb->write_offset + bytes > SCROLLBACK_SLAB_SIZE) {
+        if (next_slab(sb) < 0) {
+            return false;
+        }
+    }
+
+    ScrollbackRecord *rec = &sb->records[(sb->head + sb->hot_count) % sb->capacity];
+    ScrollbackSlab *slab = slab_at(sb, sb->slab_head_seq + sb->slab_used - 1);
+    HotLineHeader header = { (uint16_t)text_len, (uint16_t)run_count };
+    memcpy(slab->data + sb->write_offset, &header, sizeof(header));
+    slab->lines++;
+    rec->slab = sb->slab_head_seq + sb->slab_used - 1;
+    rec->offset = sb->write_offset + sizeof(header);
+    rec->cols = stored_cols;
+    rec->text_len = text_len;
+    rec->run_count = run_count;
+
+    copy_text(record_text(sb, rec), cells, text_len);
+
+    if (run_count > 0) {
+        ScrollbackRun *runs = record_runs(sb, rec);
+        int r = -1;
+        for (int x = 0; x < text_len; x++) {
+            if (cells[x].attr == ATTR_DEFAULT_ID) {
+                continue;
+            }
+            if (x > 0 && cells[x - 1].attr == cells[x].attr) {
+                runs[r].length++;
+            } else {
+                r++;
+                runs[r].start = x;
+                runs[r].length = 1;
+                runs[r].attr = cells[x].attr;
+            }
+        }
+    }
+
+    sb->write_offset += bytes;
+    sb->hot_bytes += bytes + sizeof(ScrollbackRecord);
+    sb->hot_count++;
+    sb->count++;
+
+    /* 保存しなかった部分の参照は手放す */
+    for (int i = stored_cols; i < cols; i++) {
+        attr_table_unref(sb->attrs, cells[i].attr);
+    }
+
+    enforce_byte_limit(sb);
+    return true;
+}
+
+/**
+ * 履歴の使用バイト数を返す
+ */
+uint64_t scrollback_byte_usage(const ScrollbackBuffer *sb)
+{
+    uint64_t bytes = sb->hot_bytes + sb->cold_bytes + sb->block_buf_len;
+    if (sb->group_lines > 0 && sb->count > 0) {
+        /* 生きている行にかかるグループの数（最古の行のグループから最新の行のグループまで） */
+        uint64_t groups = (sb->first_seq + sb->count - 1) / sb->group_lines - sb->first_seq / sb->group_lines + 1;
+        if (groups > (uint64_t)sb->max_groups) {
+            groups = sb->max_groups;
+        }
+        bytes += groups * sb->group_bytes;
+    }
+    return bytes;
+}
+
+/**
+ * 行のグループごとのデータの大きさを設定する
+ */
+void scrollback_set_group_overhead(ScrollbackBuffer *sb, int group_lines, uint32_t group_bytes, int max_groups)
+{
+    sb->group_lines = group_lines;
+    sb->group_bytes = group_bytes;
+    sb->max_groups = max_groups;
+    enforce_byte_limit(sb);
+}
+
+/**
+ * 履歴の使用バイト数の上限を設定する
+ */
+void scrollback_set_byte_limit(ScrollbackBuffer *sb, uint64_t bytes)
+{
+    sb->byte_limit = bytes;
+    enforce_byte_limit(sb);
+}
+
+/**
+ * バイト数の文字列を解釈する
+ */
+bool scrollback_parse_bytes(const char *text, uint64_t *bytes)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || *text == '-' || errno != 0) {
+        return false;
+    }
+
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return false;
+    }
+    *bytes = (uint64_t)value << shift;
+    return true;
+}
+
+/**
+ * 行を取得する
+ */
+bool scrollback_get(ScrollbackBuffer *sb, int index, ScrollbackLine *line)
+{
+    if (index < 0 || index >= sb->count) {
+        return false;
+    }
+    uint64_t seq = sb->first_seq + index;
+
+    if (!sb->cache) {
+        sb->cache = calloc(SCROLLBACK_CACHE_SIZE, sizeof(ScrollbackCacheEntry));
+        if (!sb->cache) {
+            return false;
+        }
+    }
+
+    /* 行は追加したあと変わらないので、通し番号が同じなら展開済みのセルをそのまま使う */
+    ScrollbackCacheEntry *entry = &sb->cache[seq % SCROLLBACK_CACHE_SIZE];
+    if (entry->valid && entry->seq == seq) {
+        line->cells = entry->cells;
+        line->cols = entry->cols;
+        return true;
+    }
+
+    /* 行の中身をホット層のスラブかコールド層のファイルから取り出す */
+    const ScrollbackRecord *rec = NULL;
+    const uint8_t *cold = NULL;
+    ColdLineHeader header;
+    if (index < sb->cold_count) {
+        cold = cold_line_at(sb, index);
+        if (!cold) {
+            return false;
+        }
+        memcpy(&header, cold, sizeof(header));
+        cold += sizeof(header);
+    } else {
+        rec = &sb->records[(sb->head + index - sb->cold_count) % sb->capacity];
+        header.cols = rec->cols;
+        header.text_len = rec->text_len;
+        header.run_count = rec->run_count;
+    }
+
+    release_cache_entry(sb, entry);
+    if (entry->capacity < header.cols || !entry->cells) {
+        int capacity = header.cols > 0 ? header.cols : 1;
+        Cell *buf = realloc(entry->cells, capacity * sizeof(Cell));
+        if (!buf) {
+            return false;
+        }
+        entry->cells = buf;
+        entry->capacity = capacity;
+    }
+
+    const uint32_t *text = rec ? record_text(sb, rec) : (const uint32_t *)cold;
+    for (int x = 0; x < header.text_len; x++) {
+        entry->cells[x].ch = text[x];
+        entry->cells[x].attr = ATTR_DEFAULT_ID;
+    }
+    for (int x = header.text_len; x < header.cols; x++) {
+        entry->cells[x].ch = ' ';
+        entry->cells[x].attr = ATTR_DEFAULT_ID;
+    }
+    if (rec) {
+        const ScrollbackRun *runs = record_runs(sb, rec);
+        for (int i = 0; i < rec->run_count; i++) {
+            for (int x = runs[i].start; x < runs[i].start + runs[i].length; x++) {
+                entry->cells[x].attr = runs[i].attr;
+            }
+        }
+    } else {
+        /* コールド層の属性は値で持っているので、インターンし直して参照をセルの数だけ持つ */
+        const uint8_t *p = cold + header.text_len * sizeof(uint32_t);
+        for (int i = 0; i < header.run_count; i++, p += sizeof(ColdRun)) {
+            ColdRun run;
+            memcpy(&run, p, sizeof(run));
+            uint32_t id = attr_table_intern(sb->attrs, &run.attr);
+            if (run.length > 1) {
+                attr_table_ref_n(sb->attrs, id, run.length - 1);
+            }
+            for (int x = run.start; x < run.start + run.length; x++) {
+                entry->cells[x].attr = id;
+            }
+        }
+        entry->owns_refs = true;
+    }
+    entry->seq = seq;
+    entry->cols = header.cols;
+    entry->valid = true;
+
+    line->cells = entry->cells;
+    line->cols = entry->cols;
+    return true;
+}
+
+/* 書き込み中のブロックの行の文字列を写す（textがNULLなら数えるだけ） */
+static uint32_t copy_open_block_text(const ScrollbackBuffer *sb, int first, uint32_t *text, uint32_t *line_start)
+{
+    uint32_t total = 0;
+    for (int index = first; index < sb->cold_count; index++) {
+        uint32_t offset;
+        memcpy(&offset, sb->block_buf + (index % SCROLLBACK_BLOCK_LINES) * sizeof(uint32_t), sizeof(offset));
+        ColdLineHeader header;
+        memcpy(&header, sb->block_buf + offset, sizeof(header));
+        if (text) {
+            line_start[index - first] = total;
+            memcpy(text + total, sb->block_buf + offset + sizeof(header), header.text_len * sizeof(uint32_t));
+        }
+        total += header.text_len;
+    }
+    if (text) {
+        line_start[sb->cold_count - first] = total;
+    }
+    return total;
+}
+
+/**
+ * 文字列のスナップショットを作る
+ */
+int scrollback_snapshot_take(const ScrollbackBuffer *sb, ScrollbackSnapshot *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->fd = -1;
+    snap->loaded_block = -1;
+    snap->loaded_slab = -1;
+    snap->first_seq = sb->first_seq;
+    snap->count = sb->count;
+    snap->hot_first = sb->cold_count;
+
+    /* 書き終えたブロックは索引とファイルだけ（書いた領域は上限超過で穴にするまで変わらない） */
+    int sealed = sb->cold_fd >= 0 ? sb->block_count - sb->first_block : 0;
+    if (sealed > 0) {
+        snap->blocks = malloc(sealed * sizeof(ScrollbackBlock));
+        snap->fd = fcntl(sb->cold_fd, F_DUPFD_CLOEXEC, 0);
+        if (!snap->blocks || snap->fd < 0) {
+            scrollback_snapshot_free(snap);
+            return -1;
+        }
+        memcpy(snap->blocks, &sb->blocks[sb->first_block], sealed * sizeof(ScrollbackBlock));
+        snap->block_count = sealed;
+    }
+
+    /* 書き込み中のブロックは書き足され、埋まれば圧縮されるので文字列を写す（256行まで） */
+    int first = sealed * SCROLLBACK_BLOCK_LINES;
+    uint32_t total = copy_open_block_text(sb, first, NULL, NULL);
+    snap->text = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    snap->line_start = malloc((sb->cold_count - first + 1) * sizeof(uint32_t));
+    if (!snap->text || !snap->line_start) {
+        scrollback_snapshot_free(snap);
+        return -1;
+    }
+    copy_open_block_text(sb, first, snap->text, snap->line_start);
+
+    /* ホット層は最古の行のスラブから書き込み中のスラブまでの参照を持つ（書いた行は変わらない） */
+    if (sb->hot_count > 0) {
+        uint32_t first_slab = sb->records[sb->head].slab;
+        int n = (int)(sb->slab_head_seq + sb->slab_used - first_slab);
+        snap->slabs = malloc(n * sizeof(ScrollbackSlab *));
+        snap->slab_first = malloc(n * sizeof(int));
+        snap->slab_lines = malloc(n * sizeof(uint32_t));
+        if (!snap->slabs || !snap->slab_first || !snap->slab_lines) {
+            scrollback_snapshot_free(snap);
+            return -1;
+        }
+        int index = sb->cold_count;
+        for (int i = 0; i < n; i++) {
+            ScrollbackSlab *slab = slab_at(sb, first_slab + i);
+            atomic_fetch_add(&slab->refs, 1);
+            snap->slabs[i] = slab;
+            snap->slab_first[i] = (i == 0) ? index - (int)slab->evicted : index;
+            snap->slab_lines[i] = slab->lines;
+            index = snap->slab_first[i] + (int)slab->lines;
+        }
+        snap->slab_count = n;
+    }
+    return 0;
+}
+
+/**
+ * スナップショットを解放する
+ */
+void scrollback_snapshot_free(ScrollbackSnapshot *snap)
+{
+    if (snap->fd >= 0) {
+        close(snap->fd);
+    }
+    for (int i = 0; i < snap->slab_count; i++) {
+        slab_unref(snap->slabs[i]);
+    }
+    free(snap->slabs);
+    free(snap->slab_first);
+    free(snap->slab_lines);
+    free(snap->line_offsets);
+    free(snap->blocks);
+    free(snap->text);
+    free(snap->line_start);
+    free(snap->stored);
+    free(snap->data);
+    memset(snap, 0, sizeof(*snap));
+    snap->fd = -1;
+    snap->loaded_block = -1;
+    snap->loaded_slab = -1;
+}
+
+/* スナップショットのホット層の行を含むスラブを探し、行の見出しを辿って行の位置を並べる */
+static int load_snapshot_slab(ScrollbackSnapshot *snap, int index)
+{
+    int lo = 0, hi = snap->slab_count - 1;
+    if (snap->loaded_slab >= 0 && index >= snap->slab_first[snap->loaded_slab] &&
+        index < snap->slab_first[snap->loaded_slab] + (int)snap->slab_lines[snap->loaded_slab]) {
+        return snap->loaded_slab;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (snap->slab_first[mid] <= index) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    uint32_t lines = snap->slab_lines[lo];
+    if (snap->line_offsets_capacity < lines) {
+        uint32_t *offsets = realloc(snap->line_offsets, lines * sizeof(uint32_t));
+        if (!offsets) {
+            snap->loaded_slab = -1;
+            return -1;
+        }
+        snap->line_offsets = offsets;
+        snap->line_offsets_capacity = lines;
+    }
+    const uint8_t *data = snap->slabs[lo]->data;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < lines; i++) {
+        HotLineHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        snap->line_offsets[i] = offset;
+        offset += sizeof(header) + header.text_len * sizeof(uint32_t) + header.run_count * sizeof(ScrollbackRun);
+    }
+    snap->loaded_slab = lo;
+    return lo;
+}
+
+/* スナップショットの書き終えたブロックをファイルから読んで展開する（mmapとLRUは元のバッファのものなので使わない） */
+static bool load_snapshot_block(ScrollbackSnapshot *snap, int index)
+{
+    if (snap->loaded_block == index) {
+        return snap->loaded_ok;
+    }
+    snap->loaded_block = index;
+    snap->loaded_ok = false;
+
+    const ScrollbackBlock *block = &snap->blocks[index];
+    if (reserve_buffer(&snap->stored, &snap->stored_capacity, block->stored_size) < 0 ||
+        reserve_buffer(&snap->data, &snap->data_capacity, block->raw_size) < 0) {
+        return false;
+    }
+    uint32_t done = 0;
+    while (done < block->stored_size) {
+        ssize_t n = pread(snap->fd, snap->stored + done, block->stored_size - done, (off_t)(block->offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    if (block->stored_size == block->raw_size) {
+        memcpy(snap->data, snap->stored, block->raw_size);
+    } else if (LZ4_decompress_safe((const char *)snap->stored, (char *)snap->data, (int)block->stored_size,
+                                   (int)block->raw_size) != (int)block->raw_size) {
+        return false;  /* 作ったあとで上限超過により捨てられたブロック */
+    }
+    snap->loaded_ok = true;
+    return true;
+}
+
+/**
+ * スナップショットの行の文字列を取得する
+ */
+bool scrollback_snapshot_line(ScrollbackSnapshot *snap, int index, const uint32_t **text, int *len)
+{
+    if (index < 0 || index >= snap->count) {
+        return false;
+    }
+
+    if (index >= snap->hot_first) {
+        int slab = load_snapshot_slab(snap, index);
+        if (slab < 0) {
+            return false;
+        }
+        HotLineHeader header;
+        const uint8_t *line = snap->slabs[slab]->data + snap->line_offsets[index - snap->slab_first[slab]];
+        memcpy(&header, line, sizeof(header));
+        *text = (const uint32_t *)(line + sizeof(header));
+        *len = header.text_len;
+        return true;
+    }
+
+    int first = snap->block_count * SCROLLBACK_BLOCK_LINES;
+    if (index >= first) {
+        *text = snap->text + snap->line_start[index - first];
+        *len = (int)(snap->line_start[index - first + 1] - snap->line_start[index - first]);
+        return true;
+    }
+
+    int block = index / SCROLLBACK_BLOCK_LINES;
+    if (!load_snapshot_block(snap, block)) {
+        return false;
+    }
+    /* 穴になったブロックをそのまま読んだ場合に備えて範囲を確かめる */
+    uint32_t raw_size = snap->blocks[block].raw_size;
+    uint32_t offset;
+    memcpy(&offset, snap->data + (index % SCROLLBACK_BLOCK_LINES) * sizeof(uint32_t), sizeof(offset));
+    if (offset < SCROLLBACK_BLOCK_TABLE_SIZE || offset + sizeof(ColdLineHeader) > raw_size) {
+        return false;
+    }
+    ColdLineHeader header;
+    memcpy(&header, snap->data + offset, sizeof(header));
+    if (offset + sizeof(header) + header.text_len * sizeof(uint32_t) > raw_size) {
+        return false;
+    }
+    *text = (const uint32_t *)(snap->data + offset + sizeof(header));
+    *len = header.text_len;
+    return true;
+}
@@ -0,0 +1,265 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "cell.h"
+#include "attr.h"
+
+/* スラブ1個の大きさ（バイト）。1行はスラブをまたがない */
+#define SCROLLBACK_SLAB_SIZE (64 * 1024)
+
+/* 展開した行をキャッシュする数（表示中の行がすべて収まるように） */
+#define SCROLLBACK_CACHE_SIZE 256
+
+/* コールド層のブロック1個の行数（ブロック単位でLZ4圧縮してファイルに書く） */
+#define SCROLLBACK_BLOCK_LINES 256
+
+/* 展開したブロックを置いておく数（LRU） */
+#define SCROLLBACK_INFLATED_BLOCKS 4
+
+/* スクロールバック行（展開したセル列を指す。同じキャッシュ位置の別の行を取得するまで有効） */
+typedef struct {
+    Cell *cells;            /* セル配列 */
+    int cols;               /* この行の列数 */
+} ScrollbackLine;
+
+/* 属性区間（列 [start, start + length) がattrの属性を持つ。デフォルト属性の区間は記録しない） */
+typedef struct {
+    uint16_t start;         /* 開始列 */
+    uint16_t length;        /* 列数 */
+    uint32_t attr;          /* 属性ID */
+} ScrollbackRun;
+
+/*
+ * ホット層のスラブ（行は追加したあと変わらないので、スナップショットはスラブを参照で持つ）
+ * スナップショットが参照している間は使い回さず、最後の参照を手放したほうが解放する。
+ */
+typedef struct {
+    atomic_int refs;        /* 参照数（バッファの1 + 参照しているスナップショットの数） */
+    uint32_t lines;         /* 書いた行数（バッファのスレッドだけが触る） */
+    uint32_t evicted;       /* ホット層から出した行数（同上） */
+    uint8_t data[SCROLLBACK_SLAB_SIZE];  /* 行（行ごとに長さの見出し、文字列、属性区間の順） */
+} ScrollbackSlab;
+
+/* 行の置き場所（スラブには行の見出し、文字のコードポイント列、続けて属性区間の配列を置く） */
+typedef struct {
+    uint32_t slab;          /* 行を置いたスラブの通し番号 */
+    uint32_t offset;        /* スラブ内の文字列のバイト位置 */
+    uint16_t cols;          /* 保存したときの列数 */
+    uint16_t text_len;      /* 保存した文字数（末尾のデフォルト属性の空白を除く） */
+    uint16_t run_count;     /* 属性区間の数 */
+} ScrollbackRecord;
+
+/* 展開した行のキャッシュ */
+typedef struct {
+    uint64_t seq;           /* 行の通し番号 */
+    Cell *cells;            /* 展開したセル配列 */
+    int cols;               /* 展開した列数 */
+    int capacity;           /* cellsの要素数 */
+    bool valid;             /* 使用中か */
+    bool owns_refs;         /* セルの属性の参照を持っているか（コールド層の行は展開時に属性をインターンする） */
+} ScrollbackCacheEntry;
+
+/* コールド層のブロックの索引 */
+typedef struct {
+    uint64_t offset;        /* ファイル内の位置 */
+    uint32_t stored_size;   /* ファイル内の大きさ（raw_sizeと同じなら圧縮していない） */
+    uint32_t raw_size;      /* 展開した大きさ */
+} ScrollbackBlock;
+
+/* 展開したブロック */
+typedef struct {
+    int block;              /* ブロック番号（-1で未使用） */
+    uint8_t *data;          /* 展開したブロック */
+    uint32_t capacity;      /* dataの大きさ */
+    uint64_t last_used;     /* 最後に使った時刻（LRU用の通し番号） */
+} ScrollbackInflatedBlock;
+
+/*
+ * スクロールバックバッファ
+ * ホット層: 行は末尾のデフォルト属性の空白を落とし、文字のコードポイント列と属性区間に詰めて
+ * 64KBのスラブに書き、行の索引（リングバッファ）で場所を引く。
+ * スラブもリングとして使い回し、最古のスラブに生きている行がなくなったら次の書き込み先にする
+ * （スナップショットが参照しているスラブは使い回さずに手放す）。
+ * 行は属性の参照をセルの数だけ持つ。
+ * コールド層: ホット層からあふれた行は、属性を値で書き出して256行ずつのブロックにまとめ、
+ * ブロックが埋まったらLZ4で圧縮して一時ファイル（作成直後にunlink）に追記する。
+ * ブロックの索引とmmapで読み戻し、展開したブロックは少数をLRUで置いておく。
+ * 行インデックスはコールド層の最古の行を0とし、ホット層の行がそれに続く。
+ * 使用バイト数（ホット層の行と索引、コールド層の圧縮後の大きさ、呼び出し側が行のグループごとに持つデータ）が
+ * 上限を超えたら、最古の行から捨てる。
+ * 読むときはセル列に展開して、行の通し番号で引くキャッシュに置く。
+ */
+typedef struct {
+    /* ホット層 */
+    ScrollbackRecord *records;  /* 行の索引（リングバッファ） */
+    int capacity;           /* メモリに置く最大行数 */
+    int hot_count;          /* メモリに置いている行数 */
+    int head;               /* リングバッファの先頭位置 */
+    ScrollbackSlab **slabs; /* スラブのリング（slab_headからslab_used個が使用中、最後が書き込み中） */
+    int slab_capacity;      /* slabs配列の要素数 */
+    int slab_head;          /* 最古のスラブの位置 */
+    int slab_used;          /* 使用中のスラブ数 */
+    uint32_t slab_head_seq; /* 最古のスラブの通し番号 */
+    uint32_t write_offset;  /* 書き込み中のスラブの使用バイト数 */
+    uint64_t hot_bytes;     /* ホット層の行が使うバイト数（索引を含む） */
+
+    /* コールド層 */
+    bool spill;             /* あふれた行を一時ファイルに退避するか */
+    int cold_fd;            /* 一時ファイル（-1で未作成） */
+    int cold_count;         /* 退避した行数 */
+    uint64_t cold_size;     /* ファイルに書き込んだバイト数 */
+    ScrollbackBlock *blocks;  /* 書き終えたブロックの索引 */
+    int block_count;        /* 書き終えたブロック数 */
+    int first_block;        /* 最古の生きているブロック（それより前は上限超過で捨てた） */
+    uint64_t cold_bytes;    /* 生きているブロックのファイル内の大きさの合計 */
+    int block_capacity;     /* blocksの要素数 */
+    uint8_t *block_buf;     /* 書き込み中のブロック（先頭に行の位置の表、続いて行） */
+    uint32_t block_buf_len; /* 書き込み中のブロックの使用バイト数 */
+    uint32_t block_buf_capacity;  /* block_bufの大きさ */
+    uint8_t *compress_buf;  /* 圧縮の出力先 */
+    uint32_t compress_buf_capacity;  /* compress_bufの大きさ */
+    ScrollbackInflatedBlock inflated[SCROLLBACK_INFLATED_BLOCKS];  /* 展開したブロック（LRU） */
+    uint64_t inflate_clock; /* LRU用の通し番号 */
+    uint8_t *cold_map;      /* ファイルのmmap */
+    size_t cold_map_size;   /* mmapした大きさ */
+
+    int count;              /* 全体の行数（コールド層 + ホット層） */
+    uint64_t first_seq;     /* 行インデックス0の行の通し番号 */
+    uint64_t byte_limit;    /* 使用バイト数の上限（0で無制限） */
+    int group_lines;        /* 呼び出し側が持つ行のグループごとのデータ（検索索引）の1グループの行数（0でなし） */
+    uint32_t group_bytes;   /* そのデータの1グループのバイト数 */
+    int max_groups;         /* そのデータが持つ最大グループ数 */
+    ScrollbackCacheEntry *cache;  /* 展開した行のキャッシュ（通し番号で直接引く、初回の取得で確保） */
+    AttrTable *attrs;       /* セルの属性IDが指す属性テーブル */
+} ScrollbackBuffer;
+
+/*
+ * スクロールバックの文字列のスナップショット（別スレッドから読むため、作ったあとは元のバッファに触れない）
+ * 書き終えたブロックはファイル上で変わらないので索引だけを写し、dupしたファイルから読む。
+ * ホット層の行はスラブの参照を持ち、スラブの行の見出しを辿って読む（行の中身は写さない）。
+ * 書き込み中のブロックの行（256行まで）だけ文字列を写す。属性は持たない。
+ * 行インデックスは作った時点のスクロールバックと同じ（0=最古）。
+ */
+typedef struct {
+    uint64_t first_seq;     /* 行インデックス0の行の通し番号 */
+    int count;              /* 行数 */
+    int fd;                 /* 一時ファイル（dupしたもの、-1でなし） */
+    ScrollbackBlock *blocks;  /* 書き終えたブロックの索引の写し（先頭のブロックの最初の行がインデックス0） */
+    int block_count;        /* 書き終えたブロック数 */
+    uint32_t *text;         /* 書き込み中のブロックの行の文字列を続けたもの */
+    uint32_t *line_start;   /* textの中の行の開始位置（行ごと、最後に終端） */
+    int hot_first;          /* ホット層の最初の行のインデックス */
+    ScrollbackSlab **slabs; /* ホット層の行を置いたスラブ（参照を持つ） */
+    int *slab_first;        /* スラブの最初の行のインデックス（先頭のスラブはホット層から出した行の分だけ小さい） */
+    uint32_t *slab_lines;   /* 作った時点のスラブの行数 */
+    int slab_count;         /* スラブの数 */
+    /* 読み出しの作業用（読む側のスレッドだけが使う） */
+    int loaded_block;       /* dataに展開したブロック（-1で未展開） */
+    bool loaded_ok;         /* 展開できたか（読めないブロックを何度も読まないように） */
+    uint8_t *stored;        /* ファイルから読んだブロック */
+    uint32_t stored_capacity;  /* storedの大きさ */
+    uint8_t *data;          /* 展開したブロック */
+    uint32_t data_capacity; /* dataの大きさ */
+    int loaded_slab;        /* line_offsetsに行の位置を並べたスラブ（-1でなし） */
+    uint32_t *line_offsets; /* loaded_slabの行の文字列の位置 */
+    uint32_t line_offsets_capacity;  /* line_offsetsの要素数 */
+} ScrollbackSnapshot;
+
+/* 関数プロトタイプ */
+
+/**
+ * スクロールバックバッファを初期化する
+ * @param sb スクロールバックバッファ
+ * @param capacity メモリに置く最大行数
+ * @param spill trueならあふれた行を一時ファイルに退避する（falseなら捨てる）
+ * @param attrs セルの属性IDが指す属性テーブル
+ * @return 成功時0、失敗時-1
+ */
+int scrollback_init(ScrollbackBuffer *sb, int capacity, bool spill, AttrTable *attrs);
+
+/**
+ * スクロールバックバッファを解放する
+ * @param sb スクロールバックバッファ
+ */
+void scrollback_free(ScrollbackBuffer *sb);
+
+/**
+ * 行を末尾に追加する（ホット層がいっぱいなら最古の行をコールド層へ退避するか捨てる）
+ * 成功した場合、セルの属性の参照はスクロールバックに移る。
+ * @param sb スクロールバックバッファ
+ * @param cells セル配列
+ * @param cols 列数
+ * @return 成功時true、メモリ確保に失敗した場合false（参照は呼び出し側に残る）
+ */
+bool scrollback_push(ScrollbackBuffer *sb, const Cell *cells, int cols);
+
+/**
+ * 行を取得する（セル列に展開してキャッシュする）
+ * @param sb スクロールバックバッファ
+ * @param index 行インデックス（0=最古）
+ * @param line 行の格納先
+ * @return 範囲内で展開できればtrue
+ */
+bool scrollback_get(ScrollbackBuffer *sb, int index, ScrollbackLine *line);
+
+/**
+ * 履歴の使用バイト数を返す（ホット層の行と索引、コールド層の圧縮後の大きさ、行のグループごとのデータ）
+ * @param sb スクロールバックバッファ
+ * @return 使用バイト数
+ */
+uint64_t scrollback_byte_usage(const ScrollbackBuffer *sb);
+
+/**
+ * 履歴の使用バイト数の上限を設定する（超えていればすぐに最古の行から捨てる）
+ * @param sb スクロールバックバッファ
+ * @param bytes 上限（0で無制限）
+ */
+void scrollback_set_byte_limit(ScrollbackBuffer *sb, uint64_t bytes);
+
+/**
+ * 呼び出し側が行の通し番号のグループごとに持つデータ（検索索引）の大きさを使用バイト数に含める
+ * @param sb スクロールバックバッファ
+ * @param group_lines 1グループの行数（通し番号 / group_lines がグループの番号）
+ * @param group_bytes 1グループのバイト数
+ * @param max_groups 持つ最大グループ数（それより古いグループは持たない）
+ */
+void scrollback_set_group_overhead(ScrollbackBuffer *sb, int group_lines, uint32_t group_bytes, int max_groups);
+
+/**
+ * 文字列のスナップショットを作る（書き込み中のブロックの行だけ文字列を写し、ほかは参照する）
+ * @param sb スクロールバックバッファ
+ * @param snap スナップショットの格納先
+ * @return 成功時0、失敗時-1
+ */
+int scrollback_snapshot_take(const ScrollbackBuffer *sb, ScrollbackSnapshot *snap);
+
+/**
+ * スナップショットを解放する
+ * @param snap スナップショット
+ */
+void scrollback_snapshot_free(ScrollbackSnapshot *snap);
+
+/**
+ * スナップショットの行の文字列を取得する（保存したコードポイント列。全角文字の2セル目を含むので添字が列になる）
+ * 書き終えたブロックの行はブロックごとにファイルから読んで展開する。作ったスレッド以外から呼べる。
+ * @param snap スナップショット
+ * @param index 行インデックス（0=最古）
+ * @param text 文字列の格納先（次の呼び出しまで有効）
+ * @param len 文字数の格納先
+ * @return 読めればtrue
+ */
+bool scrollback_snapshot_line(ScrollbackSnapshot *snap, int index, const uint32_t **text, int *len);
+
+/**
+ * バイト数の文字列を解釈する（K/M/Gの接尾辞で1024倍単位）
+ * @param text 文字列
+ * @param bytes 結果の格納先
+ * @return 解釈できればtrue
+ */
+bool scrollback_parse_bytes(const char *text, uint64_t *bytes);
+
+#endif /* SCROLLBACK_H */
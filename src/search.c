@@ -0,0 +1,1213 @@
+/*
+ * koteiterm - Search Module
+ * スクロールバック履歴の検索（トライグラムのBloomフィルタによる索引と検索UI、
+ * ワーカースレッドでの正規表現検索）
+ */
+
+#define _GNU_SOURCE  /* pipe2 */
+#include "search.h"
+#include "terminal.h"
+#include "utf8.h"
+#include "combining.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+
+/* 索引の初期グループ数 */
+#define SEARCH_INITIAL_GROUPS 64
+
+/* Bloomフィルタのビット数 */
+#define SEARCH_BLOOM_BITS (SEARCH_BLOOM_WORDS * 64)
+
+/* 正規表現検索で集める一致の上限 */
+#define SEARCH_MAX_MATCHES 100000
+
+/* 固定文字列の検索でメインループの1回に調べる行数（飛ばしたグループも1と数える） */
+#define SEARCH_SLICE_LINES 4096
+
+/* ワーカーが一致をUIに渡す間隔（行数） */
+#define SEARCH_PUBLISH_LINES 256
+
+/* 正規表現の一致（列 [x0, x1)） */
+typedef struct {
+    uint64_t seq;           /* 行の通し番号 */
+    int x0;                 /* 開始列 */
+    int x1;                 /* 終了列（含まない） */
+} SearchMatch;
+
+/* 一致の配列 */
+typedef struct {
+    SearchMatch *items;     /* 一致 */
+    int count;              /* 一致の数 */
+    int capacity;           /* itemsの要素数 */
+} MatchList;
+
+/* 正規表現に渡す1行分のUTF-8文字列 */
+typedef struct {
+    char *bytes;            /* UTF-8文字列（NUL終端） */
+    int *cols;              /* バイト → 列（最後の要素は行末の列） */
+    int capacity;           /* bytes/colsの要素数 */
+} RegexLine;
+
+/* 正規表現検索の仕事（UIが作ってワーカーに渡し、以後はワーカーだけが触る） */
+typedef struct {
+    uint64_t generation;    /* 世代 */
+    regex_t regex;          /* コンパイル済みの正規表現 */
+    ScrollbackSnapshot snapshot;  /* スクロールバックのスナップショット */
+    uint32_t *screen;       /* 画面の行の文字（rows×cols） */
+    int rows;               /* 画面の行数 */
+    int cols;               /* 画面の列数 */
+} RegexJob;
+
+/* 検索の状態（UIのスレッドだけが触る） */
+static struct {
+    bool active;                        /* 検索モード中か */
+    uint32_t query[SEARCH_MAX_QUERY];   /* 検索文字列（入力したまま） */
+    uint32_t folded[SEARCH_MAX_QUERY];  /* 検索文字列（ASCIIは小文字に揃える） */
+    int query_len;                      /* 検索文字列の長さ */
+    bool has_match;                     /* 現在の一致があるか */
+    uint64_t match_seq;                 /* 現在の一致の行の通し番号 */
+    int match_x;                        /* 現在の一致の開始列 */
+    uint32_t *text;                     /* 行の文字列の作業用配列 */
+    int *pos;                           /* 文字 → 列の作業用配列 */
+    int text_capacity;                  /* text/posの要素数 */
+    /* 固定文字列の検索の続き（メインループの1回にSEARCH_SLICE_LINES行ずつ調べる） */
+    bool scanning;                      /* 続きを探している途中か */
+    uint64_t scan_seq;                  /* 次に調べる行の通し番号 */
+    uint64_t scan_start_seq;            /* 探し始めた行の通し番号（この行だけ列で絞る） */
+    int scan_x;                         /* 探し始めた列 */
+    bool scan_inclusive;                /* 探し始めた列の一致を含めるか */
+    int scan_direction;                 /* 探す方向 */
+    /* 正規表現検索 */
+    bool regex;                         /* 正規表現モードか */
+    bool regex_compiled;                /* regexをコンパイル済みか */
+    bool regex_error;                   /* 正規表現が誤っているか */
+    regex_t compiled;                   /* 強調表示用の正規表現（ワーカーのものとは別） */
+    uint64_t generation;                /* 実行中の検索の世代 */
+    bool running;                       /* ワーカーが検索中か */
+    bool truncated;                     /* 一致が上限に達して打ち切ったか */
+    MatchList matches;                  /* 受け取った一致（新しい順） */
+    int current;                        /* 現在の一致の位置（-1でなし） */
+    RegexLine line;                     /* 強調表示用の作業用 */
+} g_search = { .current = -1 };
+
+/* ワーカースレッドとの共有状態（generation以外はlockで守る） */
+static struct {
+    pthread_t thread;                   /* ワーカースレッド */
+    bool started;                       /* スレッドを作ったか */
+    pthread_mutex_t lock;               /* 共有状態のロック */
+    pthread_cond_t cond;                /* 仕事か終了要求が来たことの通知 */
+    RegexJob *pending;                  /* まだ取り出されていない仕事 */
+    bool quit;                          /* 終了要求 */
+    atomic_uint_fast64_t generation;    /* 最新の世代（変わったら実行中の仕事を打ち切る） */
+    uint64_t found_generation;          /* foundを受け付ける世代 */
+    MatchList found;                    /* UIがまだ受け取っていない一致（新しい順） */
+    bool finished;                      /* found_generationの検索が終わったか */
+    bool truncated;                     /* 一致が上限に達して打ち切ったか */
+    int wake_pipe[2];                   /* 一致を積んだら書いてUIのselectを起こす */
+} g_worker = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .wake_pipe = {-1, -1},
+};
+
+/* 大文字小文字を区別しないように文字を揃える（ASCIIのみ）。結合文字列は基底文字で照合する */
+static inline uint32_t fold_char(uint32_t ch)
+{
+    if (combining_is_sequence(ch)) {
+        ch = combining_base(ch);
+    }
+    return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
+
+/* 文字のハッシュ値（トライグラムのハッシュ値は3文字分を回転して合わせる） */
+static inline uint64_t char_hash(uint32_t ch)
+{
+    uint64_t h = (uint64_t)ch * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+/* トライグラムのハッシュ値 */
+static inline uint64_t trigram_hash(uint64_t a, uint64_t b, uint64_t c)
+{
+    return a ^ ((b << 21) | (b >> 43)) ^ ((c << 42) | (c >> 22));
+}
+
+/* ハッシュ値をBloomフィルタに入れる（2ビット） */
+static inline void bloom_add(uint64_t *bloom, uint64_t h)
+{
+    uint32_t b1 = (h >> 32) & (SEARCH_BLOOM_BITS - 1);
+    uint32_t b2 = (h >> 48) & (SEARCH_BLOOM_BITS - 1);
+    bloom[b1 >> 6] |= 1ULL << (b1 & 63);
+    bloom[b2 >> 6] |= 1ULL << (b2 & 63);
+}
+
+/* ハッシュ値がBloomフィルタに入っている可能性があるか */
+static inline bool bloom_test(const uint64_t *bloom, uint64_t h)
+{
+    uint32_t b1 = (h >> 32) & (SEARCH_BLOOM_BITS - 1);
+    uint32_t b2 = (h >> 48) & (SEARCH_BLOOM_BITS - 1);
+    return (bloom[b1 >> 6] >> (b1 & 63) & 1) && (bloom[b2 >> 6] >> (b2 & 63) & 1);
+}
+
+/* グループのBloomフィルタを返す（索引にないグループはNULL） */
+static uint64_t *group_bloom(const SearchIndex *index, uint64_t group)
+{
+    if (index->count == 0 || group < index->first_group ||
+        group >= index->first_group + (uint64_t)index->count) {
+        return NULL;
+    }
+    int slot = (index->head + (int)(group - index->first_group)) % index->capacity;
+    return &index->blooms[(size_t)slot * SEARCH_BLOOM_WORDS];
+}
+
+/* 末尾にグループを1個加える（足りなければリングを広げる） */
+static int append_group(SearchIndex *index)
+{
+    if (index->count == index->capacity) {
+        int new_capacity = index->capacity ? index->capacity * 2 : SEARCH_INITIAL_GROUPS;
+        uint64_t *blooms = malloc((size_t)new_capacity * SEARCH_BLOOM_WORDS * sizeof(uint64_t));
+        if (!blooms) {
+            return -1;
+        }
+        for (int i = 0; i < index->count; i++) {
+            memcpy(&blooms[(size_t)i * SEARCH_BLOOM_WORDS],
+                   &index->blooms[(size_t)((index->head + i) % index->capacity) * SEARCH_BLOOM_WORDS],
+                   SEARCH_BLOOM_WORDS * sizeof(uint64_t));
+        }
+        free(index->blooms);
+        index->blooms = blooms;
+        index->capacity = new_capacity;
+        index->head = 0;
+    }
+    int slot = (index->head + index->count) % index->capacity;
+    memset(&index->blooms[(size_t)slot * SEARCH_BLOOM_WORDS], 0, SEARCH_BLOOM_WORDS * sizeof(uint64_t));
+    index->count++;
+    return 0;
+}
+
+/**
+ * 検索索引を初期化する
+ */
+void search_index_init(SearchIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * 検索索引を解放する
+ */
+void search_index_free(SearchIndex *index)
+{
+    free(index->blooms);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * スクロールバックに入った行を索引に加える
+ */
+void search_index_add(SearchIndex *index, const Cell *cells, int cols, uint64_t seq)
+{
+    uint64_t group = seq / SEARCH_GROUP_LINES;
+    if (index->count == 0) {
+        index->first_group = group;
+    }
+    while (group >= index->first_group + (uint64_t)index->count) {
+        if (append_group(index) < 0) {
+            return;  /* 索引にない行は検索時にそのまま調べる */
+        }
+    }
+    /* 上限を超えたら最古のグループを捨てる（履歴には残るが検索時にそのまま調べる） */
+    while (index->count > SEARCH_MAX_GROUPS) {
+        index->head = (index->head + 1) % index->capacity;
+        index->first_group++;
+        index->count--;
+    }
+    uint64_t *bloom = group_bloom(index, group);
+    if (!bloom) {
+        return;
+    }
+
+    /* 末尾の空白は索引に入れない */
+    while (cols > 0 && cells[cols - 1].ch == ' ') {
+        cols--;
+    }
+
+    uint32_t prev = 0;
+    uint64_t ha = 0, hb = 0;
+    int n = 0;
+    int run = 0;
+    for (int x = 0; x < cols; x++) {
+        uint32_t ch = cells[x].ch;
+        if (ch == WIDE_CHAR_CONTINUATION) {
+            continue;
+        }
+        ch = fold_char(ch);
+
+        /* 同じ文字が続く間は同じトライグラムなので1回だけ入れる（空白の連続など） */
+        run = (n > 0 && ch == prev) ? run + 1 : 0;
+        if (run >= 3) {
+            continue;
+        }
+        uint64_t hc = char_hash(ch);
+        if (++n >= 3) {
+            bloom_add(bloom, trigram_hash(ha, hb, hc));
+        }
+        ha = hb;
+        hb = hc;
+        prev = ch;
+    }
+}
+
+/**
+ * 履歴から落ちた行のグループを捨てる
+ */
+void search_index_prune(SearchIndex *index, uint64_t first_seq)
+{
+    uint64_t first_group = first_seq / SEARCH_GROUP_LINES;
+    while (index->count > 0 && index->first_group < first_group) {
+        index->head = (index->head + 1) % index->capacity;
+        index->first_group++;
+        index->count--;
+    }
+}
+
+/* 履歴の行インデックスのセル列を取得する（0=スクロールバックの最古、以降は画面の行） */
+static const Cell *history_line(int line, int *cols)
+{
+    extern TerminalBuffer g_terminal;
+
+    int count = g_terminal.scrollback.count;
+    if (line < count) {
+        ScrollbackLine sl;
+        if (!terminal_get_scrollback_line(line, &sl)) {
+            return NULL;
+        }
+        *cols = sl.cols;
+        return sl.cells;
+    }
+    int y = line - count;
+    if (y >= g_terminal.rows) {
+        return NULL;
+    }
+    *cols = g_terminal.cols;
+    return terminal_get_cell(0, y);
+}
+
+/*
+ * 行の文字を検索用の文字列に写す（全角文字の2セル目を飛ばし、文字ごとの列を記録）
+ * 末尾の空白は索引（search_index_add）と同じく含めない（履歴の行は表示幅まで空白で埋まっているため）
+ */
+static int line_text(const Cell *cells, int cols)
+{
+    while (cols > 0 && cells[cols - 1].ch == ' ') {
+        cols--;
+    }
+    if (g_search.text_capacity < cols) {
+        uint32_t *text = realloc(g_search.text, cols * sizeof(uint32_t));
+        if (text) {
+            g_search.text = text;
+        }
+        int *pos = realloc(g_search.pos, cols * sizeof(int));
+        if (pos) {
+            g_search.pos = pos;
+        }
+        if (!text || !pos) {
+            return 0;
+        }
+        g_search.text_capacity = cols;
+    }
+
+    int n = 0;
+    for (int x = 0; x < cols; x++) {
+        if (cells[x].ch == WIDE_CHAR_CONTINUATION) {
+            continue;
+        }
+        g_search.text[n] = fold_char(cells[x].ch);
+        g_search.pos[n] = x;
+        n++;
+    }
+    return n;
+}
+
+/* 文字列のi文字目から検索文字列が一致するか */
+static inline bool match_at(int i)
+{
+    return memcmp(&g_search.text[i], g_search.folded, g_search.query_len * sizeof(uint32_t)) == 0;
+}
+
+/*
+ * 行の中で一致を探す（line_textで写した文字列を対象に、文字の位置で返す）
+ * SEARCH_OLDERなら開始列がlimit_x以前（inclusiveでなければより前）の最後の一致、
+ * SEARCH_NEWERなら開始列がlimit_x以降（inclusiveでなければより後）の最初の一致
+ */
+static int find_in_text(int n, int limit_x, bool inclusive, int direction)
+{
+    int last = n - g_search.query_len;
+    if (direction == SEARCH_OLDER) {
+        for (int i = last; i >= 0; i--) {
+            int x = g_search.pos[i];
+            if ((x < limit_x || (inclusive && x == limit_x)) && match_at(i)) {
+                return i;
+            }
+        }
+    } else {
+        for (int i = 0; i <= last; i++) {
+            int x = g_search.pos[i];
+            if ((x > limit_x || (inclusive && x == limit_x)) && match_at(i)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/* 一致した行が見えるように表示位置を動かす（見えていれば動かさない） */
+static void scroll_to_line(int line)
+{
+    extern TerminalBuffer g_terminal;
+
+    int count = g_terminal.scrollback.count;
+    int top = count - terminal_get_scroll_offset();
+    if (line < top || line >= top + g_terminal.rows) {
+        /* 画面の中央に来るようにする（範囲外はterminal_set_scroll_offsetが収める） */
+        terminal_set_scroll_offset(count - line + g_terminal.rows / 2);
+    }
+    terminal_mark_all_dirty();
+}
+
+/*
+ * 固定文字列の検索の続きをSEARCH_SLICE_LINES行まで調べ、見つかれば現在の一致にして表示位置を動かす
+ * スクロールバックの行はBloomフィルタで検索文字列のトライグラムを含みえないグループを飛ばす。
+ * 位置は行の通し番号で覚えるので、途中で行がスクロールバックに入ったり履歴から落ちたりしてもよい。
+ */
+static bool scan_slice(void)
+{
+    extern TerminalBuffer g_terminal;
+
+    int qlen = g_search.query_len;
+    if (qlen == 0) {
+        g_search.scanning = false;
+        return false;
+    }
+
+    uint64_t hashes[SEARCH_MAX_QUERY];
+    int nhashes = 0;
+    for (int i = 2; i < qlen; i++) {
+        hashes[nhashes++] = trigram_hash(char_hash(g_search.folded[i - 2]), char_hash(g_search.folded[i - 1]),
+                                         char_hash(g_search.folded[i]));
+    }
+
+    const SearchIndex *index = &g_terminal.search_index;
+    uint64_t first_seq = g_terminal.scrollback.first_seq;
+    int count = g_terminal.scrollback.count;
+    int total = count + g_terminal.rows;
+    int direction = g_search.scan_direction;
+
+    if (g_search.scan_seq < first_seq) {
+        if (direction == SEARCH_OLDER) {
+            g_search.scanning = false;  /* 残りの行は履歴から落ちた */
+            return false;
+        }
+        g_search.scan_seq = first_seq;
+    }
+    uint64_t offset = g_search.scan_seq - first_seq;
+    int l = (offset < (uint64_t)total) ? (int)offset : (direction == SEARCH_OLDER ? total - 1 : total);
+
+    for (int budget = SEARCH_SLICE_LINES; l >= 0 && l < total; l += direction, budget--) {
+        if (budget == 0) {
+            g_search.scan_seq = first_seq + l;
+            return false;  /* 続きは次のsearch_pollで */
+        }
+        if (l < count && nhashes == 0) {
+            /* 3文字未満はインデックスで絞れず入力のたびに全履歴を調べることになるので、画面の行だけを探す */
+            if (direction == SEARCH_OLDER) {
+                break;
+            }
+            l = count - 1;
+            continue;
+        }
+        uint64_t seq = first_seq + l;
+        if (l < count) {
+            uint64_t group = seq / SEARCH_GROUP_LINES;
+            const uint64_t *bloom = group_bloom(index, group);
+            bool maybe = true;
+            for (int i = 0; bloom && maybe && i < nhashes; i++) {
+                maybe = bloom_test(bloom, hashes[i]);
+            }
+            if (!maybe) {
+                /* グループの端まで飛ばす */
+                if (direction == SEARCH_OLDER) {
+                    l = (int)((int64_t)(group * SEARCH_GROUP_LINES) - (int64_t)first_seq);
+                } else {
+                    l = (int)((group + 1) * SEARCH_GROUP_LINES - first_seq) - 1;
+                }
+                continue;
+            }
+        }
+
+        int cols;
+        const Cell *cells = history_line(l, &cols);
+        if (!cells) {
+            continue;
+        }
+        bool start_line = (seq == g_search.scan_start_seq);
+        int n = line_text(cells, cols);
+        int limit = start_line ? g_search.scan_x : (direction == SEARCH_OLDER ? cols : -1);
+        int i = find_in_text(n, limit, !start_line || g_search.scan_inclusive, direction);
+        if (i >= 0) {
+            g_search.scanning = false;
+            g_search.has_match = true;
+            g_search.match_seq = seq;
+            g_search.match_x = g_search.pos[i];
+            scroll_to_line(l);
+            return true;
+        }
+    }
+    g_search.scanning = false;
+    return false;
+}
+
+/*
+ * 行line・列xから方向directionに一致を探し始める（最初のSEARCH_SLICE_LINES行はその場で調べる）
+ * 見つからないまま行が残ったら、続きはメインループから呼ばれるsearch_pollで調べる
+ */
+static bool search_from(int line, int x, bool inclusive, int direction)
+{
+    extern TerminalBuffer g_terminal;
+
+    g_search.scanning = true;
+    g_search.scan_seq = g_terminal.scrollback.first_seq + line;
+    g_search.scan_start_seq = g_search.scan_seq;
+    g_search.scan_x = x;
+    g_search.scan_inclusive = inclusive;
+    g_search.scan_direction = direction;
+    return scan_slice();
+}
+
+/* 検索文字列が変わったので、現在の一致の位置（なければ最新の行）から古い方へ探し直す */
+static void research(void)
+{
+    extern TerminalBuffer g_terminal;
+
+    int count = g_terminal.scrollback.count;
+    int line = count + g_terminal.rows - 1;
+    int x = g_terminal.cols;
+    /* 3文字未満は画面の行しか探さないので、履歴の中の一致からは探し直さない */
+    if (g_search.has_match && g_search.match_seq >= g_terminal.scrollback.first_seq &&
+        (g_search.query_len >= 3 || g_search.match_seq >= g_terminal.scrollback.first_seq + count)) {
+        line = (int)(g_search.match_seq - g_terminal.scrollback.first_seq);
+        x = g_search.match_x;
+    }
+    g_search.has_match = false;
+    search_from(line, x, true, SEARCH_OLDER);
+    terminal_mark_all_dirty();
+}
+
+/* 一致を配列の末尾に加える */
+static int append_match(MatchList *list, const SearchMatch *match)
+{
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        SearchMatch *items = realloc(list->items, new_capacity * sizeof(SearchMatch));
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = new_capacity;
+    }
+    list->items[list->count++] = *match;
+    return 0;
+}
+
+/* 行の文字をUTF-8に変換する（全角文字の2セル目と末尾の空白は除き、バイトごとの列を記録）。バイト数を返す */
+static int encode_line(RegexLine *line, const uint32_t *text, int len)
+{
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == 0)) {
+        len--;
+    }
+    if (line->capacity < len * 4 * COMBINING_MAX_CODEPOINTS + 1) {
+        int capacity = len * 4 * COMBINING_MAX_CODEPOINTS + 1;
+        char *bytes = realloc(line->bytes, capacity);
+        if (bytes) {
+            line->bytes = bytes;
+        }
+        int *cols = realloc(line->cols, capacity * sizeof(int));
+        if (cols) {
+            line->cols = cols;
+        }
+        if (!bytes || !cols) {
+            return -1;
+        }
+        line->capacity = capacity;
+    }
+
+    int n = 0;
+    for (int x = 0; x < len; x++) {
+        uint32_t ch = text[x];
+        if (ch == WIDE_CHAR_CONTINUATION) {
+            continue;
+        }
+        if (ch == 0) {
+            ch = ' ';
+        }
+        /* 結合文字は基底文字と同じ列のバイトとして続ける */
+        uint32_t cps[COMBINING_MAX_CODEPOINTS];
+        int ncps = combining_expand(ch, cps);
+        int start = n;
+        for (int k = 0; k < ncps; k++) {
+            n += utf8_encode(cps[k], &line->bytes[n]);
+        }
+        for (int b = start; b < n; b++) {
+            line->cols[b] = x;
+        }
+    }
+    line->bytes[n] = '\0';
+    line->cols[n] = len;
+    return n;
+}
+
+/*
+ * encode_lineで変換した行の*startバイト目以降で次の一致を探す（空の一致は飛ばす）
+ * 見つかれば列の範囲を返し、*startを一致の後ろへ進める
+ */
+static bool next_regex_match(const regex_t *regex, const RegexLine *line, int nbytes, int *start,
+                             int *x0, int *x1)
+{
+    while (*start <= nbytes) {
+        regmatch_t m;
+        if (regexec(regex, line->bytes + *start, 1, &m, *start > 0 ? REG_NOTBOL : 0) != 0) {
+            return false;
+        }
+        int so = *start + (int)m.rm_so;
+        int eo = *start + (int)m.rm_eo;
+        if (eo > so) {
+            *start = eo;
+            *x0 = line->cols[so];
+            *x1 = line->cols[eo];
+            return true;
+        }
+        /* 空の一致は次の文字から探し直す */
+        *start = eo + 1;
+        while (*start < nbytes && (line->bytes[*start] & 0xC0) == 0x80) {
+            (*start)++;
+        }
+    }
+    return false;
+}
+
+/* 検索文字列をUTF-8に変換する */
+static void query_utf8(char *out, int size)
+{
+    RegexLine line = {0};
+    int n = encode_line(&line, g_search.query, g_search.query_len);
+    if (n < 0 || n >= size) {
+        n = 0;
+    } else {
+        memcpy(out, line.bytes, n);
+    }
+    out[n] = '\0';
+    free(line.bytes);
+    free(line.cols);
+}
+
+/* 仕事を解放する */
+static void free_job(RegexJob *job)
+{
+    if (!job) {
+        return;
+    }
+    regfree(&job->regex);
+    scrollback_snapshot_free(&job->snapshot);
+    free(job->screen);
+    free(job);
+}
+
+/* 見つけた一致をUIに渡す（世代が変わっていれば捨てる）。UIのselectを起こす */
+static void publish_matches(uint64_t generation, MatchList *batch, bool finished, bool truncated)
+{
+    pthread_mutex_lock(&g_worker.lock);
+    if (g_worker.found_generation == generation) {
+        for (int i = 0; i < batch->count; i++) {
+            if (append_match(&g_worker.found, &batch->items[i]) < 0) {
+                break;
+            }
+        }
+        g_worker.finished = finished;
+        g_worker.truncated = truncated;
+    }
+    pthread_mutex_unlock(&g_worker.lock);
+    batch->count = 0;
+
+    char c = 0;
+    ssize_t n = write(g_worker.wake_pipe[1], &c, 1);
+    (void)n;  /* パイプがいっぱいならUIはすでに起きる */
+}
+
+/* 仕事を実行する（新しい行から古い行へ、画面の行、続いてスナップショットの行を調べる） */
+static void run_job(RegexJob *job, RegexLine *line, MatchList *batch)
+{
+    ScrollbackSnapshot *snap = &job->snapshot;
+    int total = 0;
+    int since_publish = 0;
+    bool truncated = false;
+
+    for (int l = snap->count + job->rows - 1; l >= 0; l--) {
+        if (atomic_load(&g_worker.generation) != job->generation) {
+            return;  /* 検索文字列が変わった */
+        }
+
+        const uint32_t *text;
+        int len;
+        if (l >= snap->count) {
+            text = &job->screen[(size_t)(l - snap->count) * job->cols];
+            len = job->cols;
+        } else if (!scrollback_snapshot_line(snap, l, &text, &len)) {
+            continue;
+        }
+
+        int nbytes = encode_line(line, text, len);
+        if (nbytes < 0) {
+            continue;
+        }
+        /* 1行の一致は左から見つかるので、新しい順に並ぶように行の中では逆にする */
+        int first = batch->count;
+        int start = 0;
+        SearchMatch match = { .seq = snap->first_seq + l };
+        while (next_regex_match(&job->regex, line, nbytes, &start, &match.x0, &match.x1)) {
+            if (total + (batch->count - first) >= SEARCH_MAX_MATCHES) {
+                truncated = true;
+                break;
+            }
+            if (append_match(batch, &match) < 0) {
+                break;
+            }
+        }
+        for (int a = first, b = batch->count - 1; a < b; a++, b--) {
+            SearchMatch tmp = batch->items[a];
+            batch->items[a] = batch->items[b];
+            batch->items[b] = tmp;
+        }
+        total += batch->count - first;
+        if (truncated) {
+            break;
+        }
+
+        if (++since_publish >= SEARCH_PUBLISH_LINES && batch->count > 0) {
+            publish_matches(job->generation, batch, false, false);
+            since_publish = 0;
+        }
+    }
+    publish_matches(job->generation, batch, true, truncated);
+}
+
+/* ワーカースレッド（仕事を待って実行する） */
+static void *regex_worker(void *arg)
+{
+    (void)arg;
+    RegexLine line = {0};
+    MatchList batch = {0};
+
+    pthread_mutex_lock(&g_worker.lock);
+    for (;;) {
+        while (!g_worker.pending && !g_worker.quit) {
+            pthread_cond_wait(&g_worker.cond, &g_worker.lock);
+        }
+        if (g_worker.quit) {
+            break;
+        }
+        RegexJob *job = g_worker.pending;
+        g_worker.pending = NULL;
+        pthread_mutex_unlock(&g_worker.lock);
+
+        run_job(job, &line, &batch);
+        batch.count = 0;
+        free_job(job);
+
+        pthread_mutex_lock(&g_worker.lock);
+    }
+    pthread_mutex_unlock(&g_worker.lock);
+
+    free(line.bytes);
+    free(line.cols);
+    free(batch.items);
+    return NULL;
+}
+
+/* ワーカースレッドと起床用のパイプを用意する（初回だけ） */
+static int start_worker(void)
+{
+    if (g_worker.started) {
+        return 0;
+    }
+    if (pipe2(g_worker.wake_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        fprintf(stderr, "警告: 検索用のパイプを作成できません: %s\n", strerror(errno));
+        return -1;
+    }
+    int err = pthread_create(&g_worker.thread, NULL, regex_worker, NULL);
+    if (err != 0) {
+        fprintf(stderr, "警告: 検索用のスレッドを作成できません: %s\n", strerror(err));
+        close(g_worker.wake_pipe[0]);
+        close(g_worker.wake_pipe[1]);
+        g_worker.wake_pipe[0] = g_worker.wake_pipe[1] = -1;
+        return -1;
+    }
+    g_worker.started = true;
+    return 0;
+}
+
+/* 実行中・待機中の正規表現検索を打ち切り、受け取った一致を捨てる */
+static void cancel_regex(void)
+{
+    uint64_t generation = atomic_fetch_add(&g_worker.generation, 1) + 1;
+
+    pthread_mutex_lock(&g_worker.lock);
+    RegexJob *pending = g_worker.pending;
+    g_worker.pending = NULL;
+    g_worker.found_generation = generation;
+    g_worker.found.count = 0;
+    g_worker.finished = false;
+    g_worker.truncated = false;
+    pthread_mutex_unlock(&g_worker.lock);
+    free_job(pending);
+
+    g_search.generation = generation;
+    g_search.running = false;
+    g_search.truncated = false;
+    g_search.regex_error = false;
+    g_search.matches.count = 0;
+    g_search.current = -1;
+    g_search.has_match = false;
+    if (g_search.regex_compiled) {
+        regfree(&g_search.compiled);
+        g_search.regex_compiled = false;
+    }
+}
+
+/*
+ * 検索文字列の正規表現でワーカーに検索させる（結果はsearch_pollで受け取る）
+ * スナップショットを作るのはこのスレッドで、書き込み中のブロックとホット層の文字列を写すだけ
+ */
+static void regex_restart(void)
+{
+    extern TerminalBuffer g_terminal;
+
+    cancel_regex();
+    terminal_mark_all_dirty();
+    if (g_search.query_len == 0) {
+        return;
+    }
+
+    char pattern[SEARCH_MAX_QUERY * 4 + 1];
+    query_utf8(pattern, sizeof(pattern));
+    if (regcomp(&g_search.compiled, pattern, REG_EXTENDED | REG_ICASE) != 0) {
+        g_search.regex_error = true;
+        return;
+    }
+    g_search.regex_compiled = true;
+
+    if (start_worker() < 0) {
+        return;
+    }
+    RegexJob *job = calloc(1, sizeof(RegexJob));
+    if (!job) {
+        return;
+    }
+    job->snapshot.fd = -1;
+    if (regcomp(&job->regex, pattern, REG_EXTENDED | REG_ICASE) != 0) {
+        free(job);
+        return;
+    }
+    job->generation = g_search.generation;
+    job->rows = g_terminal.rows;
+    job->cols = g_terminal.cols;
+    job->screen = malloc((size_t)job->rows * job->cols * sizeof(uint32_t));
+    if (!job->screen || scrollback_snapshot_take(&g_terminal.scrollback, &job->snapshot) < 0) {
+        free_job(job);
+        return;
+    }
+    for (int y = 0; y < job->rows; y++) {
+        const Cell *cells = terminal_get_cell(0, y);
+        for (int x = 0; x < job->cols; x++) {
+            job->screen[(size_t)y * job->cols + x] = cells[x].ch;
+        }
+    }
+
+    pthread_mutex_lock(&g_worker.lock);
+    g_worker.pending = job;
+    pthread_cond_signal(&g_worker.cond);
+    pthread_mutex_unlock(&g_worker.lock);
+    g_search.running = true;
+}
+
+/* 受け取った一致のi番目を現在の一致にして表示位置を動かす（履歴から落ちた行ならfalse） */
+static bool select_match(int i)
+{
+    extern TerminalBuffer g_terminal;
+
+    const SearchMatch *match = &g_search.matches.items[i];
+    if (match->seq < g_terminal.scrollback.first_seq) {
+        return false;
+    }
+    g_search.current = i;
+    g_search.has_match = true;
+    g_search.match_seq = match->seq;
+    g_search.match_x = match->x0;
+    scroll_to_line((int)(match->seq - g_terminal.scrollback.first_seq));
+    return true;
+}
+
+/* 検索文字列が変わったので探し直す */
+static void restart(void)
+{
+    g_search.scanning = false;
+    if (g_search.regex) {
+        regex_restart();
+    } else {
+        research();
+    }
+}
+
+/**
+ * 検索モードを開始する
+ */
+void search_begin(void)
+{
+    g_search.active = true;
+    g_search.query_len = 0;
+    g_search.has_match = false;
+    g_search.scanning = false;
+    cancel_regex();
+    terminal_mark_all_dirty();
+}
+
+/**
+ * 検索モードを終了する
+ */
+void search_end(void)
+{
+    cancel_regex();
+    g_search.active = false;
+    g_search.has_match = false;
+    g_search.scanning = false;
+    free(g_search.text);
+    free(g_search.pos);
+    g_search.text = NULL;
+    g_search.pos = NULL;
+    g_search.text_capacity = 0;
+    free(g_search.matches.items);
+    memset(&g_search.matches, 0, sizeof(g_search.matches));
+    free(g_search.line.bytes);
+    free(g_search.line.cols);
+    memset(&g_search.line, 0, sizeof(g_search.line));
+    terminal_mark_all_dirty();
+}
+
+/**
+ * 検索のワーカースレッドを止めて後始末する
+ */
+void search_cleanup(void)
+{
+    search_end();
+    if (!g_worker.started) {
+        return;
+    }
+    atomic_fetch_add(&g_worker.generation, 1);
+    pthread_mutex_lock(&g_worker.lock);
+    g_worker.quit = true;
+    pthread_cond_signal(&g_worker.cond);
+    pthread_mutex_unlock(&g_worker.lock);
+    pthread_join(g_worker.thread, NULL);
+
+    close(g_worker.wake_pipe[0]);
+    close(g_worker.wake_pipe[1]);
+    g_worker.wake_pipe[0] = g_worker.wake_pipe[1] = -1;
+    free(g_worker.found.items);
+    memset(&g_worker.found, 0, sizeof(g_worker.found));
+    g_worker.started = false;
+    g_worker.quit = false;
+}
+
+/**
+ * 検索モード中か
+ */
+bool search_is_active(void)
+{
+    return g_search.active;
+}
+
+/**
+ * 正規表現モードを切り替えて検索し直す
+ */
+void search_toggle_regex(void)
+{
+    g_search.regex = !g_search.regex;
+    cancel_regex();
+    restart();
+    terminal_mark_all_dirty();
+}
+
+/**
+ * 正規表現モードか
+ */
+bool search_is_regex(void)
+{
+    return g_search.regex;
+}
+
+/**
+ * 検索文字列に文字を追加して検索し直す
+ */
+void search_input(const char *text, int len)
+{
+    Utf8Decoder dec = {0};
+    uint32_t chars[SEARCH_MAX_QUERY];
+    size_t n = 0;
+    utf8_decode_block(&dec, (const unsigned char *)text, len, chars, SEARCH_MAX_QUERY, &n);
+
+    bool changed = false;
+    for (size_t i = 0; i < n && g_search.query_len < SEARCH_MAX_QUERY; i++) {
+        g_search.query[g_search.query_len] = chars[i];
+        g_search.folded[g_search.query_len] = fold_char(chars[i]);
+        g_search.query_len++;
+        changed = true;
+    }
+    if (changed) {
+        restart();
+    }
+}
+
+/**
+ * 検索文字列の最後の1文字を消して検索し直す
+ */
+void search_backspace(void)
+{
+    if (g_search.query_len == 0) {
+        return;
+    }
+    g_search.query_len--;
+    restart();
+}
+
+/**
+ * 次の一致へ移動する
+ */
+bool search_next(int direction)
+{
+    extern TerminalBuffer g_terminal;
+
+    if (g_search.regex) {
+        /* 受け取った一致は新しい順に並んでいる */
+        int step = (direction == SEARCH_OLDER) ? 1 : -1;
+        int start = g_search.current < 0 ? 0 : g_search.current + step;
+        for (int i = start; i >= 0 && i < g_search.matches.count; i += step) {
+            if (select_match(i)) {
+                return true;
+            }
+            if (direction == SEARCH_OLDER) {
+                break;  /* これより古い一致はすべて履歴から落ちている */
+            }
+        }
+        return false;
+    }
+
+    if (g_search.scanning) {
+        return false;  /* 前の検索の続きを探している */
+    }
+    if (!g_search.has_match || g_search.match_seq < g_terminal.scrollback.first_seq) {
+        research();
+        return g_search.has_match;
+    }
+    int line = (int)(g_search.match_seq - g_terminal.scrollback.first_seq);
+    return search_from(line, g_search.match_x, false, direction);
+}
+
+/**
+ * 正規表現検索の起床用ファイルディスクリプタを取得する
+ */
+int search_wakeup_fd(void)
+{
+    return g_worker.wake_pipe[0];
+}
+
+/**
+ * 固定文字列の検索の続きを探しているか
+ */
+bool search_is_scanning(void)
+{
+    return g_search.scanning;
+}
+
+/**
+ * 固定文字列の検索の続きを調べ、ワーカーが見つけた一致を受け取る
+ */
+void search_poll(void)
+{
+    char buf[64];
+    while (g_worker.wake_pipe[0] >= 0 && read(g_worker.wake_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+
+    if (g_search.scanning) {
+        scan_slice();
+        if (!g_search.scanning) {
+            terminal_mark_all_dirty();  /* 入力欄の状態を更新する */
+        }
+    }
+
+    if (!g_search.running) {
+        return;
+    }
+    int before = g_search.matches.count;
+    bool finished = false;
+    pthread_mutex_lock(&g_worker.lock);
+    if (g_worker.found_generation == g_search.generation) {
+        for (int i = 0; i < g_worker.found.count; i++) {
+            if (append_match(&g_search.matches, &g_worker.found.items[i]) < 0) {
+                break;
+            }
+        }
+        g_worker.found.count = 0;
+        finished = g_worker.finished;
+        g_search.truncated = g_worker.truncated;
+    }
+    pthread_mutex_unlock(&g_worker.lock);
+
+    if (finished) {
+        g_search.running = false;
+    }
+    if (g_search.current < 0) {
+        /* 最初に見つかった（最も新しい）一致へ移動する */
+        for (int i = before; i < g_search.matches.count && !select_match(i); i++) {
+        }
+    }
+    if (finished || g_search.matches.count != before) {
+        terminal_mark_all_dirty();
+    }
+}
+
+/**
+ * 検索文字列を取得する
+ */
+const uint32_t *search_get_query(int *len)
+{
+    *len = g_search.query_len;
+    return g_search.query;
+}
+
+/**
+ * 現在の一致があるか
+ */
+bool search_has_match(void)
+{
+    return g_search.has_match;
+}
+
+/**
+ * 入力欄に出す検索の状態を取得する
+ */
+void search_get_status(char *buf, int size)
+{
+    buf[0] = '\0';
+    if (g_search.query_len == 0) {
+        return;
+    }
+    if (g_search.regex_error) {
+        snprintf(buf, size, "  (正規表現の誤り)");
+    } else if (g_search.regex && g_search.running) {
+        snprintf(buf, size, "  (検索中 %d件)", g_search.matches.count);
+    } else if (g_search.scanning) {
+        snprintf(buf, size, "  (検索中)");
+    } else if (!g_search.has_match && !g_search.regex && g_search.query_len < 3) {
+        snprintf(buf, size, "  (履歴は3文字から検索)");
+    } else if (!g_search.has_match) {
+        snprintf(buf, size, "  (一致なし)");
+    } else if (g_search.regex) {
+        snprintf(buf, size, "  (%d/%d件%s)", g_search.current + 1, g_search.matches.count,
+                 g_search.truncated ? "以上" : "");
+    }
+}
+
+/* 正規表現モードで行の一致に印を付ける（表示中の行だけなので、このスレッドでコンパイル済みの正規表現を使う） */
+static void mark_regex_line(const Cell *cells, int line_cols, bool current_line, uint8_t *marks, int cols)
+{
+    if (!g_search.regex_compiled) {
+        return;
+    }
+    if (g_search.text_capacity < line_cols) {
+        uint32_t *text = realloc(g_search.text, line_cols * sizeof(uint32_t));
+        if (text) {
+            g_search.text = text;
+        }
+        int *pos = realloc(g_search.pos, line_cols * sizeof(int));
+        if (pos) {
+            g_search.pos = pos;
+        }
+        if (!text || !pos) {
+            return;
+        }
+        g_search.text_capacity = line_cols;
+    }
+    for (int x = 0; x < line_cols; x++) {
+        g_search.text[x] = cells[x].ch;
+    }
+    int nbytes = encode_line(&g_search.line, g_search.text, line_cols);
+    if (nbytes < 0) {
+        return;
+    }
+
+    int start = 0, x0, x1;
+    while (next_regex_match(&g_search.compiled, &g_search.line, nbytes, &start, &x0, &x1)) {
+        uint8_t mark = (current_line && x0 == g_search.match_x) ? SEARCH_MARK_CURRENT : SEARCH_MARK_MATCH;
+        for (int x = x0; x < x1 && x < cols; x++) {
+            marks[x] = mark;
+        }
+    }
+}
+
+/**
+ * 履歴の行の一致を強調表示用に印を付ける
+ */
+void search_mark_line(int line, uint8_t *marks, int cols)
+{
+    extern TerminalBuffer g_terminal;
+
+    memset(marks, SEARCH_MARK_NONE, cols);
+    if (!g_search.active || g_search.query_len == 0) {
+        return;
+    }
+
+    int line_cols;
+    const Cell *cells = history_line(line, &line_cols);
+    if (!cells) {
+        return;
+    }
+    bool current_line = g_search.has_match &&
+                        g_search.match_seq == g_terminal.scrollback.first_seq + (uint64_t)line;
+    if (g_search.regex) {
+        mark_regex_line(cells, line_cols, current_line, marks, cols);
+        return;
+    }
+
+    int n = line_text(cells, line_cols);
+    for (int i = 0; i + g_search.query_len <= n; i++) {
+        if (!match_at(i)) {
+            continue;
+        }
+        int x0 = g_search.pos[i];
+        int x1 = g_search.pos[i + g_search.query_len - 1] + 1;
+        if (x1 < line_cols && cells[x1].ch == WIDE_CHAR_CONTINUATION) {
+            x1++;
+        }
+        uint8_t mark = (current_line && x0 == g_search.match_x) ? SEARCH_MARK_CURRENT : SEARCH_MARK_MATCH;
+        for (int x = x0; x < x1 && x < cols; x++) {
+            marks[x] = mark;
+        }
+        i += g_search.query_len - 1;
+    }
+}
@@ -0,0 +1,175 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cell.h"
+
+/* 索引の1グループの行数（グループごとにBloomフィルタを1個持つ） */
+#define SEARCH_GROUP_LINES 64
+
+/* Bloomフィルタ1個の64ビット語数（8192ビット） */
+#define SEARCH_BLOOM_WORDS 128
+
+/* 索引に置く最大グループ数（16MB、約100万行。これより古い行は索引なしで調べる） */
+#define SEARCH_MAX_GROUPS 16384
+
+/* 検索文字列の最大長（コードポイント数） */
+#define SEARCH_MAX_QUERY 256
+
+/* 検索の方向 */
+#define SEARCH_OLDER (-1)   /* 古い行へ（上へ） */
+#define SEARCH_NEWER 1      /* 新しい行へ（下へ） */
+
+/* 検索結果の強調表示 */
+#define SEARCH_MARK_NONE 0      /* 一致していない */
+#define SEARCH_MARK_MATCH 1     /* 一致している */
+#define SEARCH_MARK_CURRENT 2   /* 現在の一致 */
+
+/*
+ * スクロールバックの検索索引
+ * 行の通し番号をSEARCH_GROUP_LINES行ずつのグループに分け、グループに含まれる
+ * トライグラム（連続する3文字、ASCIIは小文字に揃える）をBloomフィルタに入れる。
+ * 検索では文字列のトライグラムをすべて含みうるグループの行だけを調べる。
+ * グループはリングバッファに置き、履歴から落ちた行のグループとSEARCH_MAX_GROUPSを超えた古いグループは捨てる。
+ * 索引のメモリはスクロールバックの使用バイト数に含める（scrollback_set_group_overhead）。
+ */
+typedef struct {
+    uint64_t *blooms;       /* Bloomフィルタのリングバッファ（グループごとにSEARCH_BLOOM_WORDS語） */
+    int capacity;           /* 置けるグループ数 */
+    int head;               /* 最古のグループの位置 */
+    int count;              /* グループ数 */
+    uint64_t first_group;   /* 最古のグループの番号（行の通し番号 / SEARCH_GROUP_LINES） */
+} SearchIndex;
+
+/* 関数プロトタイプ */
+
+/**
+ * 検索索引を初期化する
+ * @param index 検索索引
+ */
+void search_index_init(SearchIndex *index);
+
+/**
+ * 検索索引を解放する
+ * @param index 検索索引
+ */
+void search_index_free(SearchIndex *index);
+
+/**
+ * スクロールバックに入った行を索引に加える
+ * @param index 検索索引
+ * @param cells 行のセル配列
+ * @param cols 列数
+ * @param seq 行の通し番号
+ */
+void search_index_add(SearchIndex *index, const Cell *cells, int cols, uint64_t seq);
+
+/**
+ * 履歴から落ちた行のグループを捨てる
+ * @param index 検索索引
+ * @param first_seq 履歴に残っている最古の行の通し番号
+ */
+void search_index_prune(SearchIndex *index, uint64_t first_seq);
+
+/**
+ * 検索モードを開始する
+ */
+void search_begin(void);
+
+/**
+ * 検索モードを終了する（強調表示を消す。表示位置はそのまま）
+ */
+void search_end(void);
+
+/**
+ * 検索のワーカースレッドを止めて後始末する（終了時）
+ */
+void search_cleanup(void);
+
+/**
+ * 検索モード中か
+ * @return 検索モード中ならtrue
+ */
+bool search_is_active(void);
+
+/**
+ * 正規表現モードを切り替えて検索し直す
+ * 正規表現モードではワーカースレッドがスクロールバックのスナップショットを新しい行から順に調べ、
+ * 見つけた一致を少しずつUIに渡す（search_pollで受け取る）。検索文字列が変わると打ち切る。
+ */
+void search_toggle_regex(void);
+
+/**
+ * 正規表現モードか
+ * @return 正規表現モードならtrue
+ */
+bool search_is_regex(void);
+
+/**
+ * 検索文字列に文字を追加して検索し直す
+ * @param text UTF-8文字列
+ * @param len バイト数
+ */
+void search_input(const char *text, int len);
+
+/**
+ * 検索文字列の最後の1文字を消して検索し直す
+ */
+void search_backspace(void);
+
+/**
+ * 次の一致へ移動する（見つかれば表示位置を動かす。前の検索の続きを探している間は何もしない）
+ * 固定文字列の検索はメインループを止めないように少しずつ調べ、続きはsearch_pollで探す。
+ * @param direction SEARCH_OLDERまたはSEARCH_NEWER
+ * @return その場で見つかればtrue
+ */
+bool search_next(int direction);
+
+/**
+ * 正規表現検索の起床用ファイルディスクリプタを取得する（一致を見つけると読めるようになる）
+ * @return ファイルディスクリプタ（ワーカーを起動していなければ-1）
+ */
+int search_wakeup_fd(void);
+
+/**
+ * 固定文字列の検索の続きを探しているか（その間メインループは待たずにsearch_pollを呼ぶ）
+ * @return 続きを探している途中ならtrue
+ */
+bool search_is_scanning(void);
+
+/**
+ * 固定文字列の検索の続きを調べ、ワーカーが見つけた一致を受け取る（現在の一致がなければ最初の一致へ移動する）
+ * 起床用ファイルディスクリプタが読めるようになったときと、search_is_scanningの間はメインループから呼ぶ
+ */
+void search_poll(void);
+
+/**
+ * 検索文字列を取得する
+ * @param len 長さ（コードポイント数）の格納先
+ * @return コードポイント列
+ */
+const uint32_t *search_get_query(int *len);
+
+/**
+ * 現在の一致があるか
+ * @return あればtrue
+ */
+bool search_has_match(void);
+
+/**
+ * 入力欄に出す検索の状態を取得する（一致なし・検索中・件数など、なければ空文字列）
+ * @param buf 格納先
+ * @param size bufの大きさ
+ */
+void search_get_status(char *buf, int size);
+
+/**
+ * 履歴の行の一致を強調表示用に印を付ける
+ * @param line 履歴の行インデックス（0=スクロールバックの最古、スクロールバックの行数以降は画面の行）
+ * @param marks 列ごとの印の格納先（SEARCH_MARK_*）
+ * @param cols marksの要素数
+ */
+void search_mark_line(int line, uint8_t *marks, int cols);
+
+#endif /* SEARCH_H */
@@ -4,9 +4,20 @@
  */
 
 #include "terminal.h"
+#include "utf8.h"
+#include "vtparse.h"
+#include "unicode_width.h"
+#include "combining.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* スクロールバックの使用バイト数の上限を設定・問い合わせるOSCの番号 */
+#define OSC_SCROLLBACK_BYTES "7770"
 
 /* グローバルターミナルバッファ */
 TerminalBuffer g_terminal = {0};
@@ -18,98 +29,349 @@ static CellAttr g_current_attr = {
     .flags = 0
 };
 
-/* UTF-8デコード関数 */
-static int utf8_decode(const unsigned char *data, size_t size, uint32_t *codepoint)
+/* 現在の描画属性のID（g_current_attrがg_current_attr_cacheと同じ間は使い回す） */
+static uint32_t g_current_attr_id = ATTR_DEFAULT_ID;
+static CellAttr g_current_attr_cache = {
+    .fg_color = 7,
+    .bg_color = 0,
+    .flags = 0
+};
+
+/* 現在の描画属性のIDを取得（属性が変わっていればインターンし直す） */
+static uint32_t current_attr_id(void)
 {
-    if (size < 1) {
-        return 0;
+    if (g_current_attr.fg_color != g_current_attr_cache.fg_color ||
+        g_current_attr.bg_color != g_current_attr_cache.bg_color ||
+        g_current_attr.flags != g_current_attr_cache.flags ||
+        g_current_attr.fg_rgb != g_current_attr_cache.fg_rgb ||
+        g_current_attr.bg_rgb != g_current_attr_cache.bg_rgb) {
+        /* 新しいIDの参照を現在の属性が持ち、古いIDの参照を手放す */
+        uint32_t id = attr_table_intern(&g_terminal.attrs, &g_current_attr);
+        attr_table_unref(&g_terminal.attrs, g_current_attr_id);
+        g_current_attr_id = id;
+        g_current_attr_cache = g_current_attr;
     }
+    return g_current_attr_id;
+}
+
+/* 現在の描画属性のIDを手放してデフォルトに戻す */
+static void reset_current_attr_id(void)
+{
+    g_current_attr_id = ATTR_DEFAULT_ID;
+    g_current_attr_cache = (CellAttr){.fg_color = 7, .bg_color = 0, .flags = 0};
+}
 
-    unsigned char first = data[0];
+/* セルに文字と属性IDを書き込む（属性の参照を付け替える） */
+static inline void cell_set(Cell *cell, uint32_t ch, uint32_t attr_id)
+{
+    attr_table_ref(&g_terminal.attrs, attr_id);
+    attr_table_unref(&g_terminal.attrs, cell->attr);
+    cell->ch = ch;
+    cell->attr = attr_id;
+}
 
-    /* 1バイト文字 (ASCII) */
-    if ((first & 0x80) == 0) {
-        *codepoint = first;
-        return 1;
+/* セル配列の属性参照をまとめて増やす（セルを複製したとき） */
+static void cells_ref(const Cell *cells, int count)
+{
+    for (int i = 0; i < count; i++) {
+        attr_table_ref(&g_terminal.attrs, cells[i].attr);
     }
+}
 
-    /* 2バイト文字 */
-    if ((first & 0xE0) == 0xC0) {
-        if (size < 2) return 0;
-        if ((data[1] & 0xC0) != 0x80) return 0;
-        *codepoint = ((first & 0x1F) << 6) | (data[1] & 0x3F);
-        return 2;
+/* セル配列の属性参照をまとめて手放す（セル配列を解放する前） */
+static void cells_unref(const Cell *cells, int count)
+{
+    for (int i = 0; i < count; i++) {
+        attr_table_unref(&g_terminal.attrs, cells[i].attr);
     }
+}
 
-    /* 3バイト文字 */
-    if ((first & 0xF0) == 0xE0) {
-        if (size < 3) return 0;
-        if ((data[1] & 0xC0) != 0x80) return 0;
-        if ((data[2] & 0xC0) != 0x80) return 0;
-        *codepoint = ((first & 0x0F) << 12) | ((data[1] & 0x3F) << 6) | (data[2] & 0x3F);
-        return 3;
+/* 行yの列 [x0, x1) を変更済みにする */
+static inline void mark_dirty(int y, int x0, int x1)
+{
+    RowDamage *d = &g_terminal.damage[y];
+    if (x0 < d->x0) {
+        d->x0 = x0;
+    }
+    if (x1 > d->x1) {
+        d->x1 = x1;
     }
+    g_terminal.dirty = true;
+}
 
-    /* 4バイト文字 */
-    if ((first & 0xF8) == 0xF0) {
-        if (size < 4) return 0;
-        if ((data[1] & 0xC0) != 0x80) return 0;
-        if ((data[2] & 0xC0) != 0x80) return 0;
-        if ((data[3] & 0xC0) != 0x80) return 0;
-        *codepoint = ((first & 0x07) << 18) | ((data[1] & 0x3F) << 12) |
-                     ((data[2] & 0x3F) << 6) | (data[3] & 0x3F);
-        return 4;
+/* 行 [top, bottom] の全体を変更済みにする */
+static void mark_rows_dirty(int top, int bottom)
+{
+    if (top < 0) {
+        top = 0;
+    }
+    if (bottom >= g_terminal.rows) {
+        bottom = g_terminal.rows - 1;
     }
+    for (int y = top; y <= bottom; y++) {
+        g_terminal.damage[y].x0 = 0;
+        g_terminal.damage[y].x1 = g_terminal.cols;
+    }
+    g_terminal.dirty = true;
+}
 
-    /* 不正なUTF-8シーケンス */
-    return 0;
+/*
+ * 範囲 [top, bottom] の内容がn行動いたことを記録する（正で上、負で下）
+ * 変更範囲も内容と一緒に動かし、空いた行だけを変更済みにする。
+ */
+static void mark_scrolled(int top, int bottom, int n)
+{
+    ScrollDamage *scroll = &g_terminal.scroll_damage;
+    int height = bottom - top + 1;
+
+    if (g_terminal.selection.active) {
+        /* 選択のハイライトは画面に固定なので、画素をずらさずに描き直す */
+        mark_rows_dirty(top, bottom);
+        return;
+    }
+
+    if (scroll->lines != 0 && (scroll->top != top || scroll->bottom != bottom)) {
+        /* 別の範囲のスクロールとはまとめられないので、前の範囲は描き直しにする */
+        mark_rows_dirty(scroll->top, scroll->bottom);
+        scroll->lines = 0;
+    }
+
+    if (n > 0) {
+        memmove(&g_terminal.damage[top], &g_terminal.damage[top + n], (height - n) * sizeof(RowDamage));
+        mark_rows_dirty(bottom - n + 1, bottom);
+    } else {
+        memmove(&g_terminal.damage[top - n], &g_terminal.damage[top], (height + n) * sizeof(RowDamage));
+        mark_rows_dirty(top, top - n - 1);
+    }
+
+    scroll->top = top;
+    scroll->bottom = bottom;
+    scroll->lines += n;
+    if (abs(scroll->lines) >= height) {
+        /* 範囲に残る画素がない（全行が変更済み） */
+        scroll->lines = 0;
+    }
 }
 
-/* 文字幅を取得（East Asian Width） */
-static int get_char_width(uint32_t ch)
+/* セル区間を空白（デフォルト属性）で埋める（参照は手放さない: 内容を別の場所へ移したときなど） */
+static void cells_fill_blank(Cell *cells, int count)
 {
-    /* ASCII範囲 */
-    if (ch < 0x7F) {
-        return 1;
-    }
-
-    /* 全角文字の範囲を判定 */
-    if ((ch >= 0x1100 && ch <= 0x115F) ||   /* ハングル */
-        (ch >= 0x2E80 && ch <= 0x2EFF) ||   /* CJK部首補助 */
-        (ch >= 0x2F00 && ch <= 0x2FDF) ||   /* 康熙部首 */
-        (ch >= 0x3000 && ch <= 0x303F) ||   /* CJK記号・句読点 */
-        (ch >= 0x3040 && ch <= 0x309F) ||   /* ひらがな */
-        (ch >= 0x30A0 && ch <= 0x30FF) ||   /* カタカナ */
-        (ch >= 0x3100 && ch <= 0x312F) ||   /* 注音符号 */
-        (ch >= 0x3130 && ch <= 0x318F) ||   /* ハングル互換字母 */
-        (ch >= 0x3190 && ch <= 0x319F) ||   /* 漢文用記号 */
-        (ch >= 0x31A0 && ch <= 0x31BF) ||   /* 注音符号拡張 */
-        (ch >= 0x31C0 && ch <= 0x31EF) ||   /* CJK筆画 */
-        (ch >= 0x3200 && ch <= 0x32FF) ||   /* 囲み文字 */
-        (ch >= 0x3300 && ch <= 0x33FF) ||   /* CJK互換 */
-        (ch >= 0x3400 && ch <= 0x4DBF) ||   /* CJK統合漢字拡張A */
-        (ch >= 0x4E00 && ch <= 0x9FFF) ||   /* CJK統合漢字 */
-        (ch >= 0xAC00 && ch <= 0xD7AF) ||   /* ハングル音節 */
-        (ch >= 0xF900 && ch <= 0xFAFF) ||   /* CJK互換漢字 */
-        (ch >= 0xFE30 && ch <= 0xFE4F) ||   /* CJK互換形式 */
-        (ch >= 0xFF00 && ch <= 0xFF60) ||   /* 全角ASCII、全角記号 */
-        (ch >= 0xFFE0 && ch <= 0xFFE6) ||   /* 全角記号 */
-        (ch >= 0x20000 && ch <= 0x2FFFD) || /* CJK統合漢字拡張B-F */
-        (ch >= 0x30000 && ch <= 0x3FFFD)) { /* CJK統合漢字拡張G */
-        return 2;
+    int i = 0;
+#ifdef __SSE2__
+    /* 空白セル2個分（16バイト）のパターンをまとめて書き込む */
+    const __m128i blank = _mm_set_epi32(ATTR_DEFAULT_ID, ' ', ATTR_DEFAULT_ID, ' ');
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_si128((__m128i *)&cells[i], blank);
+    }
+#endif
+    for (; i < count; i++) {
+        cells[i].ch = ' ';
+        cells[i].attr = ATTR_DEFAULT_ID;
     }
+}
 
-    /* その他は半角 */
-    return 1;
+/* セル区間を消去する（参照を手放して空白にする） */
+static void cells_erase(Cell *cells, int count)
+{
+    cells_unref(cells, count);
+    cells_fill_blank(cells, count);
+}
+
+/* y行目の区間 [x0, x1) を消去する（画面外の部分は無視） */
+static void erase_cells(int y, int x0, int x1)
+{
+    if (y < 0 || y >= g_terminal.rows) {
+        return;
+    }
+    if (x0 < 0) {
+        x0 = 0;
+    }
+    if (x1 > g_terminal.cols) {
+        x1 = g_terminal.cols;
+    }
+    if (x0 < x1) {
+        cells_erase(&g_terminal.lines[y][x0], x1 - x0);
+        mark_dirty(y, x0, x1);
+    }
+}
+
+/* カーソル位置にn個の空白を挿入し、右側をずらす（右端からはみ出したセルは破棄） */
+static void insert_blank_cells(int n)
+{
+    int x = g_terminal.cursor_x;
+    int y = g_terminal.cursor_y;
+    if (x < 0 || x >= g_terminal.cols || y < 0 || y >= g_terminal.rows) {
+        return;
+    }
+    int remain = g_terminal.cols - x;
+    if (n > remain) {
+        n = remain;
+    }
+
+    Cell *row = g_terminal.lines[y];
+    cells_unref(&row[g_terminal.cols - n], n);
+    memmove(&row[x + n], &row[x], (remain - n) * sizeof(Cell));
+    cells_fill_blank(&row[x], n);
+    mark_dirty(y, x, g_terminal.cols);
+}
+
+/* カーソル位置からn個のセルを削除し、右側を詰めて行末を空白にする */
+static void delete_cells(int n)
+{
+    int x = g_terminal.cursor_x;
+    int y = g_terminal.cursor_y;
+    if (x < 0 || x >= g_terminal.cols || y < 0 || y >= g_terminal.rows) {
+        return;
+    }
+    int remain = g_terminal.cols - x;
+    if (n > remain) {
+        n = remain;
+    }
+
+    Cell *row = g_terminal.lines[y];
+    cells_unref(&row[x], n);
+    memmove(&row[x], &row[x + n], (remain - n) * sizeof(Cell));
+    cells_fill_blank(&row[g_terminal.cols - n], n);
+    mark_dirty(y, x, g_terminal.cols);
+}
+
+/* 空白で埋めたセル配列と、その行ポインタ配列を確保する */
+static Cell *alloc_screen(int rows, int cols, Cell ***lines_out)
+{
+    Cell *cells = malloc((size_t)rows * cols * sizeof(Cell));
+    Cell **lines = malloc(rows * sizeof(Cell *));
+    if (!cells || !lines) {
+        free(cells);
+        free(lines);
+        return NULL;
+    }
+
+    for (int y = 0; y < rows; y++) {
+        lines[y] = &cells[(size_t)y * cols];
+        cells_fill_blank(lines[y], cols);
+    }
+
+    *lines_out = lines;
+    return cells;
+}
+
+/* セル配列と行ポインタ配列を解放する（セルの参照を手放す） */
+static void free_screen(Cell *cells, Cell **lines, int count)
+{
+    if (cells) {
+        cells_unref(cells, count);
+    }
+    free(cells);
+    free(lines);
+}
+
+/* 行ポインタ配列の区間 [first, last] を逆順にする */
+static void reverse_lines(Cell **lines, int first, int last)
+{
+    while (first < last) {
+        Cell *tmp = lines[first];
+        lines[first++] = lines[last];
+        lines[last--] = tmp;
+    }
+}
+
+/* 行ポインタ配列の区間 [top, bottom] をn行上に回転する（上端のn行が下端に回る） */
+static void rotate_lines_up(Cell **lines, int top, int bottom, int n)
+{
+    if (n <= 0 || n > bottom - top) {
+        return;
+    }
+    reverse_lines(lines, top, top + n - 1);
+    reverse_lines(lines, top + n, bottom);
+    reverse_lines(lines, top, bottom);
+}
+
+/* スクロール範囲を画面内に収める。範囲が空ならfalse */
+static bool clamp_region(int *top, int *bottom, int *n)
+{
+    if (*top < 0) {
+        *top = 0;
+    }
+    if (*bottom >= g_terminal.rows) {
+        *bottom = g_terminal.rows - 1;
+    }
+    if (*top > *bottom || *n <= 0) {
+        return false;
+    }
+    if (*n > *bottom - *top + 1) {
+        *n = *bottom - *top + 1;
+    }
+    return true;
+}
+
+/* メインバッファと代替バッファを入れ替える */
+static void swap_screen_buffers(void)
+{
+    Cell *tmp = g_terminal.cells;
+    g_terminal.cells = g_terminal.alternate_cells;
+    g_terminal.alternate_cells = tmp;
+
+    Cell **tmp_lines = g_terminal.lines;
+    g_terminal.lines = g_terminal.alternate_lines;
+    g_terminal.alternate_lines = tmp_lines;
+
+    mark_rows_dirty(0, g_terminal.rows - 1);
+}
+
+/* 範囲 [top, bottom] をn行上にスクロールする（押し出した行を消去して下端へ回す） */
+static void scroll_region_up(int top, int bottom, int n)
+{
+    if (!clamp_region(&top, &bottom, &n)) {
+        return;
+    }
+    for (int y = top; y < top + n; y++) {
+        cells_erase(g_terminal.lines[y], g_terminal.cols);
+    }
+    rotate_lines_up(g_terminal.lines, top, bottom, n);
+    mark_scrolled(top, bottom, n);
+}
+
+/* 範囲 [top, bottom] をn行下にスクロールする（押し出した行を消去して上端へ回す） */
+static void scroll_region_down(int top, int bottom, int n)
+{
+    if (!clamp_region(&top, &bottom, &n)) {
+        return;
+    }
+    for (int y = bottom - n + 1; y <= bottom; y++) {
+        cells_erase(g_terminal.lines[y], g_terminal.cols);
+    }
+    rotate_lines_up(g_terminal.lines, top, bottom, bottom - top + 1 - n);
+    mark_scrolled(top, bottom, -n);
+}
+
+/* UTF-8デコーダ（pty_readの区切りをまたぐマルチバイト文字を保持） */
+static Utf8Decoder g_utf8_decoder = {0};
+
+/* エスケープシーケンスのパーサー状態（pty_readの区切りをまたいで保持） */
+static VtParser g_parser = {.state = VT_STATE_GROUND};
+
+/* 直前に書き込んだ印字文字（REP用、0はなし） */
+static uint32_t g_last_graphic_char = 0;
+
+/* 一度にデコードするコードポイント数 */
+#define DECODE_CHUNK 512
+
+/* terminal_put_runで一度に文字幅を引く文字数 */
+#define PUT_RUN_CHUNK 256
+
+/* 文字幅を取得（生成済みの2段テーブルを引く） */
+static int get_char_width(uint32_t ch)
+{
+    return unicode_char_width(ch);
 }
 
 /**
  * ターミナルバッファを初期化する
  */
-int terminal_init(int rows, int cols)
+int terminal_init(int rows, int cols, int scrollback_lines, bool scrollback_spill)
 {
-    /* メインバッファを確保 */
-    g_terminal.cells = calloc(rows * cols, sizeof(Cell));
+    /* メインバッファを確保（空白で初期化済み） */
+    g_terminal.cells = alloc_screen(rows, cols, &g_terminal.lines);
     if (!g_terminal.cells) {
         fprintf(stderr, "エラー: ターミナルバッファのメモリ確保に失敗しました\n");
         return -1;
@@ -117,6 +379,7 @@ int terminal_init(int rows, int cols)
 
     /* 代替バッファは後で必要に応じて確保 */
     g_terminal.alternate_cells = NULL;
+    g_terminal.alternate_lines = NULL;
     g_terminal.using_alternate = false;
 
     g_terminal.rows = rows;
@@ -138,29 +401,38 @@ int terminal_init(int rows, int cols)
     g_terminal.saved_attr.flags = 0;
 
     /* スクロールバックバッファを初期化 */
-    g_terminal.scrollback.capacity = 1000;  /* 1000行の履歴 */
-    g_terminal.scrollback.count = 0;
-    g_terminal.scrollback.head = 0;
-    g_terminal.scrollback.lines = calloc(g_terminal.scrollback.capacity, sizeof(ScrollbackLine));
-    if (!g_terminal.scrollback.lines) {
+    if (scrollback_init(&g_terminal.scrollback, scrollback_lines, scrollback_spill, &g_terminal.attrs) < 0) {
         fprintf(stderr, "エラー: スクロールバックバッファのメモリ確保に失敗しました\n");
         free(g_terminal.cells);
+        free(g_terminal.lines);
         return -1;
     }
     g_terminal.scroll_offset = 0;  /* 最下部から開始 */
+    search_index_init(&g_terminal.search_index);
+    scrollback_set_group_overhead(&g_terminal.scrollback, SEARCH_GROUP_LINES,
+                                  SEARCH_BLOOM_WORDS * sizeof(uint64_t), SEARCH_MAX_GROUPS);
+
+    /* 変更範囲（初回は全体を描画する） */
+    g_terminal.damage = malloc(rows * sizeof(RowDamage));
+    if (!g_terminal.damage) {
+        fprintf(stderr, "エラー: ダメージ領域のメモリ確保に失敗しました\n");
+        scrollback_free(&g_terminal.scrollback);
+        free(g_terminal.cells);
+        free(g_terminal.lines);
+        return -1;
+    }
+    mark_rows_dirty(0, rows - 1);
     g_terminal.pending_wrap = false;    /* 折り返し保留フラグ初期化 */
 
-    /* 初期化: 空白で埋める */
-    CellAttr default_attr = {
-        .fg_color = 7,  /* 白 */
-        .bg_color = 0,  /* 黒 */
-        .flags = 0
-    };
-
-    for (int i = 0; i < rows * cols; i++) {
-        g_terminal.cells[i].ch = ' ';
-        g_terminal.cells[i].attr = default_attr;
+    /* 属性テーブルを初期化 */
+    if (attr_table_init(&g_terminal.attrs) < 0) {
+        free(g_terminal.damage);
+        scrollback_free(&g_terminal.scrollback);
+        free(g_terminal.cells);
+        free(g_terminal.lines);
+        return -1;
     }
+    reset_current_attr_id();
 
     extern bool g_debug;
     if (g_debug) {
@@ -175,28 +447,35 @@ int terminal_init(int rows, int cols)
  */
 void terminal_cleanup(void)
 {
-    if (g_terminal.cells) {
-        free(g_terminal.cells);
-        g_terminal.cells = NULL;
-    }
+    /* 検索のワーカースレッドを止める */
+    search_cleanup();
+
+    free(g_terminal.cells);
+    free(g_terminal.lines);
+    g_terminal.cells = NULL;
+    g_terminal.lines = NULL;
 
     /* 代替バッファをクリーンアップ */
-    if (g_terminal.alternate_cells) {
-        free(g_terminal.alternate_cells);
-        g_terminal.alternate_cells = NULL;
-    }
+    free(g_terminal.alternate_cells);
+    free(g_terminal.alternate_lines);
+    g_terminal.alternate_cells = NULL;
+    g_terminal.alternate_lines = NULL;
 
     /* スクロールバックバッファをクリーンアップ */
-    if (g_terminal.scrollback.lines) {
-        for (int i = 0; i < g_terminal.scrollback.count; i++) {
-            int idx = (g_terminal.scrollback.head + i) % g_terminal.scrollback.capacity;
-            if (g_terminal.scrollback.lines[idx].cells) {
-                free(g_terminal.scrollback.lines[idx].cells);
-            }
-        }
-        free(g_terminal.scrollback.lines);
-        g_terminal.scrollback.lines = NULL;
-    }
+    scrollback_free(&g_terminal.scrollback);
+    search_index_free(&g_terminal.search_index);
+
+    /* スクリーンショットバッファをクリーンアップ */
+    free(g_terminal.screenshot.cells);
+
+    free(g_terminal.damage);
+
+    /* 属性テーブルをクリーンアップ（全セルを解放したので参照数は見ない） */
+    attr_table_free(&g_terminal.attrs);
+    reset_current_attr_id();
+
+    /* 結合文字列のテーブルをクリーンアップ */
+    combining_cleanup();
 
     memset(&g_terminal, 0, sizeof(g_terminal));
 
@@ -215,7 +494,7 @@ Cell *terminal_get_cell(int x, int y)
         return NULL;
     }
 
-    return &g_terminal.cells[y * g_terminal.cols + x];
+    return &g_terminal.lines[y][x];
 }
 
 /**
@@ -225,8 +504,12 @@ void terminal_put_char(int x, int y, uint32_t ch, CellAttr attr)
 {
     Cell *cell = terminal_get_cell(x, y);
     if (cell) {
+        /* インターンで得た参照をそのままセルに持たせる */
+        uint32_t id = attr_table_intern(&g_terminal.attrs, &attr);
+        attr_table_unref(&g_terminal.attrs, cell->attr);
         cell->ch = ch;
-        cell->attr = attr;
+        cell->attr = id;
+        mark_dirty(y, x, x + 1);
     }
 }
 
@@ -235,16 +518,8 @@ void terminal_put_char(int x, int y, uint32_t ch, CellAttr attr)
  */
 void terminal_clear(void)
 {
-    CellAttr default_attr = {
-        .fg_color = 7,  /* 白 */
-        .bg_color = 0,  /* 黒 */
-        .flags = 0
-    };
-
-    for (int i = 0; i < g_terminal.rows * g_terminal.cols; i++) {
-        g_terminal.cells[i].ch = ' ';
-        g_terminal.cells[i].attr = default_attr;
-    }
+    cells_erase(g_terminal.cells, g_terminal.rows * g_terminal.cols);
+    mark_rows_dirty(0, g_terminal.rows - 1);
 
     g_terminal.cursor_x = 0;
     g_terminal.cursor_y = 0;
@@ -279,64 +554,71 @@ void terminal_get_cursor(int *x, int *y)
 }
 
 /**
- * 画面を1行上にスクロール
+ * スクロール領域を1行上にスクロール
  */
 void terminal_scroll_up(void)
 {
-    /* 最初の行をスクロールバックバッファに保存 */
-    if (g_terminal.scrollback.lines) {
-        /* リングバッファの次の位置を計算 */
-        int write_idx;
-        if (g_terminal.scrollback.count < g_terminal.scrollback.capacity) {
-            /* まだ容量に余裕がある */
-            write_idx = g_terminal.scrollback.count;
-            g_terminal.scrollback.count++;
-        } else {
-            /* 容量いっぱい、最古の行を上書き */
-            write_idx = g_terminal.scrollback.head;
-            g_terminal.scrollback.head = (g_terminal.scrollback.head + 1) % g_terminal.scrollback.capacity;
-
-            /* 既存の行のメモリを解放 */
-            if (g_terminal.scrollback.lines[write_idx].cells) {
-                free(g_terminal.scrollback.lines[write_idx].cells);
-            }
-        }
-
-        /* 最初の行をコピー */
-        g_terminal.scrollback.lines[write_idx].cols = g_terminal.cols;
-        g_terminal.scrollback.lines[write_idx].cells = malloc(g_terminal.cols * sizeof(Cell));
-        if (g_terminal.scrollback.lines[write_idx].cells) {
-            memcpy(g_terminal.scrollback.lines[write_idx].cells,
-                   g_terminal.cells,
-                   g_terminal.cols * sizeof(Cell));
-        }
+    int top = g_terminal.scroll_top;
+    int bottom = g_terminal.scroll_bottom;
+    int n = 1;
+    if (!clamp_region(&top, &bottom, &n)) {
+        return;
     }
 
-    /* 全ての行を1行上に移動 */
-    int line_size = g_terminal.cols * sizeof(Cell);
-    memmove(g_terminal.cells,
-            g_terminal.cells + g_terminal.cols,
-            (g_terminal.rows - 1) * line_size);
-
-    /* 最後の行をクリア */
-    CellAttr default_attr = {
-        .fg_color = 7,  /* 白 */
-        .bg_color = 0,  /* 黒 */
-        .flags = 0
-    };
+    /* 上端が画面の1行目でない領域や代替バッファのスクロールは履歴に残さない */
+    if (top != 0 || g_terminal.using_alternate) {
+        scroll_region_up(top, bottom, 1);
+        return;
+    }
 
-    int last_row_start = (g_terminal.rows - 1) * g_terminal.cols;
-    for (int x = 0; x < g_terminal.cols; x++) {
-        g_terminal.cells[last_row_start + x].ch = ' ';
-        g_terminal.cells[last_row_start + x].attr = default_attr;
+    /* 最初の行をスクロールバックバッファに保存（属性の参照は画面からスクロールバックへ移る） */
+    if (scrollback_push(&g_terminal.scrollback, g_terminal.lines[0], g_terminal.cols)) {
+        /* 検索索引に加え、上限を超えて捨てた行の分を索引から落とす */
+        ScrollbackBuffer *sb = &g_terminal.scrollback;
+        search_index_add(&g_terminal.search_index, g_terminal.lines[0], g_terminal.cols,
+                         sb->first_seq + sb->count - 1);
+        search_index_prune(&g_terminal.search_index, sb->first_seq);
+        cells_fill_blank(g_terminal.lines[0], g_terminal.cols);
+    } else {
+        /* 保存できなかった行の参照は捨てる */
+        cells_erase(g_terminal.lines[0], g_terminal.cols);
+    }
+    if (g_terminal.scroll_offset > g_terminal.scrollback.count) {
+        /* 上限を超えて古い行を捨てたら、表示位置を履歴の範囲に収める */
+        terminal_set_scroll_offset(g_terminal.scroll_offset);
     }
 
+    /* 空白にした最初の行を領域の最下行へ回す（セルは動かさず行ポインタだけを回転） */
+    rotate_lines_up(g_terminal.lines, 0, bottom, 1);
+    mark_scrolled(0, bottom, 1);
+
     /* 新しい出力があったらスクロールオフセットをリセット（最下部に移動） */
     if (g_terminal.scroll_offset == 0) {
         /* すでに最下部にいる場合は何もしない（自動スクロール） */
     }
 }
 
+/* 新しいサイズのセル配列を作り、重なる範囲をコピーする（コピーしたセルの参照を増やす） */
+static Cell *resize_cells(Cell *const *old_lines, int old_rows, int old_cols,
+                          int new_rows, int new_cols, Cell ***new_lines)
+{
+    Cell *new_cells = alloc_screen(new_rows, new_cols, new_lines);
+    if (!new_cells) {
+        return NULL;
+    }
+
+    /* 既存の内容をコピー */
+    int copy_rows = (new_rows < old_rows) ? new_rows : old_rows;
+    int copy_cols = (new_cols < old_cols) ? new_cols : old_cols;
+
+    for (int y = 0; y < copy_rows; y++) {
+        memcpy((*new_lines)[y], old_lines[y], copy_cols * sizeof(Cell));
+        cells_ref((*new_lines)[y], copy_cols);
+    }
+
+    return new_cells;
+}
+
 /**
  * ターミナルバッファをリサイズする
  */
@@ -348,44 +630,50 @@ int terminal_resize(int new_rows, int new_cols)
     }
 
     /* 新しいバッファを確保 */
-    Cell *new_cells = calloc(new_rows * new_cols, sizeof(Cell));
+    Cell **new_lines;
+    Cell *new_cells = resize_cells(g_terminal.lines, g_terminal.rows, g_terminal.cols,
+                                   new_rows, new_cols, &new_lines);
     if (!new_cells) {
         fprintf(stderr, "エラー: リサイズ用バッファのメモリ確保に失敗しました\n");
         return -1;
     }
-
-    /* デフォルト属性で初期化 */
-    CellAttr default_attr = {
-        .fg_color = 7,  /* 白 */
-        .bg_color = 0,  /* 黒 */
-        .flags = 0
-    };
-
-    for (int i = 0; i < new_rows * new_cols; i++) {
-        new_cells[i].ch = ' ';
-        new_cells[i].attr = default_attr;
+    RowDamage *new_damage = realloc(g_terminal.damage, new_rows * sizeof(RowDamage));
+    if (!new_damage) {
+        fprintf(stderr, "エラー: リサイズ用バッファのメモリ確保に失敗しました\n");
+        free_screen(new_cells, new_lines, new_rows * new_cols);
+        return -1;
     }
+    g_terminal.damage = new_damage;
 
-    /* 既存の内容をコピー */
-    int copy_rows = (new_rows < g_terminal.rows) ? new_rows : g_terminal.rows;
-    int copy_cols = (new_cols < g_terminal.cols) ? new_cols : g_terminal.cols;
-
-    for (int y = 0; y < copy_rows; y++) {
-        for (int x = 0; x < copy_cols; x++) {
-            int old_idx = y * g_terminal.cols + x;
-            int new_idx = y * new_cols + x;
-            new_cells[new_idx] = g_terminal.cells[old_idx];
-        }
+    /* 代替バッファも同じサイズにそろえる（入れ替え時にサイズが食い違わないように） */
+    if (g_terminal.alternate_cells) {
+        Cell **new_alternate_lines;
+        Cell *new_alternate = resize_cells(g_terminal.alternate_lines, g_terminal.rows, g_terminal.cols,
+                                           new_rows, new_cols, &new_alternate_lines);
+        /* 確保できなければ代替バッファは作り直す */
+        free_screen(g_terminal.alternate_cells, g_terminal.alternate_lines,
+                    g_terminal.rows * g_terminal.cols);
+        g_terminal.alternate_cells = new_alternate;
+        g_terminal.alternate_lines = new_alternate ? new_alternate_lines : NULL;
     }
 
     /* 古いバッファを解放 */
-    free(g_terminal.cells);
+    free_screen(g_terminal.cells, g_terminal.lines, g_terminal.rows * g_terminal.cols);
 
     /* 新しいバッファに切り替え */
     g_terminal.cells = new_cells;
+    g_terminal.lines = new_lines;
     g_terminal.rows = new_rows;
     g_terminal.cols = new_cols;
 
+    /* スクロール領域は全画面に戻す */
+    g_terminal.scroll_top = 0;
+    g_terminal.scroll_bottom = new_rows - 1;
+
+    /* 全体を描画し直す（記録済みのスクロールは古い行数のものなので捨てる） */
+    mark_rows_dirty(0, new_rows - 1);
+    g_terminal.scroll_damage.lines = 0;
+
     /* カーソル位置を調整 */
     if (g_terminal.cursor_x >= new_cols) {
         g_terminal.cursor_x = new_cols - 1;
@@ -416,41 +704,34 @@ void terminal_carriage_return(void)
  */
 void terminal_newline(void)
 {
-    g_terminal.cursor_y++;
-    if (g_terminal.cursor_y >= g_terminal.rows) {
-        /* スクロール */
+    if (g_terminal.cursor_y == g_terminal.scroll_bottom) {
+        /* スクロール領域の下端ではカーソルを動かさず領域をスクロール */
         terminal_scroll_up();
+    } else if (g_terminal.cursor_y < g_terminal.rows - 1) {
+        g_terminal.cursor_y++;
+    } else {
+        /* 領域外の最下行（またはリサイズ後の範囲外）では画面下端にとどまる */
         g_terminal.cursor_y = g_terminal.rows - 1;
     }
     g_terminal.pending_wrap = false;  /* LF時に折り返し保留をクリア */
 }
 
-/**
- * 1文字をカーソル位置に書き込んで進める
- */
-void terminal_put_char_at_cursor(uint32_t ch)
+/* 1文字を境界チェック付きで書き込んで進める（カーソルが範囲外の場合に使う） */
+static void terminal_put_char_checked(uint32_t ch, int char_width)
 {
-    /* pending wrap状態なら、まず改行する */
-    if (g_terminal.pending_wrap) {
-        g_terminal.cursor_x = 0;
-        terminal_newline();
-        g_terminal.pending_wrap = false;
-    }
-
-    int char_width = get_char_width(ch);
-
+    uint32_t attr_id = current_attr_id();
     Cell *cell = terminal_get_cell(g_terminal.cursor_x, g_terminal.cursor_y);
     if (cell) {
-        cell->ch = ch;
-        cell->attr = g_current_attr;  /* 現在の属性を使用 */
+        cell_set(cell, ch, attr_id);  /* 現在の属性を使用 */
+        mark_dirty(g_terminal.cursor_y, g_terminal.cursor_x, g_terminal.cursor_x + 1);
     }
 
     /* 全角文字の場合、次のセルに継続マーカーを設定 */
     if (char_width == 2 && g_terminal.cursor_x + 1 < g_terminal.cols) {
         Cell *next_cell = terminal_get_cell(g_terminal.cursor_x + 1, g_terminal.cursor_y);
         if (next_cell) {
-            next_cell->ch = WIDE_CHAR_CONTINUATION;
-            next_cell->attr = g_current_attr;
+            cell_set(next_cell, WIDE_CHAR_CONTINUATION, attr_id);
+            mark_dirty(g_terminal.cursor_y, g_terminal.cursor_x + 1, g_terminal.cursor_x + 2);
         }
     }
 
@@ -469,44 +750,359 @@ void terminal_put_char_at_cursor(uint32_t ch)
     }
 }
 
-/* CSIパラメータをパースする */
-static void parse_csi_params(const char *param_buf, int *params, int *param_count, int max_params)
+/* 幅0の文字（結合文字・ZWJなど）を直前に書いたセル（全角文字なら左半分）に結び付ける */
+static void terminal_attach_mark(uint32_t mark)
 {
-    *param_count = 0;
-    int value = 0;
-    bool has_value = false;
+    int x = g_terminal.cursor_x;
+    int y = g_terminal.cursor_y;
+    if (!g_terminal.pending_wrap || x < g_terminal.cols - 1) {
+        /* 折り返し保留中で行末にいるときはカーソル位置のセルが直前に書いたセル */
+        x--;
+    }
+    if (x < 0 || x >= g_terminal.cols || y < 0 || y >= g_terminal.rows) {
+        return;  /* 行頭など、結び付けるセルがない */
+    }
+
+    Cell *row = g_terminal.lines[y];
+    if (row[x].ch == WIDE_CHAR_CONTINUATION && x > 0) {
+        x--;
+    }
+    if (row[x].ch == WIDE_CHAR_CONTINUATION) {
+        return;
+    }
+
+    uint32_t ch = combining_attach(row[x].ch, mark);
+    if (ch != row[x].ch) {
+        row[x].ch = ch;
+        int x1 = (x + 1 < g_terminal.cols && row[x + 1].ch == WIDE_CHAR_CONTINUATION) ? x + 2 : x + 1;
+        mark_dirty(y, x, x1);
+    }
+}
 
-    for (const char *p = param_buf; *p; p++) {
-        if (*p >= '0' && *p <= '9') {
-            value = value * 10 + (*p - '0');
-            has_value = true;
-        } else if (*p == ';') {
-            if (*param_count < max_params) {
-                params[(*param_count)++] = has_value ? value : 0;
+/**
+ * 文字列をカーソル位置に書き込んで進める
+ */
+void terminal_put_run(const uint32_t *cps, size_t n)
+{
+    uint8_t widths[PUT_RUN_CHUNK];
+    AttrTable *attrs = &g_terminal.attrs;
+    uint32_t attr = current_attr_id();
+
+    while (n > 0) {
+        /* 文字幅を先にまとめて引いておく */
+        size_t m = (n < PUT_RUN_CHUNK) ? n : PUT_RUN_CHUNK;
+        for (size_t k = 0; k < m; k++) {
+            widths[k] = (uint8_t)get_char_width(cps[k]);
+            if (widths[k] != 0) {
+                g_last_graphic_char = cps[k];
             }
-            value = 0;
-            has_value = false;
         }
+
+        size_t i = 0;
+        while (i < m) {
+            /* 幅0の文字（結合文字・ZWJなど）はセルを占有せず、カーソルを動かさずに直前のセルに結び付ける */
+            if (widths[i] == 0) {
+                terminal_attach_mark(cps[i]);
+                i++;
+                continue;
+            }
+
+            /* pending wrap状態なら、まず改行する */
+            if (g_terminal.pending_wrap) {
+                g_terminal.cursor_x = 0;
+                terminal_newline();
+                g_terminal.pending_wrap = false;
+            }
+
+            int cols = g_terminal.cols;
+            int x = g_terminal.cursor_x;
+            int y = g_terminal.cursor_y;
+            if (x < 0 || x >= cols || y < 0 || y >= g_terminal.rows) {
+                /* カーソルが範囲外（リサイズ後のDECRCなど）は1文字ずつ処理する */
+                terminal_put_char_checked(cps[i], widths[i]);
+                i++;
+                continue;
+            }
+
+            /* 行の区間を一括で埋める（全角文字が行末に入りきらないところで止める） */
+            /* 上書きされるセルの参照を手放し、書き込んだセル数だけ最後にまとめて参照を増やす */
+            Cell *row = g_terminal.lines[y];
+            int start_x = x;
+            while (i < m && x < cols) {
+                int w = widths[i];
+                if (w == 0) {
+                    break;  /* 幅0の文字はカーソルを確定してから結び付ける */
+                }
+                if (w == 2 && x + 1 >= cols) {
+                    break;
+                }
+                attr_table_unref(attrs, row[x].attr);
+                row[x].ch = cps[i];
+                row[x].attr = attr;
+                if (w == 2) {
+                    /* 全角文字の場合、次のセルに継続マーカーを設定 */
+                    attr_table_unref(attrs, row[x + 1].attr);
+                    row[x + 1].ch = WIDE_CHAR_CONTINUATION;
+                    row[x + 1].attr = attr;
+                }
+                x += w;
+                i++;
+            }
+            attr_table_ref_n(attrs, attr, (uint32_t)(x - start_x));
+            if (x > start_x) {
+                mark_dirty(y, start_x, x);
+            }
+
+            if (x < cols && i < m && widths[i] == 2) {
+                /* 全角文字が最終列に入りきらない */
+                if (g_terminal.auto_wrap_mode && x > 0) {
+                    /* 自動折り返しモード: 次の行の先頭に書く */
+                    g_terminal.cursor_x = x;
+                    g_terminal.pending_wrap = true;
+                    continue;
+                }
+                /* 自動折り返し無効: 最終列に左半分だけ書く */
+                cell_set(&row[x], cps[i], attr);
+                mark_dirty(y, x, x + 1);
+                x = cols;
+                i++;
+            }
+
+            /* カーソルを進める（行末では折り返しを保留） */
+            if (x >= cols) {
+                x = cols - 1;
+                if (g_terminal.auto_wrap_mode) {
+                    g_terminal.pending_wrap = true;
+                }
+            }
+            g_terminal.cursor_x = x;
+        }
+
+        cps += m;
+        n -= m;
+    }
+}
+
+/**
+ * 1文字をカーソル位置に書き込んで進める
+ */
+void terminal_put_char_at_cursor(uint32_t ch)
+{
+    terminal_put_run(&ch, 1);
+}
+
+/* 印字可能ASCIIの連続をカーソル位置から現在行にまとめて書き込む */
+static void terminal_put_ascii_run(const unsigned char *s, size_t n)
+{
+    if (n > 0) {
+        g_last_graphic_char = s[n - 1];
     }
 
-    /* 最後のパラメータ */
-    if (*param_count < max_params) {
-        params[(*param_count)++] = has_value ? value : 0;
+    while (n > 0) {
+        /* pending wrap状態なら、まず改行する */
+        if (g_terminal.pending_wrap) {
+            g_terminal.cursor_x = 0;
+            terminal_newline();
+            g_terminal.pending_wrap = false;
+        }
+
+        int x = g_terminal.cursor_x;
+        int y = g_terminal.cursor_y;
+        if (x < 0 || x >= g_terminal.cols || y < 0 || y >= g_terminal.rows) {
+            /* カーソルが範囲外（リサイズ後のDECRCなど）は1文字ずつの処理に任せる */
+            terminal_put_char_at_cursor(*s++);
+            n--;
+            continue;
+        }
+
+        /* 右端で切り詰める */
+        size_t space = (size_t)(g_terminal.cols - x);
+        size_t count = (n < space) ? n : space;
+        Cell *row = &g_terminal.lines[y][x];
+
+        uint32_t attr = current_attr_id();
+
+        if (!g_terminal.auto_wrap_mode && n > space) {
+            /* 自動折り返し無効: 入りきらない文字は最終列に上書きされ続け、最後の1文字が残る */
+            for (size_t k = 0; k + 1 < space; k++) {
+                cell_set(&row[k], s[k], attr);
+            }
+            cell_set(&row[space - 1], s[n - 1], attr);
+            mark_dirty(y, x, g_terminal.cols);
+            g_terminal.cursor_x = g_terminal.cols - 1;
+            return;
+        }
+
+        for (size_t k = 0; k < count; k++) {
+            attr_table_unref(&g_terminal.attrs, row[k].attr);
+            row[k].ch = s[k];
+            row[k].attr = attr;
+        }
+        attr_table_ref_n(&g_terminal.attrs, attr, (uint32_t)count);
+        mark_dirty(y, x, x + (int)count);
+        s += count;
+        n -= count;
+
+        /* カーソルを進める（行末では折り返しを保留） */
+        g_terminal.cursor_x += (int)count;
+        if (g_terminal.cursor_x >= g_terminal.cols) {
+            g_terminal.cursor_x = g_terminal.cols - 1;
+            if (g_terminal.auto_wrap_mode) {
+                g_terminal.pending_wrap = true;
+            }
+        }
     }
 }
 
-/* CSIコマンドを処理する */
-static void handle_csi_command(char cmd, const char *param_buf)
+/* 直前の印字文字をn回繰り返して書き込む（REP） */
+static void repeat_last_char(int n)
 {
-    int params[16];
-    int param_count;
+    if (g_last_graphic_char == 0) {
+        return;
+    }
 
-    parse_csi_params(param_buf, params, &param_count, 16);
+    uint32_t buf[PUT_RUN_CHUNK];
+    int m = (n < PUT_RUN_CHUNK) ? n : PUT_RUN_CHUNK;
+    for (int k = 0; k < m; k++) {
+        buf[k] = g_last_graphic_char;
+    }
+    while (n > 0) {
+        m = (n < PUT_RUN_CHUNK) ? n : PUT_RUN_CHUNK;
+        terminal_put_run(buf, (size_t)m);
+        n -= m;
+    }
+}
+
+/* 同期出力モード（DECSET/DECRST 2026）を切り替える */
+static void terminal_set_synchronized_update(bool enable)
+{
+    if (enable && !g_terminal.synchronized_update) {
+        clock_gettime(CLOCK_MONOTONIC, &g_terminal.sync_update_start);
+    }
+    g_terminal.synchronized_update = enable;
+}
+
+/* 256色パレットのインデックスを前景色/背景色に設定する */
+static void sgr_set_indexed_color(bool foreground, int index)
+{
+    if (foreground) {
+        g_current_attr.fg_color = index;
+    } else {
+        g_current_attr.bg_color = index;
+    }
+}
+
+/* 24-bit RGBを前景色/背景色に設定する（256色モードではパレットに変換） */
+static void sgr_set_rgb_color(bool foreground, int r, int g, int b)
+{
+    uint8_t flag = foreground ? ATTR_FG_TRUECOLOR : ATTR_BG_TRUECOLOR;
+
+    extern bool g_truecolor_mode;
+    if (g_truecolor_mode) {
+        /* Truecolorモード: RGB値をそのまま保存 */
+        uint32_t rgb = (r << 16) | (g << 8) | b;
+        if (foreground) {
+            g_current_attr.fg_rgb = rgb;
+        } else {
+            g_current_attr.bg_rgb = rgb;
+        }
+        g_current_attr.flags |= flag;
+        return;
+    }
+
+    /* 256色モード: RGBを256色パレットに変換 */
+    g_current_attr.flags &= ~flag;
+    int index;
+    if (r == g && g == b) {
+        /* グレースケールの場合 */
+        if (r < 8) {
+            index = 0;  /* 黒 */
+        } else if (r > 238) {
+            index = 15;  /* 白 */
+        } else {
+            /* グレースケール: 232-255 */
+            index = 232 + (r - 8) / 10;
+        }
+    } else {
+        /* 216色キューブ: 16 + 36*r + 6*g + b */
+        int r6 = (r * 6) / 256;
+        int g6 = (g * 6) / 256;
+        int b6 = (b * 6) / 256;
+        index = 16 + 36 * r6 + 6 * g6 + b6;
+    }
+    sgr_set_indexed_color(foreground, index);
+}
+
+/*
+ * SGR 38/48（拡張色）を適用する
+ * ';'区切り（38;5;N, 38;2;R;G;B）と':'区切り（38:5:N, 38:2:R:G:B, 38:2:CS:R:G:B）に対応。
+ * 消費した後続パラメータ数を返す。
+ */
+static int sgr_extended_color(const VtParser *parser, int i, bool foreground)
+{
+    const int *params = parser->params;
+    int param_count = parser->param_count;
+
+    if (i + 1 < param_count && vtparse_is_subparam(parser, i + 1)) {
+        /* ':'区切り: サブパラメータのグループ全体を消費する */
+        int n = 1;
+        while (i + 1 + n < param_count && vtparse_is_subparam(parser, i + 1 + n)) {
+            n++;
+        }
+        const int *sub = &params[i + 1];
+        if (sub[0] == 5 && n >= 2) {
+            sgr_set_indexed_color(foreground, sub[1]);
+        } else if (sub[0] == 2 && n >= 4) {
+            /* 色空間ID（38:2:CS:R:G:B、多くは空）があれば読み飛ばす */
+            const int *rgb = (n >= 5) ? &sub[2] : &sub[1];
+            sgr_set_rgb_color(foreground, rgb[0], rgb[1], rgb[2]);
+        }
+        return n;
+    }
+
+    /* ';'区切り */
+    if (i + 2 < param_count && params[i + 1] == 5) {
+        sgr_set_indexed_color(foreground, params[i + 2]);
+        return 2;
+    }
+    if (i + 4 < param_count && params[i + 1] == 2) {
+        sgr_set_rgb_color(foreground, params[i + 2], params[i + 3], params[i + 4]);
+        return 4;
+    }
+    return 0;
+}
+
+/* CSIコマンドを処理する */
+static void handle_csi_command(const VtParser *parser, char cmd)
+{
+    /* パラメータはパーサーが受信しながら整数に積算済み */
+    const int *params = parser->params;
+    int param_count = parser->param_count;
+    char marker = parser->private_marker;
 
     /* デバッグ: CSIコマンドをログ出力 */
     extern bool g_debug;
+    char param_buf[128];
+    param_buf[0] = '\0';
     if (g_debug) {
-        fprintf(stderr, "CSI: ESC[%s%c (cursor_before: %d,%d)\n", param_buf, cmd, g_terminal.cursor_x, g_terminal.cursor_y);
+        vtparse_format_params(parser, param_buf, sizeof(param_buf));
+        fprintf(stderr, "CSI: ESC[%.*s%s%c (cursor_before: %d,%d)\n", marker ? 1 : 0, &marker,
+                param_buf, cmd, g_terminal.cursor_x, g_terminal.cursor_y);
+    }
+
+    if (marker == '>' && cmd == 'c') {
+        /* Secondary DA: 端末の種類とバージョンを応答 */
+        extern void pty_write(const char *data, size_t len);
+        const char *response = "\033[>0;10;0c";
+        pty_write(response, strlen(response));
+        return;
+    }
+    if (marker != 0 && marker != '?') {
+        /* '?'以外のプライベートマーカー（'>', '<', '='）付きのコマンドは未対応 */
+        if (g_debug) {
+            fprintf(stderr, "未実装のCSIコマンド: ESC[%c%s%c\n", marker, param_buf, cmd);
+        }
+        return;
     }
 
     switch (cmd) {
@@ -558,32 +1154,19 @@ static void handle_csi_command(char cmd, const char *param_buf)
         case 'J':  /* ED: Erase in Display */
         {
             int n = (param_count > 0) ? params[0] : 0;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
 
             if (n == 0) {
                 /* カーソルから下をクリア */
-                for (int y = g_terminal.cursor_y; y < g_terminal.rows; y++) {
-                    int start_x = (y == g_terminal.cursor_y) ? g_terminal.cursor_x : 0;
-                    for (int x = start_x; x < g_terminal.cols; x++) {
-                        Cell *cell = terminal_get_cell(x, y);
-                        if (cell) {
-                            cell->ch = ' ';
-                            cell->attr = default_attr;
-                        }
-                    }
+                erase_cells(g_terminal.cursor_y, g_terminal.cursor_x, g_terminal.cols);
+                for (int y = g_terminal.cursor_y + 1; y < g_terminal.rows; y++) {
+                    erase_cells(y, 0, g_terminal.cols);
                 }
             } else if (n == 1) {
                 /* カーソルから上をクリア */
-                for (int y = 0; y <= g_terminal.cursor_y; y++) {
-                    int end_x = (y == g_terminal.cursor_y) ? g_terminal.cursor_x : g_terminal.cols - 1;
-                    for (int x = 0; x <= end_x; x++) {
-                        Cell *cell = terminal_get_cell(x, y);
-                        if (cell) {
-                            cell->ch = ' ';
-                            cell->attr = default_attr;
-                        }
-                    }
+                for (int y = 0; y < g_terminal.cursor_y; y++) {
+                    erase_cells(y, 0, g_terminal.cols);
                 }
+                erase_cells(g_terminal.cursor_y, 0, g_terminal.cursor_x + 1);
             } else if (n == 2 || n == 3) {
                 /* 画面全体をクリア */
                 terminal_clear();
@@ -594,35 +1177,16 @@ static void handle_csi_command(char cmd, const char *param_buf)
         case 'K':  /* EL: Erase in Line */
         {
             int n = (param_count > 0) ? params[0] : 0;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
 
             if (n == 0) {
                 /* カーソルから行末までクリア */
-                for (int x = g_terminal.cursor_x; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.cursor_y);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
+                erase_cells(g_terminal.cursor_y, g_terminal.cursor_x, g_terminal.cols);
             } else if (n == 1) {
                 /* 行頭からカーソルまでクリア */
-                for (int x = 0; x <= g_terminal.cursor_x; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.cursor_y);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
+                erase_cells(g_terminal.cursor_y, 0, g_terminal.cursor_x + 1);
             } else if (n == 2) {
                 /* 行全体をクリア */
-                for (int x = 0; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.cursor_y);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
+                erase_cells(g_terminal.cursor_y, 0, g_terminal.cols);
             }
             break;
         }
@@ -638,6 +1202,12 @@ static void handle_csi_command(char cmd, const char *param_buf)
                 for (int i = 0; i < param_count; i++) {
                     int p = params[i];
 
+                    /* ':'で続くサブパラメータの範囲 */
+                    int group_end = i + 1;
+                    while (group_end < param_count && vtparse_is_subparam(parser, group_end)) {
+                        group_end++;
+                    }
+
                     if (p == 0) {
                         /* リセット */
                         g_current_attr.fg_color = 7;
@@ -650,8 +1220,12 @@ static void handle_csi_command(char cmd, const char *param_buf)
                         /* イタリック */
                         g_current_attr.flags |= ATTR_ITALIC;
                     } else if (p == 4) {
-                        /* 下線 */
-                        g_current_attr.flags |= ATTR_UNDERLINE;
+                        /* 下線（4:0 は下線なし、4:1〜4:5 は下線の種類。種類は区別しない） */
+                        if (group_end > i + 1 && params[i + 1] == 0) {
+                            g_current_attr.flags &= ~ATTR_UNDERLINE;
+                        } else {
+                            g_current_attr.flags |= ATTR_UNDERLINE;
+                        }
                     } else if (p == 7) {
                         /* 反転 */
                         g_current_attr.flags |= ATTR_REVERSE;
@@ -685,88 +1259,17 @@ static void handle_csi_command(char cmd, const char *param_buf)
                     } else if (p >= 100 && p <= 107) {
                         /* 明るい背景色: 100-107 */
                         g_current_attr.bg_color = (p - 100) + 8;
-                    } else if (p == 38 && i + 2 < param_count) {
+                    } else if (p == 38) {
                         /* 前景色: 256色または24-bit RGB */
-                        if (params[i + 1] == 5 && i + 2 < param_count) {
-                            /* 256色前景色: 38;5;N */
-                            g_current_attr.fg_color = params[i + 2];
-                            i += 2;  /* パラメータ2つ分スキップ */
-                        } else if (params[i + 1] == 2 && i + 4 < param_count) {
-                            /* 24-bit RGB前景色: 38;2;R;G;B */
-                            int r = params[i + 2];
-                            int g = params[i + 3];
-                            int b = params[i + 4];
-
-                            extern bool g_truecolor_mode;
-                            if (g_truecolor_mode) {
-                                /* Truecolorモード: RGB値をそのまま保存 */
-                                g_current_attr.fg_rgb = (r << 16) | (g << 8) | b;
-                                g_current_attr.flags |= ATTR_FG_TRUECOLOR;
-                            } else {
-                                /* 256色モード: RGBを256色パレットに変換 */
-                                g_current_attr.flags &= ~ATTR_FG_TRUECOLOR;
-                                /* グレースケールの場合 */
-                                if (r == g && g == b) {
-                                    if (r < 8) {
-                                        g_current_attr.fg_color = 0;  /* 黒 */
-                                    } else if (r > 238) {
-                                        g_current_attr.fg_color = 15;  /* 白 */
-                                    } else {
-                                        /* グレースケール: 232-255 */
-                                        g_current_attr.fg_color = 232 + (r - 8) / 10;
-                                    }
-                                } else {
-                                    /* 216色キューブ: 16 + 36*r + 6*g + b */
-                                    int r6 = (r * 6) / 256;
-                                    int g6 = (g * 6) / 256;
-                                    int b6 = (b * 6) / 256;
-                                    g_current_attr.fg_color = 16 + 36 * r6 + 6 * g6 + b6;
-                                }
-                            }
-
-                            i += 4;  /* パラメータ4つ分スキップ */
-                        }
-                    } else if (p == 48 && i + 2 < param_count) {
+                        i += sgr_extended_color(parser, i, true);
+                    } else if (p == 48) {
                         /* 背景色: 256色または24-bit RGB */
-                        if (params[i + 1] == 5 && i + 2 < param_count) {
-                            /* 256色背景色: 48;5;N */
-                            g_current_attr.bg_color = params[i + 2];
-                            i += 2;  /* パラメータ2つ分スキップ */
-                        } else if (params[i + 1] == 2 && i + 4 < param_count) {
-                            /* 24-bit RGB背景色: 48;2;R;G;B */
-                            int r = params[i + 2];
-                            int g = params[i + 3];
-                            int b = params[i + 4];
-
-                            extern bool g_truecolor_mode;
-                            if (g_truecolor_mode) {
-                                /* Truecolorモード: RGB値をそのまま保存 */
-                                g_current_attr.bg_rgb = (r << 16) | (g << 8) | b;
-                                g_current_attr.flags |= ATTR_BG_TRUECOLOR;
-                            } else {
-                                /* 256色モード: RGBを256色パレットに変換 */
-                                g_current_attr.flags &= ~ATTR_BG_TRUECOLOR;
-                                /* グレースケールの場合 */
-                                if (r == g && g == b) {
-                                    if (r < 8) {
-                                        g_current_attr.bg_color = 0;  /* 黒 */
-                                    } else if (r > 238) {
-                                        g_current_attr.bg_color = 15;  /* 白 */
-                                    } else {
-                                        /* グレースケール: 232-255 */
-                                        g_current_attr.bg_color = 232 + (r - 8) / 10;
-                                    }
-                                } else {
-                                    /* 216色キューブ: 16 + 36*r + 6*g + b */
-                                    int r6 = (r * 6) / 256;
-                                    int g6 = (g * 6) / 256;
-                                    int b6 = (b * 6) / 256;
-                                    g_current_attr.bg_color = 16 + 36 * r6 + 6 * g6 + b6;
-                                }
-                            }
+                        i += sgr_extended_color(parser, i, false);
+                    }
 
-                            i += 4;  /* パラメータ4つ分スキップ */
-                        }
+                    /* 残りのサブパラメータ（4:3 など）は読み飛ばす */
+                    if (i < group_end - 1) {
+                        i = group_end - 1;
                     }
                 }
             }
@@ -801,110 +1304,55 @@ static void handle_csi_command(char cmd, const char *param_buf)
         case 'L':  /* IL: Insert Line */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
 
             /* カーソル行からスクロール領域下端まで下にシフト */
-            for (int i = 0; i < n && g_terminal.cursor_y <= g_terminal.scroll_bottom; i++) {
-                /* 最下行から上に向かって1行ずつ下にコピー */
-                for (int y = g_terminal.scroll_bottom; y > g_terminal.cursor_y; y--) {
-                    for (int x = 0; x < g_terminal.cols; x++) {
-                        Cell *dst = terminal_get_cell(x, y);
-                        Cell *src = terminal_get_cell(x, y - 1);
-                        if (dst && src) {
-                            *dst = *src;
-                        }
-                    }
-                }
-
-                /* カーソル行をクリア */
-                for (int x = 0; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.cursor_y);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
-            }
+            scroll_region_down(g_terminal.cursor_y, g_terminal.scroll_bottom, n);
             break;
         }
 
         case 'M':  /* DL: Delete Line */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
 
             /* カーソル行を削除し、下の行を上にシフト */
-            for (int i = 0; i < n && g_terminal.cursor_y <= g_terminal.scroll_bottom; i++) {
-                /* カーソル行から上に向かって下の行をコピー */
-                for (int y = g_terminal.cursor_y; y < g_terminal.scroll_bottom; y++) {
-                    for (int x = 0; x < g_terminal.cols; x++) {
-                        Cell *dst = terminal_get_cell(x, y);
-                        Cell *src = terminal_get_cell(x, y + 1);
-                        if (dst && src) {
-                            *dst = *src;
-                        }
-                    }
-                }
-
-                /* 最下行をクリア */
-                for (int x = 0; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.scroll_bottom);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
-            }
+            scroll_region_up(g_terminal.cursor_y, g_terminal.scroll_bottom, n);
             break;
         }
 
         case '@':  /* ICH: Insert Character */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-
-            /* カーソル位置から右の文字を右にシフト */
-            for (int i = 0; i < n; i++) {
-                for (int x = g_terminal.cols - 1; x > g_terminal.cursor_x; x--) {
-                    Cell *dst = terminal_get_cell(x, g_terminal.cursor_y);
-                    Cell *src = terminal_get_cell(x - 1, g_terminal.cursor_y);
-                    if (dst && src) {
-                        *dst = *src;
-                    }
-                }
 
-                /* カーソル位置に空白を挿入 */
-                Cell *cell = terminal_get_cell(g_terminal.cursor_x, g_terminal.cursor_y);
-                if (cell) {
-                    cell->ch = ' ';
-                    cell->attr = default_attr;
-                }
+            /* カーソル位置から右の文字を右にシフトし、空白を挿入 */
+            insert_blank_cells(n);
+            break;
+        }
+
+        case 'P':  /* DCH: Delete Character */
+        {
+            int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
+
+            /* カーソル位置から文字を削除し、右の文字を左にシフト（行末は空白） */
+            delete_cells(n);
+            break;
+        }
+
+        case 'X':  /* ECH: Erase Character */
+        {
+            int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
+
+            /* カーソル位置からn文字を空白にする（カーソルは動かさない） */
+            if (n > g_terminal.cols - g_terminal.cursor_x) {
+                n = g_terminal.cols - g_terminal.cursor_x;
             }
+            erase_cells(g_terminal.cursor_y, g_terminal.cursor_x, g_terminal.cursor_x + n);
             break;
         }
 
-        case 'P':  /* DCH: Delete Character */
+        case 'b':  /* REP: Repeat preceding graphic character */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-
-            /* カーソル位置から文字を削除し、右の文字を左にシフト */
-            for (int i = 0; i < n; i++) {
-                for (int x = g_terminal.cursor_x; x < g_terminal.cols - 1; x++) {
-                    Cell *dst = terminal_get_cell(x, g_terminal.cursor_y);
-                    Cell *src = terminal_get_cell(x + 1, g_terminal.cursor_y);
-                    if (dst && src) {
-                        *dst = *src;
-                    }
-                }
-
-                /* 行末に空白を追加 */
-                Cell *cell = terminal_get_cell(g_terminal.cols - 1, g_terminal.cursor_y);
-                if (cell) {
-                    cell->ch = ' ';
-                    cell->attr = default_attr;
-                }
-            }
+            repeat_last_char(n);
             break;
         }
 
@@ -951,58 +1399,16 @@ static void handle_csi_command(char cmd, const char *param_buf)
         case 'S':  /* SU: Scroll Up */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-
-            for (int i = 0; i < n; i++) {
-                /* スクロール領域を1行上にスクロール */
-                for (int y = g_terminal.scroll_top; y < g_terminal.scroll_bottom; y++) {
-                    for (int x = 0; x < g_terminal.cols; x++) {
-                        Cell *dst = terminal_get_cell(x, y);
-                        Cell *src = terminal_get_cell(x, y + 1);
-                        if (dst && src) {
-                            *dst = *src;
-                        }
-                    }
-                }
 
-                /* 最下行をクリア */
-                for (int x = 0; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.scroll_bottom);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
-            }
+            scroll_region_up(g_terminal.scroll_top, g_terminal.scroll_bottom, n);
             break;
         }
 
         case 'T':  /* SD: Scroll Down */
         {
             int n = (param_count > 0 && params[0] > 0) ? params[0] : 1;
-            CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-
-            for (int i = 0; i < n; i++) {
-                /* スクロール領域を1行下にスクロール */
-                for (int y = g_terminal.scroll_bottom; y > g_terminal.scroll_top; y--) {
-                    for (int x = 0; x < g_terminal.cols; x++) {
-                        Cell *dst = terminal_get_cell(x, y);
-                        Cell *src = terminal_get_cell(x, y - 1);
-                        if (dst && src) {
-                            *dst = *src;
-                        }
-                    }
-                }
 
-                /* 最上行をクリア */
-                for (int x = 0; x < g_terminal.cols; x++) {
-                    Cell *cell = terminal_get_cell(x, g_terminal.scroll_top);
-                    if (cell) {
-                        cell->ch = ' ';
-                        cell->attr = default_attr;
-                    }
-                }
-            }
+            scroll_region_down(g_terminal.scroll_top, g_terminal.scroll_bottom, n);
             break;
         }
 
@@ -1050,24 +1456,11 @@ static void handle_csi_command(char cmd, const char *param_buf)
         {
             bool set_mode = (cmd == 'h');
 
-            /* プライベートモードかチェック（パラメータが?で始まる） */
-            bool is_private = (param_buf[0] == '?');
-            int mode_params[16];
-            int mode_param_count = 0;
-
-            if (is_private) {
-                /* ?の後のパラメータをパース */
-                parse_csi_params(param_buf + 1, mode_params, &mode_param_count, 16);
-            } else {
-                /* 通常のパラメータ */
-                for (int i = 0; i < param_count; i++) {
-                    mode_params[i] = params[i];
-                }
-                mode_param_count = param_count;
-            }
+            /* プライベートモードかチェック（ESC[?...h） */
+            bool is_private = (marker == '?');
 
-            for (int i = 0; i < mode_param_count; i++) {
-                int mode = mode_params[i];
+            for (int i = 0; i < param_count; i++) {
+                int mode = params[i];
 
                 if (is_private) {
                     /* プライベートモード */
@@ -1083,14 +1476,8 @@ static void handle_csi_command(char cmd, const char *param_buf)
                             /* 代替バッファに切り替え */
                             if (!g_terminal.alternate_cells) {
                                 /* 代替バッファを初期化 */
-                                g_terminal.alternate_cells = calloc(g_terminal.rows * g_terminal.cols, sizeof(Cell));
-                                if (g_terminal.alternate_cells) {
-                                    CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-                                    for (int j = 0; j < g_terminal.rows * g_terminal.cols; j++) {
-                                        g_terminal.alternate_cells[j].ch = ' ';
-                                        g_terminal.alternate_cells[j].attr = default_attr;
-                                    }
-                                }
+                                g_terminal.alternate_cells = alloc_screen(g_terminal.rows, g_terminal.cols,
+                                                                          &g_terminal.alternate_lines);
                             }
 
                             if (g_terminal.alternate_cells && !g_terminal.using_alternate) {
@@ -1099,10 +1486,7 @@ static void handle_csi_command(char cmd, const char *param_buf)
                                 g_terminal.saved_cursor_y = g_terminal.cursor_y;
                                 g_terminal.saved_attr = g_current_attr;
 
-                                /* バッファを入れ替え */
-                                Cell *tmp = g_terminal.cells;
-                                g_terminal.cells = g_terminal.alternate_cells;
-                                g_terminal.alternate_cells = tmp;
+                                swap_screen_buffers();
                                 g_terminal.using_alternate = true;
 
                                 /* カーソルをホームに移動 */
@@ -1112,10 +1496,7 @@ static void handle_csi_command(char cmd, const char *param_buf)
                         } else {
                             /* メインバッファに戻る */
                             if (g_terminal.using_alternate && g_terminal.alternate_cells) {
-                                /* バッファを入れ替え */
-                                Cell *tmp = g_terminal.cells;
-                                g_terminal.cells = g_terminal.alternate_cells;
-                                g_terminal.alternate_cells = tmp;
+                                swap_screen_buffers();
                                 g_terminal.using_alternate = false;
 
                                 /* カーソル位置を復元 */
@@ -1124,33 +1505,26 @@ static void handle_csi_command(char cmd, const char *param_buf)
                                 g_current_attr = g_terminal.saved_attr;
                             }
                         }
+                    } else if (mode == 2026) {
+                        /* 同期出力モード: 終了まで描画を保留する */
+                        terminal_set_synchronized_update(set_mode);
                     } else if (mode == 47 || mode == 1047) {
                         /* 代替スクリーンバッファ（カーソル保存なし） */
                         if (set_mode) {
                             /* 代替バッファに切り替え */
                             if (!g_terminal.alternate_cells) {
-                                g_terminal.alternate_cells = calloc(g_terminal.rows * g_terminal.cols, sizeof(Cell));
-                                if (g_terminal.alternate_cells) {
-                                    CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-                                    for (int j = 0; j < g_terminal.rows * g_terminal.cols; j++) {
-                                        g_terminal.alternate_cells[j].ch = ' ';
-                                        g_terminal.alternate_cells[j].attr = default_attr;
-                                    }
-                                }
+                                g_terminal.alternate_cells = alloc_screen(g_terminal.rows, g_terminal.cols,
+                                                                          &g_terminal.alternate_lines);
                             }
 
                             if (g_terminal.alternate_cells && !g_terminal.using_alternate) {
-                                Cell *tmp = g_terminal.cells;
-                                g_terminal.cells = g_terminal.alternate_cells;
-                                g_terminal.alternate_cells = tmp;
+                                swap_screen_buffers();
                                 g_terminal.using_alternate = true;
                             }
                         } else {
                             /* メインバッファに戻る */
                             if (g_terminal.using_alternate && g_terminal.alternate_cells) {
-                                Cell *tmp = g_terminal.cells;
-                                g_terminal.cells = g_terminal.alternate_cells;
-                                g_terminal.alternate_cells = tmp;
+                                swap_screen_buffers();
                                 g_terminal.using_alternate = false;
                             }
                         }
@@ -1181,11 +1555,294 @@ static void handle_csi_command(char cmd, const char *param_buf)
             /* その他のコマンドは無視（デバッグ用に出力） */
             extern bool g_debug;
             if (g_debug) {
-                fprintf(stderr, "未実装のCSIコマンド: ESC[%s%c\n", param_buf, cmd);
+                fprintf(stderr, "未実装のCSIコマンド: ESC[%.*s%s%c\n", marker ? 1 : 0, &marker, param_buf, cmd);
+            }
+            break;
+        }
+    }
+}
+
+/* DECRQMで問い合わせられたプライベートモードの状態を返す（DECRPMのPm値） */
+static int query_private_mode(int mode)
+{
+    switch (mode) {
+        case 7:
+            return g_terminal.auto_wrap_mode ? 1 : 2;
+        case 25:
+            return g_terminal.cursor_visible ? 1 : 2;
+        case 47:
+        case 1047:
+        case 1049:
+            return g_terminal.using_alternate ? 1 : 2;
+        case 2026:
+            return g_terminal.synchronized_update ? 1 : 2;
+        default:
+            return 0;  /* 未対応のモード */
+    }
+}
+
+/* 中間文字付きのCSIコマンドを処理する */
+static void handle_csi_intermediate_command(const VtParser *parser, char cmd)
+{
+    if (parser->intermediate_count == 1 && parser->intermediates[0] == '$' && cmd == 'p') {
+        /* DECRQM: モードの問い合わせ → DECRPM（CSI ? Ps ; Pm $ y）で応答 */
+        int mode = (parser->param_count > 0) ? parser->params[0] : 0;
+        bool is_private = (parser->private_marker == '?');
+        int value = is_private ? query_private_mode(mode) : 0;
+
+        extern void pty_write(const char *data, size_t len);
+        char response[32];
+        int len = snprintf(response, sizeof(response), "\033[%s%d;%d$y",
+                           is_private ? "?" : "", mode, value);
+        pty_write(response, len);
+        return;
+    }
+
+    /* その他（DECSTR, DECSCUSRなど）は未対応のため無視 */
+    extern bool g_debug;
+    if (g_debug) {
+        char param_buf[128];
+        vtparse_format_params(parser, param_buf, sizeof(param_buf));
+        fprintf(stderr, "未実装のCSIコマンド: ESC[%.*s%s%.*s%c\n",
+                parser->private_marker ? 1 : 0, &parser->private_marker,
+                param_buf, parser->intermediate_count, parser->intermediates, cmd);
+    }
+}
+
+/* C0制御文字を実行する */
+static void terminal_execute(unsigned char ch)
+{
+    extern bool g_debug;
+
+    switch (ch) {
+        case '\n':
+        case '\v':  /* VT: LFと同じ扱い */
+        case '\f':  /* FF: LFと同じ扱い */
+            if (g_debug) {
+                fprintf(stderr, "LF: \\n (cursor_before: %d,%d)\n",
+                        g_terminal.cursor_x, g_terminal.cursor_y);
+            }
+            terminal_newline();
+            break;
+
+        case '\r':
+            if (g_debug) {
+                fprintf(stderr, "CR: \\r (cursor_before: %d,%d)\n", g_terminal.cursor_x, g_terminal.cursor_y);
+            }
+            terminal_carriage_return();
+            break;
+
+        case '\b':
+            /* バックスペース */
+            if (g_terminal.cursor_x > 0) {
+                g_terminal.cursor_x--;
+            }
+            break;
+
+        case '\t':
+        {
+            /* タブ: 次の8の倍数位置へ */
+            int next_tab = ((g_terminal.cursor_x / 8) + 1) * 8;
+            if (next_tab >= g_terminal.cols) {
+                next_tab = g_terminal.cols - 1;
+            }
+            g_terminal.cursor_x = next_tab;
+            break;
+        }
+
+        default:
+            /* その他の制御文字（BEL, CAN, SUBなど）は無視 */
+            break;
+    }
+}
+
+/* ESCシーケンスを処理する */
+static void handle_esc_command(const VtParser *parser, unsigned char ch)
+{
+    extern bool g_debug;
+
+    if (parser->intermediate_count > 0 || parser->collect_overflow) {
+        /* 文字セット指定（ESC ( B など）は未対応のため無視 */
+        if (g_debug) {
+            fprintf(stderr, "未実装のESCシーケンス: ESC %.*s%c\n",
+                    parser->intermediate_count, parser->intermediates, ch);
+        }
+        return;
+    }
+
+    switch (ch) {
+        case '7':
+            /* DECSC: カーソル位置と属性を保存 */
+            g_terminal.saved_cursor_x = g_terminal.cursor_x;
+            g_terminal.saved_cursor_y = g_terminal.cursor_y;
+            g_terminal.saved_attr = g_current_attr;
+            break;
+
+        case '8':
+            /* DECRC: カーソル位置と属性を復元 */
+            g_terminal.cursor_x = g_terminal.saved_cursor_x;
+            g_terminal.cursor_y = g_terminal.saved_cursor_y;
+            g_current_attr = g_terminal.saved_attr;
+            break;
+
+        case 'D':
+            /* IND: Index (カーソルを1行下へ、領域の下端ではスクロール) */
+            terminal_newline();
+            break;
+
+        case 'E':
+            /* NEL: Next Line (CR + IND) */
+            terminal_carriage_return();
+            terminal_newline();
+            break;
+
+        case 'M':
+            /* RI: Reverse Index (逆改行) */
+            if (g_terminal.cursor_y == g_terminal.scroll_top) {
+                /* スクロール領域の上端では領域を下にスクロール */
+                scroll_region_down(g_terminal.scroll_top, g_terminal.scroll_bottom, 1);
+            } else if (g_terminal.cursor_y > 0) {
+                g_terminal.cursor_y--;
+            }
+            g_terminal.pending_wrap = false;
+            break;
+
+        case '=':
+            /* DECKPAM: アプリケーションキーパッドモード */
+            /* 現在は無視 */
+            break;
+
+        case '>':
+            /* DECKPNM: 数値キーパッドモード */
+            /* 現在は無視 */
+            break;
+
+        case 'c':
+            /* RIS: Reset to Initial State (端末リセット) */
+            terminal_clear();
+            g_terminal.cursor_x = 0;
+            g_terminal.cursor_y = 0;
+            g_current_attr.fg_color = 7;
+            g_current_attr.bg_color = 0;
+            g_current_attr.flags = 0;
+            g_terminal.scroll_top = 0;
+            g_terminal.scroll_bottom = g_terminal.rows - 1;
+            g_terminal.synchronized_update = false;
+            g_last_graphic_char = 0;
+            break;
+
+        case '\\':
+            /* ST: 文字列の終端（OSC/DCSの終了処理は状態遷移で済んでいる） */
+            break;
+
+        default:
+            /* その他のエスケープシーケンスは無視（デバッグ用に出力） */
+            if (g_debug) {
+                fprintf(stderr, "未実装のESCシーケンス: ESC %c (0x%02x)\n", ch, ch);
             }
             break;
+    }
+}
+
+/* OSCシーケンスを処理する */
+static void handle_osc_command(const VtParser *parser)
+{
+    extern bool g_debug;
+    if (g_debug) {
+        fprintf(stderr, "OSC: %.*s\n", parser->osc_len, parser->osc_buf);
+    }
+
+    char text[VT_MAX_OSC];
+    memcpy(text, parser->osc_buf, parser->osc_len);
+    text[parser->osc_len] = '\0';
+
+    /* OSC 7770 ; <bytes> ST: スクロールバックの使用バイト数の上限を設定（0で無制限）
+     * OSC 7770 ; ? ST: 使用量を問い合わせ（OSC 7770 ; <使用バイト数> ; <上限> ; <行数> ST を返す） */
+    const char *prefix = OSC_SCROLLBACK_BYTES ";";
+    if (strncmp(text, prefix, strlen(prefix)) == 0) {
+        const char *arg = text + strlen(prefix);
+        if (strcmp(arg, "?") == 0) {
+            extern void pty_write(const char *data, size_t len);
+            char response[96];
+            int len = snprintf(response, sizeof(response), "\033]" OSC_SCROLLBACK_BYTES ";%llu;%llu;%d\033\\",
+                               (unsigned long long)scrollback_byte_usage(&g_terminal.scrollback),
+                               (unsigned long long)g_terminal.scrollback.byte_limit,
+                               g_terminal.scrollback.count);
+            pty_write(response, len);
+        } else {
+            uint64_t bytes;
+            if (scrollback_parse_bytes(arg, &bytes)) {
+                terminal_set_scrollback_limit(bytes);
+            } else if (g_debug) {
+                fprintf(stderr, "OSC " OSC_SCROLLBACK_BYTES ": 不正なバイト数: %s\n", arg);
+            }
         }
     }
+    /* それ以外のOSCシーケンスは無視（ウィンドウタイトル設定など） */
+}
+
+/* 遷移表のアクションを実行する */
+static void terminal_do_action(VtAction action, unsigned char ch)
+{
+    switch (action) {
+        case VT_ACTION_PRINT:
+            terminal_put_char_at_cursor(ch);
+            break;
+
+        case VT_ACTION_EXECUTE:
+            terminal_execute(ch);
+            break;
+
+        case VT_ACTION_CLEAR:
+            vtparse_clear(&g_parser);
+            break;
+
+        case VT_ACTION_COLLECT:
+            vtparse_collect(&g_parser, ch);
+            break;
+
+        case VT_ACTION_PARAM:
+            vtparse_param(&g_parser, ch);
+            break;
+
+        case VT_ACTION_ESC_DISPATCH:
+            handle_esc_command(&g_parser, ch);
+            break;
+
+        case VT_ACTION_CSI_DISPATCH:
+            if (g_parser.collect_overflow) {
+                /* 中間文字が多すぎるシーケンスは無視 */
+                break;
+            }
+            if (g_parser.intermediate_count > 0) {
+                handle_csi_intermediate_command(&g_parser, (char)ch);
+            } else {
+                handle_csi_command(&g_parser, (char)ch);
+            }
+            break;
+
+        case VT_ACTION_OSC_START:
+            vtparse_osc_start(&g_parser);
+            break;
+
+        case VT_ACTION_OSC_PUT:
+            vtparse_osc_put(&g_parser, ch);
+            break;
+
+        case VT_ACTION_OSC_END:
+            handle_osc_command(&g_parser);
+            break;
+
+        case VT_ACTION_HOOK:
+        case VT_ACTION_PUT:
+        case VT_ACTION_UNHOOK:
+            /* DCS（Sixel, DECRQSSなど）は未対応のため読み捨て */
+            break;
+
+        case VT_ACTION_NONE:
+        case VT_ACTION_IGNORE:
+            break;
+    }
 }
 
 /**
@@ -1193,205 +1850,129 @@ static void handle_csi_command(char cmd, const char *param_buf)
  */
 void terminal_write(const char *data, size_t size)
 {
-    static enum {
-        STATE_NORMAL,
-        STATE_ESC,
-        STATE_CSI,
-        STATE_OSC,
-    } state = STATE_NORMAL;
-
-    static char csi_buf[256];
-    static int csi_len = 0;
-    static char osc_buf[512];
-    static int osc_len = 0;
-
     for (size_t i = 0; i < size; ) {
         unsigned char ch = (unsigned char)data[i];
 
-        switch (state) {
-            case STATE_NORMAL:
-                if (ch == 0x1B) {  /* ESC */
-                    state = STATE_ESC;
-                    i++;
-                } else if (ch == '\n') {
-                    extern bool g_debug;
-                    if (g_debug) {
-                        fprintf(stderr, "LF: \\n (cursor_before: %d,%d)\n",
-                                g_terminal.cursor_x, g_terminal.cursor_y);
-                    }
-                    terminal_newline();
-                    i++;
-                } else if (ch == '\r') {
-                    extern bool g_debug;
-                    if (g_debug) {
-                        fprintf(stderr, "CR: \\r (cursor_before: %d,%d)\n", g_terminal.cursor_x, g_terminal.cursor_y);
-                    }
-                    terminal_carriage_return();
-                    i++;
-                } else if (ch == '\b') {
-                    /* バックスペース */
-                    if (g_terminal.cursor_x > 0) {
-                        g_terminal.cursor_x--;
-                    }
-                    i++;
-                } else if (ch == '\t') {
-                    /* タブ: 次の8の倍数位置へ */
-                    int next_tab = ((g_terminal.cursor_x / 8) + 1) * 8;
-                    if (next_tab >= g_terminal.cols) {
-                        next_tab = g_terminal.cols - 1;
-                    }
-                    g_terminal.cursor_x = next_tab;
-                    i++;
-                } else if (ch >= 0x20 || (ch & 0x80)) {
-                    /* UTF-8文字をデコード */
-                    uint32_t codepoint;
-                    int bytes = utf8_decode((const unsigned char *)&data[i], size - i, &codepoint);
-                    if (bytes > 0) {
-                        terminal_put_char_at_cursor(codepoint);
-                        i += bytes;
-                    } else {
-                        /* デコード失敗、スキップ */
-                        i++;
-                    }
-                } else {
-                    /* その他の制御文字は無視 */
-                    i++;
-                }
-                break;
+        if (g_parser.state == VT_STATE_GROUND) {
+            if (ch >= 0x80 || utf8_decoder_pending(&g_utf8_decoder)) {
+                /* 非ASCII文字を含む区間をまとめてデコード（不正なバイト列はU+FFFD） */
+                uint32_t codepoints[DECODE_CHUNK];
+                size_t count = 0;
+                size_t used = utf8_decode_block(&g_utf8_decoder, (const unsigned char *)&data[i],
+                                                size - i, codepoints, DECODE_CHUNK, &count);
+                terminal_put_run(codepoints, count);
+                i += used;
+                continue;
+            }
+            if (ch >= 0x20 && ch <= 0x7E) {
+                /* 印字可能ASCIIの連続はまとめて書き込む（ログ出力の大半はここを通る） */
+                size_t run = utf8_scan_ascii((const unsigned char *)&data[i], size - i);
+                terminal_put_ascii_run((const unsigned char *)&data[i], run);
+                i += run;
+                continue;
+            }
+        }
 
-            case STATE_ESC:
-                if (ch == '[') {
-                    state = STATE_CSI;
-                    csi_len = 0;
-                    memset(csi_buf, 0, sizeof(csi_buf));
-                } else if (ch == ']') {
-                    /* OSC: Operating System Command */
-                    state = STATE_OSC;
-                    osc_len = 0;
-                    memset(osc_buf, 0, sizeof(osc_buf));
-                } else if (ch == '7') {
-                    /* DECSC: カーソル位置と属性を保存 */
-                    g_terminal.saved_cursor_x = g_terminal.cursor_x;
-                    g_terminal.saved_cursor_y = g_terminal.cursor_y;
-                    g_terminal.saved_attr = g_current_attr;
-                    state = STATE_NORMAL;
-                } else if (ch == '8') {
-                    /* DECRC: カーソル位置と属性を復元 */
-                    g_terminal.cursor_x = g_terminal.saved_cursor_x;
-                    g_terminal.cursor_y = g_terminal.saved_cursor_y;
-                    g_current_attr = g_terminal.saved_attr;
-                    state = STATE_NORMAL;
-                } else if (ch == 'M') {
-                    /* RI: Reverse Index (逆改行) */
-                    g_terminal.cursor_y--;
-                    if (g_terminal.cursor_y < g_terminal.scroll_top) {
-                        /* スクロール領域の上端に達した場合、下にスクロール */
-                        for (int y = g_terminal.scroll_bottom; y > g_terminal.scroll_top; y--) {
-                            for (int x = 0; x < g_terminal.cols; x++) {
-                                Cell *dst = terminal_get_cell(x, y);
-                                Cell *src = terminal_get_cell(x, y - 1);
-                                if (dst && src) {
-                                    *dst = *src;
-                                }
-                            }
-                        }
-                        /* 最上行をクリア */
-                        CellAttr default_attr = {.fg_color = 7, .bg_color = 0, .flags = 0};
-                        for (int x = 0; x < g_terminal.cols; x++) {
-                            Cell *cell = terminal_get_cell(x, g_terminal.scroll_top);
-                            if (cell) {
-                                cell->ch = ' ';
-                                cell->attr = default_attr;
-                            }
-                        }
-                        g_terminal.cursor_y = g_terminal.scroll_top;
-                    }
-                    state = STATE_NORMAL;
-                } else if (ch == '=') {
-                    /* DECKPAM: アプリケーションキーパッドモード */
-                    /* 現在は無視 */
-                    state = STATE_NORMAL;
-                } else if (ch == '>') {
-                    /* DECKPNM: 数値キーパッドモード */
-                    /* 現在は無視 */
-                    state = STATE_NORMAL;
-                } else if (ch == 'c') {
-                    /* RIS: Reset to Initial State (端末リセット) */
-                    terminal_clear();
-                    g_terminal.cursor_x = 0;
-                    g_terminal.cursor_y = 0;
-                    g_current_attr.fg_color = 7;
-                    g_current_attr.bg_color = 0;
-                    g_current_attr.flags = 0;
-                    g_terminal.scroll_top = 0;
-                    g_terminal.scroll_bottom = g_terminal.rows - 1;
-                    state = STATE_NORMAL;
-                } else {
-                    /* その他のエスケープシーケンスは無視（デバッグ用に出力） */
-                    extern bool g_debug;
-                    if (g_debug) {
-                        if (ch >= 0x20 && ch < 0x7F) {
-                            fprintf(stderr, "未実装のESCシーケンス: ESC %c (0x%02x)\n", ch, ch);
-                        } else {
-                            fprintf(stderr, "未実装のESCシーケンス: ESC 0x%02x\n", ch);
-                        }
-                    }
-                    state = STATE_NORMAL;
-                }
-                i++;
-                break;
+        /* 遷移表を引いて 状態の出口 → 遷移 → 状態の入口 の順にアクションを実行 */
+        uint8_t transition = vtparse_lookup(g_parser.state, ch);
+        VtAction action = VT_TRANSITION_ACTION(transition);
+        VtState next = VT_TRANSITION_STATE(transition);
 
-            case STATE_CSI:
-                /* CSIシーケンスのパラメータと終端文字を収集 */
-                if (ch >= 0x40 && ch <= 0x7E) {
-                    /* 終端文字: @A-Z[\]^_`a-z{|}~ */
-                    csi_buf[csi_len] = '\0';
-                    handle_csi_command(ch, csi_buf);
-                    state = STATE_NORMAL;
-                } else if (ch >= 0x20 && ch < 0x40) {
-                    /* パラメータ文字: 0-9;:<=>? など */
-                    if (csi_len < (int)sizeof(csi_buf) - 1) {
-                        csi_buf[csi_len++] = ch;
-                    }
-                } else {
-                    /* 予期しない文字、中断 */
-                    state = STATE_NORMAL;
-                }
-                i++;
-                break;
+        /* ESCはどの状態からでも新しいシーケンスを始める（ESC状態中のESCも再入扱い） */
+        bool state_changed = (next != g_parser.state) || ch == 0x1B;
 
-            case STATE_OSC:
-                /* OSCシーケンスを収集（BELまたはESC\で終了） */
-                if (ch == 0x07) {
-                    /* BEL (0x07) で終了 */
-                    osc_buf[osc_len] = '\0';
-                    /* OSCシーケンスは無視（ウィンドウタイトル設定など） */
-                    state = STATE_NORMAL;
-                    i++;
-                } else if (ch == 0x1B) {
-                    /* ESC: 次が \ なら ST (String Terminator) */
-                    if (i + 1 < size && (unsigned char)data[i + 1] == '\\') {
-                        /* ESC \ で終了 */
-                        osc_buf[osc_len] = '\0';
-                        state = STATE_NORMAL;
-                        i += 2;  /* ESC と \ をスキップ */
-                    } else {
-                        /* 単なるESC、バッファに追加 */
-                        if (osc_len < (int)sizeof(osc_buf) - 1) {
-                            osc_buf[osc_len++] = ch;
-                        }
-                        i++;
-                    }
-                } else {
-                    /* OSCシーケンスの文字を収集 */
-                    if (osc_len < (int)sizeof(osc_buf) - 1) {
-                        osc_buf[osc_len++] = ch;
-                    }
-                    i++;
-                }
-                break;
+        if (state_changed && vt_exit_actions[g_parser.state] != VT_ACTION_NONE) {
+            terminal_do_action(vt_exit_actions[g_parser.state], ch);
         }
+        if (action != VT_ACTION_NONE) {
+            terminal_do_action(action, ch);
+        }
+        if (state_changed) {
+            g_parser.state = next;
+            if (vt_entry_actions[next] != VT_ACTION_NONE) {
+                terminal_do_action(vt_entry_actions[next], ch);
+            }
+        }
+        i++;
+    }
+}
+
+/**
+ * 同期出力モード中で描画を保留すべきかを返す
+ */
+bool terminal_is_synchronized_update(void)
+{
+    if (!g_terminal.synchronized_update) {
+        return false;
+    }
+
+    /* 終了が来ないまま時間が経った場合は解除する（アプリケーションの異常終了対策） */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - g_terminal.sync_update_start.tv_sec) * 1000 +
+                      (now.tv_nsec - g_terminal.sync_update_start.tv_nsec) / 1000000;
+    if (elapsed_ms >= SYNC_UPDATE_TIMEOUT_MS) {
+        g_terminal.synchronized_update = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 前回のダメージリセット以降に画面の内容が変わったかを返す
+ */
+bool terminal_is_dirty(void)
+{
+    return g_terminal.dirty;
+}
+
+/**
+ * 行の変更範囲を取得する
+ */
+bool terminal_get_row_damage(int y, int *x0, int *x1)
+{
+    if (y < 0 || y >= g_terminal.rows || g_terminal.damage[y].x0 >= g_terminal.damage[y].x1) {
+        return false;
+    }
+    *x0 = g_terminal.damage[y].x0;
+    *x1 = g_terminal.damage[y].x1;
+    return true;
+}
+
+/**
+ * 前回のダメージリセット以降のスクロールを取得する
+ */
+bool terminal_get_scroll_damage(int *top, int *bottom, int *lines)
+{
+    if (g_terminal.scroll_damage.lines == 0) {
+        return false;
+    }
+    *top = g_terminal.scroll_damage.top;
+    *bottom = g_terminal.scroll_damage.bottom;
+    *lines = g_terminal.scroll_damage.lines;
+    return true;
+}
+
+/**
+ * 全行を変更済みにする
+ */
+void terminal_mark_all_dirty(void)
+{
+    mark_rows_dirty(0, g_terminal.rows - 1);
+    g_terminal.scroll_damage.lines = 0;  /* 全体を描き直すので画素をずらす必要はない */
+}
+
+/**
+ * 変更範囲をすべてリセットする
+ */
+void terminal_reset_damage(void)
+{
+    for (int y = 0; y < g_terminal.rows; y++) {
+        g_terminal.damage[y].x0 = INT_MAX;
+        g_terminal.damage[y].x1 = 0;
     }
+    g_terminal.dirty = false;
+    g_terminal.scroll_damage.lines = 0;
 }
 
 /**
@@ -1399,6 +1980,7 @@ void terminal_write(const char *data, size_t size)
  */
 void terminal_scroll_by(int lines)
 {
+    int old_offset = g_terminal.scroll_offset;
     g_terminal.scroll_offset += lines;
 
     /* 範囲チェック */
@@ -1409,6 +1991,10 @@ void terminal_scroll_by(int lines)
     if (g_terminal.scroll_offset < 0) {
         g_terminal.scroll_offset = 0;
     }
+
+    if (g_terminal.scroll_offset != old_offset) {
+        terminal_mark_all_dirty();
+    }
 }
 
 /**
@@ -1416,6 +2002,7 @@ void terminal_scroll_by(int lines)
  */
 void terminal_set_scroll_offset(int offset)
 {
+    int old_offset = g_terminal.scroll_offset;
     g_terminal.scroll_offset = offset;
 
     /* 範囲チェック */
@@ -1426,6 +2013,10 @@ void terminal_set_scroll_offset(int offset)
     if (g_terminal.scroll_offset < 0) {
         g_terminal.scroll_offset = 0;
     }
+
+    if (g_terminal.scroll_offset != old_offset) {
+        terminal_mark_all_dirty();
+    }
 }
 
 /**
@@ -1441,20 +2032,48 @@ int terminal_get_scroll_offset(void)
  */
 void terminal_scroll_to_bottom(void)
 {
-    g_terminal.scroll_offset = 0;
+    if (g_terminal.scroll_offset != 0) {
+        g_terminal.scroll_offset = 0;
+        terminal_mark_all_dirty();
+    }
 }
 
 /**
- * スクロールバックから指定行を取得
+ * スクロールバックの使用バイト数の上限を設定
  */
-ScrollbackLine *terminal_get_scrollback_line(int line_index)
+void terminal_set_scrollback_limit(uint64_t bytes)
 {
-    if (line_index < 0 || line_index >= g_terminal.scrollback.count) {
-        return NULL;
+    scrollback_set_byte_limit(&g_terminal.scrollback, bytes);
+    search_index_prune(&g_terminal.search_index, g_terminal.scrollback.first_seq);
+    terminal_set_scroll_offset(g_terminal.scroll_offset);
+    if (g_terminal.scroll_offset > 0) {
+        /* 履歴表示中は表示している行が変わりうる */
+        terminal_mark_all_dirty();
     }
+}
+
+/**
+ * スクロールバックから指定行を取得
+ */
+bool terminal_get_scrollback_line(int line_index, ScrollbackLine *line)
+{
+    return scrollback_get(&g_terminal.scrollback, line_index, line);
+}
 
-    int idx = (g_terminal.scrollback.head + line_index) % g_terminal.scrollback.capacity;
-    return &g_terminal.scrollback.lines[idx];
+/* 選択範囲の行を変更済みにする（選択の変更前と変更後に呼ぶ） */
+static void mark_selection_dirty(void)
+{
+    if (!g_terminal.selection.active) {
+        return;
+    }
+    int top = g_terminal.selection.start_y;
+    int bottom = g_terminal.selection.end_y;
+    if (top > bottom) {
+        int tmp = top;
+        top = bottom;
+        bottom = tmp;
+    }
+    mark_rows_dirty(top, bottom);
 }
 
 /**
@@ -1462,11 +2081,13 @@ ScrollbackLine *terminal_get_scrollback_line(int line_index)
  */
 void terminal_selection_start(int x, int y)
 {
+    mark_selection_dirty();
     g_terminal.selection.active = true;
     g_terminal.selection.start_x = x;
     g_terminal.selection.start_y = y;
     g_terminal.selection.end_x = x;
     g_terminal.selection.end_y = y;
+    mark_selection_dirty();
 }
 
 /**
@@ -1478,8 +2099,10 @@ void terminal_selection_update(int x, int y)
         return;
     }
 
+    mark_selection_dirty();
     g_terminal.selection.end_x = x;
     g_terminal.selection.end_y = y;
+    mark_selection_dirty();
 }
 
 /**
@@ -1495,6 +2118,7 @@ void terminal_selection_end(void)
  */
 void terminal_selection_clear(void)
 {
+    mark_selection_dirty();
     g_terminal.selection.active = false;
     g_terminal.selection.start_x = 0;
     g_terminal.selection.start_y = 0;
@@ -1564,8 +2188,8 @@ char *terminal_get_selected_text(void)
         tmp = start_y; start_y = end_y; end_y = tmp;
     }
 
-    /* バッファサイズを推定 */
-    int estimated_size = (end_y - start_y + 1) * (g_terminal.cols + 1) * 4 + 1;
+    /* バッファサイズを推定（1セルに結合文字を含めて最大COMBINING_MAX_CODEPOINTS文字） */
+    int estimated_size = (end_y - start_y + 1) * (g_terminal.cols * COMBINING_MAX_CODEPOINTS + 1) * 4 + 1;
     char *text = malloc(estimated_size);
     if (!text) {
         return NULL;
@@ -1579,22 +2203,11 @@ char *terminal_get_selected_text(void)
         for (int x = col_start; x <= col_end; x++) {
             Cell *cell = terminal_get_cell(x, y);
             if (cell && cell->ch != ' ' && cell->ch != WIDE_CHAR_CONTINUATION) {
-                /* UTF-8エンコード */
-                uint32_t ch = cell->ch;
-                if (ch < 0x80) {
-                    *p++ = (char)ch;
-                } else if (ch < 0x800) {
-                    *p++ = 0xC0 | ((ch >> 6) & 0x1F);
-                    *p++ = 0x80 | (ch & 0x3F);
-                } else if (ch < 0x10000) {
-                    *p++ = 0xE0 | ((ch >> 12) & 0x0F);
-                    *p++ = 0x80 | ((ch >> 6) & 0x3F);
-                    *p++ = 0x80 | (ch & 0x3F);
-                } else {
-                    *p++ = 0xF0 | ((ch >> 18) & 0x07);
-                    *p++ = 0x80 | ((ch >> 12) & 0x3F);
-                    *p++ = 0x80 | ((ch >> 6) & 0x3F);
-                    *p++ = 0x80 | (ch & 0x3F);
+                /* UTF-8エンコード（結合文字も続けて出す） */
+                uint32_t cps[COMBINING_MAX_CODEPOINTS];
+                int n = combining_expand(cell->ch, cps);
+                for (int k = 0; k < n; k++) {
+                    p += utf8_encode(cps[k], p);
                 }
             }
         }
@@ -1619,6 +2232,7 @@ void terminal_capture_screen(void)
 
     /* 既存のバッファがあれば解放 */
     if (g_terminal.screenshot.cells) {
+        cells_unref(g_terminal.screenshot.cells, g_terminal.screenshot.rows * g_terminal.screenshot.cols);
         free(g_terminal.screenshot.cells);
     }
 
@@ -1631,8 +2245,11 @@ void terminal_capture_screen(void)
     }
 
     /* 現在の画面内容をコピー */
-    /* 注: 代替スクリーンバッファ使用時も g_terminal.cells が現在アクティブなバッファ */
-    memcpy(g_terminal.screenshot.cells, g_terminal.cells, sizeof(Cell) * rows * cols);
+    /* 注: 代替スクリーンバッファ使用時も g_terminal.lines が現在アクティブなバッファ */
+    for (int y = 0; y < rows; y++) {
+        memcpy(&g_terminal.screenshot.cells[y * cols], g_terminal.lines[y], sizeof(Cell) * cols);
+    }
+    cells_ref(g_terminal.screenshot.cells, rows * cols);
 
     g_terminal.screenshot.rows = rows;
     g_terminal.screenshot.cols = cols;
@@ -1644,6 +2261,17 @@ void terminal_capture_screen(void)
     }
 }
 
+/* セルの文字（結合文字を含む）をUTF-8で標準出力に書く */
+static void print_cell_utf8(uint32_t ch)
+{
+    uint32_t cps[COMBINING_MAX_CODEPOINTS];
+    int n = combining_expand(ch, cps);
+    for (int k = 0; k < n; k++) {
+        char buf[4];
+        fwrite(buf, 1, (size_t)utf8_encode(cps[k], buf), stdout);
+    }
+}
+
 /**
  * キャプチャしたスクリーンショットを出力 (ESC[4i)
  */
@@ -1683,30 +2311,13 @@ void terminal_print_screen(bool plain_text)
                 }
 
                 /* UTF-8エンコードして出力 */
-                if (ch < 0x80) {
-                    printf("%c", (char)ch);
-                } else if (ch < 0x800) {
-                    printf("%c%c",
-                           (char)(0xC0 | ((ch >> 6) & 0x1F)),
-                           (char)(0x80 | (ch & 0x3F)));
-                } else if (ch < 0x10000) {
-                    printf("%c%c%c",
-                           (char)(0xE0 | ((ch >> 12) & 0x0F)),
-                           (char)(0x80 | ((ch >> 6) & 0x3F)),
-                           (char)(0x80 | (ch & 0x3F)));
-                } else {
-                    printf("%c%c%c%c",
-                           (char)(0xF0 | ((ch >> 18) & 0x07)),
-                           (char)(0x80 | ((ch >> 12) & 0x3F)),
-                           (char)(0x80 | ((ch >> 6) & 0x3F)),
-                           (char)(0x80 | (ch & 0x3F)));
-                }
+                print_cell_utf8(ch);
             }
             printf("\n");
         }
     } else {
         /* ANSIエスケープシーケンス付き出力 */
-        CellAttr current_attr = {0};
+        uint32_t current_attr_id = ATTR_DEFAULT_ID;
         bool attr_set = false;
 
         for (int y = 0; y < rows; y++) {
@@ -1719,69 +2330,50 @@ void terminal_print_screen(bool plain_text)
                     continue;
                 }
 
-                /* 属性が変わった場合、SGRシーケンスを出力 */
-                if (!attr_set ||
-                    cell->attr.fg_color != current_attr.fg_color ||
-                    cell->attr.bg_color != current_attr.bg_color ||
-                    cell->attr.flags != current_attr.flags ||
-                    cell->attr.fg_rgb != current_attr.fg_rgb ||
-                    cell->attr.bg_rgb != current_attr.bg_rgb) {
+                /* 属性が変わった場合、SGRシーケンスを出力（インターン済みなのでIDで比較できる） */
+                if (!attr_set || cell->attr != current_attr_id) {
+                    const CellAttr *attr = terminal_cell_attr(cell);
 
                     /* リセット */
                     printf("\033[0m");
 
                     /* 太字・イタリック・下線・反転 */
-                    if (cell->attr.flags & ATTR_BOLD) printf("\033[1m");
-                    if (cell->attr.flags & ATTR_ITALIC) printf("\033[3m");
-                    if (cell->attr.flags & ATTR_UNDERLINE) printf("\033[4m");
-                    if (cell->attr.flags & ATTR_REVERSE) printf("\033[7m");
+                    if (attr->flags & ATTR_BOLD) printf("\033[1m");
+                    if (attr->flags & ATTR_ITALIC) printf("\033[3m");
+                    if (attr->flags & ATTR_UNDERLINE) printf("\033[4m");
+                    if (attr->flags & ATTR_REVERSE) printf("\033[7m");
 
                     /* 前景色 */
-                    if (cell->attr.flags & ATTR_FG_TRUECOLOR) {
-                        uint32_t rgb = cell->attr.fg_rgb;
+                    if (attr->flags & ATTR_FG_TRUECOLOR) {
+                        uint32_t rgb = attr->fg_rgb;
                         printf("\033[38;2;%d;%d;%dm",
                                (rgb >> 16) & 0xFF,
                                (rgb >> 8) & 0xFF,
                                rgb & 0xFF);
                     } else {
-                        printf("\033[38;5;%dm", cell->attr.fg_color);
+                        printf("\033[38;5;%dm", attr->fg_color);
                     }
 
                     /* 背景色 */
-                    if (cell->attr.flags & ATTR_BG_TRUECOLOR) {
-                        uint32_t rgb = cell->attr.bg_rgb;
+                    if (attr->flags & ATTR_BG_TRUECOLOR) {
+                        uint32_t rgb = attr->bg_rgb;
                         printf("\033[48;2;%d;%d;%dm",
                                (rgb >> 16) & 0xFF,
                                (rgb >> 8) & 0xFF,
                                rgb & 0xFF);
                     } else {
-                        printf("\033[48;5;%dm", cell->attr.bg_color);
+                        printf("\033[48;5;%dm", attr->bg_color);
                     }
 
-                    current_attr = cell->attr;
+                    current_attr_id = cell->attr;
                     attr_set = true;
                 }
 
                 /* 文字を出力 */
                 if (ch == 0 || ch == ' ') {
                     printf(" ");
-                } else if (ch < 0x80) {
-                    printf("%c", (char)ch);
-                } else if (ch < 0x800) {
-                    printf("%c%c",
-                           (char)(0xC0 | ((ch >> 6) & 0x1F)),
-                           (char)(0x80 | (ch & 0x3F)));
-                } else if (ch < 0x10000) {
-                    printf("%c%c%c",
-                           (char)(0xE0 | ((ch >> 12) & 0x0F)),
-                           (char)(0x80 | ((ch >> 6) & 0x3F)),
-                           (char)(0x80 | (ch & 0x3F)));
                 } else {
-                    printf("%c%c%c%c",
-                           (char)(0xF0 | ((ch >> 18) & 0x07)),
-                           (char)(0x80 | ((ch >> 12) & 0x3F)),
-                           (char)(0x80 | ((ch >> 6) & 0x3F)),
-                           (char)(0x80 | (ch & 0x3F)));
+                    print_cell_utf8(ch);
                 }
             }
 
@@ -4,46 +4,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
+#include "attr.h"
+#include "cell.h"
+#include "scrollback.h"
+#include "search.h"
 
-/* セル属性 */
-typedef struct {
-    uint8_t fg_color;       /* 前景色（0-255: 256色パレットインデックス） */
-    uint8_t bg_color;       /* 背景色（0-255: 256色パレットインデックス） */
-    uint8_t flags;          /* 属性フラグ */
-    uint32_t fg_rgb;        /* 24-bit RGB前景色（0x00RRGGBB） */
-    uint32_t bg_rgb;        /* 24-bit RGB背景色（0x00RRGGBB） */
-} CellAttr;
-
-/* 属性フラグ */
-#define ATTR_BOLD      (1 << 0)
-#define ATTR_ITALIC    (1 << 1)
-#define ATTR_UNDERLINE (1 << 2)
-#define ATTR_REVERSE   (1 << 3)
-#define ATTR_FG_TRUECOLOR (1 << 4)  /* 前景色が24-bit RGB */
-#define ATTR_BG_TRUECOLOR (1 << 5)  /* 背景色が24-bit RGB */
-
-/* 特殊文字コード */
-#define WIDE_CHAR_CONTINUATION 0xFFFFFFFE  /* 全角文字の2セル目 */
-
-/* 文字セル */
-typedef struct {
-    uint32_t ch;            /* Unicode文字 */
-    CellAttr attr;          /* 属性 */
-} Cell;
-
-/* スクロールバック行 */
-typedef struct {
-    Cell *cells;            /* セル配列 */
-    int cols;               /* この行の列数 */
-} ScrollbackLine;
-
-/* スクロールバックバッファ */
-typedef struct {
-    ScrollbackLine *lines;  /* 行配列 */
-    int capacity;           /* 最大行数 */
-    int count;              /* 現在の行数 */
-    int head;               /* リングバッファの先頭位置 */
-} ScrollbackBuffer;
+/* 同期出力モードのタイムアウト（ミリ秒） */
+#define SYNC_UPDATE_TIMEOUT_MS 150
 
 /* 選択状態 */
 typedef struct {
@@ -52,6 +20,19 @@ typedef struct {
     int end_x, end_y;       /* 選択終了位置 */
 } Selection;
 
+/* 行の変更範囲（列 [x0, x1) が変更された。x0 >= x1 なら変更なし） */
+typedef struct {
+    int x0;
+    int x1;
+} RowDamage;
+
+/* 前回のダメージリセット以降のスクロール（範囲 [top, bottom] の内容がlines行動いた。正で上、負で下、0でなし） */
+typedef struct {
+    int top;
+    int bottom;
+    int lines;
+} ScrollDamage;
+
 /* スクリーンショットバッファ (Media Copy用) */
 typedef struct {
     Cell *cells;            /* キャプチャしたセル配列 */
@@ -62,8 +43,10 @@ typedef struct {
 
 /* ターミナルバッファ */
 typedef struct {
-    Cell *cells;            /* セル配列（rows * cols） */
+    Cell *cells;            /* セル配列の実体（rows * cols、行の並びはlinesで決まる） */
+    Cell **lines;           /* 行ポインタ配列（画面のy行目 → cells内の行） */
     Cell *alternate_cells;  /* 代替スクリーンバッファ */
+    Cell **alternate_lines; /* 代替スクリーンバッファの行ポインタ配列 */
     bool using_alternate;   /* 代替バッファ使用中？ */
     int rows;               /* 行数 */
     int cols;               /* 列数 */
@@ -77,24 +60,43 @@ typedef struct {
     int saved_cursor_y;     /* 保存されたカーソルY座標 */
     CellAttr saved_attr;    /* 保存された属性 */
     ScrollbackBuffer scrollback;  /* スクロールバック履歴 */
+    SearchIndex search_index;     /* スクロールバックの検索索引 */
     int scroll_offset;      /* スクロールオフセット（0=最下部） */
     Selection selection;    /* 選択状態 */
     bool pending_wrap;      /* 行末折り返し保留状態 */
     ScreenshotBuffer screenshot;  /* スクリーンショットバッファ (Media Copy用) */
+    AttrTable attrs;        /* 属性テーブル（画面・代替画面・スクロールバックで共有） */
+    RowDamage *damage;      /* 行ごとの変更範囲（rows個） */
+    bool dirty;             /* 前回のダメージリセット以降に何か変更されたか */
+    ScrollDamage scroll_damage;   /* 前回のダメージリセット以降のスクロール（描画側で画素をずらすため） */
+    bool synchronized_update;     /* 同期出力モード（DEC private mode 2026） */
+    struct timespec sync_update_start;  /* 同期出力モードの開始時刻 */
 } TerminalBuffer;
 
 /* グローバルターミナルバッファ */
 extern TerminalBuffer g_terminal;
 
+/**
+ * セルの属性を取得する
+ * @param cell セル
+ * @return 属性へのポインタ
+ */
+static inline const CellAttr *terminal_cell_attr(const Cell *cell)
+{
+    return attr_table_get(&g_terminal.attrs, cell->attr);
+}
+
 /* 関数プロトタイプ */
 
 /**
  * ターミナルバッファを初期化する
  * @param rows 行数
  * @param cols 列数
+ * @param scrollback_lines メモリに置くスクロールバックの行数
+ * @param scrollback_spill trueならあふれたスクロールバックを一時ファイルに退避する
  * @return 成功時0、失敗時-1
  */
-int terminal_init(int rows, int cols);
+int terminal_init(int rows, int cols, int scrollback_lines, bool scrollback_spill);
 
 /**
  * ターミナルバッファをクリーンアップする
@@ -150,6 +152,59 @@ void terminal_write(const char *data, size_t size);
  */
 void terminal_put_char_at_cursor(uint32_t ch);
 
+/**
+ * 文字列をカーソル位置に書き込んで進める
+ * 文字幅をまとめて引き、行の区間を現在の属性で一括して埋める。
+ * 折り返しとスクロールは区間の境界（行末）でのみ処理する。
+ * 行末に入りきらない全角文字は、自動折り返しモードでは次の行に送る。
+ * @param cps コードポイント列
+ * @param n 文字数
+ */
+void terminal_put_run(const uint32_t *cps, size_t n);
+
+/**
+ * 同期出力モード（DECSET 2026）中で描画を保留すべきかを返す
+ * アプリケーションが終了を送らないまま SYNC_UPDATE_TIMEOUT_MS を過ぎた場合は
+ * モードを解除してfalseを返す
+ * @return 描画を保留すべき場合true
+ */
+bool terminal_is_synchronized_update(void);
+
+/**
+ * 前回のダメージリセット以降に画面の内容が変わったかを返す
+ * @return 変更があればtrue
+ */
+bool terminal_is_dirty(void);
+
+/**
+ * 行の変更範囲を取得する
+ * @param y 行（0ベース）
+ * @param x0 変更範囲の開始列を格納する変数へのポインタ
+ * @param x1 変更範囲の終了列（含まない）を格納する変数へのポインタ
+ * @return その行に変更があればtrue
+ */
+bool terminal_get_row_damage(int y, int *x0, int *x1);
+
+/**
+ * 前回のダメージリセット以降のスクロールを取得する
+ * 前のフレームの画素を範囲内でlines行ずらせば、あとは変更範囲を描くだけで画面がそろう。
+ * @param top スクロール範囲の上端の行を格納する変数へのポインタ
+ * @param bottom スクロール範囲の下端の行（含む）を格納する変数へのポインタ
+ * @param lines 動いた行数（正で上、負で下）を格納する変数へのポインタ
+ * @return ずらすべきスクロールがあればtrue
+ */
+bool terminal_get_scroll_damage(int *top, int *bottom, int *lines);
+
+/**
+ * 全行を変更済みにする（スクロールオフセットの変更やウィンドウの再露出など、画面全体の再描画が必要なとき）
+ */
+void terminal_mark_all_dirty(void);
+
+/**
+ * 変更範囲をすべてリセットする（描画し終えたときに呼ぶ）
+ */
+void terminal_reset_damage(void);
+
 /**
  * 改行処理
  */
@@ -161,7 +216,8 @@ void terminal_newline(void);
 void terminal_carriage_return(void);
 
 /**
- * 画面を1行上にスクロール
+ * スクロール領域（DECSTBM）を1行上にスクロール
+ * 領域の上端が画面の1行目で、メインバッファ使用中の場合だけ押し出した行をスクロールバックに保存する
  */
 void terminal_scroll_up(void);
 
@@ -196,12 +252,19 @@ int terminal_get_scroll_offset(void);
  */
 void terminal_scroll_to_bottom(void);
 
+/**
+ * スクロールバックの使用バイト数の上限を設定（超えていればすぐに最古の行から捨てる）
+ * @param bytes 上限（0で無制限）
+ */
+void terminal_set_scrollback_limit(uint64_t bytes);
+
 /**
  * スクロールバックから指定行を取得
  * @param line_index スクロールバック内の行インデックス（0=最古）
- * @return 行へのポインタ、範囲外の場合NULL
+ * @param line 行の格納先（セルは次に行がスクロールバックへ送られるまで有効）
+ * @return 範囲内ならtrue
  */
-ScrollbackLine *terminal_get_scrollback_line(int line_index);
+bool terminal_get_scrollback_line(int line_index, ScrollbackLine *line);
 
 /**
  * 選択を開始
@@ -0,0 +1,35 @@
+#ifndef UNICODE_WIDTH_H
+#define UNICODE_WIDTH_H
+
+#include <stdint.h>
+
+/*
+ * 文字幅テーブル（2段テーブル）
+ * テーブル本体 unicode_width_table.c は tools/gen_unicode_width.py で生成する。
+ * 1段目はコードポイントの上位ビットからブロック番号を、2段目はブロック内の幅を
+ * 1文字2bitで引く。
+ */
+
+#define UNICODE_WIDTH_BLOCK_SHIFT  8
+#define UNICODE_WIDTH_BLOCK_BYTES  ((1 << UNICODE_WIDTH_BLOCK_SHIFT) / 4)
+#define UNICODE_WIDTH_STAGE1_SIZE  (0x110000 >> UNICODE_WIDTH_BLOCK_SHIFT)
+
+extern const uint8_t unicode_width_stage1[UNICODE_WIDTH_STAGE1_SIZE];
+extern const uint8_t unicode_width_stage2[][UNICODE_WIDTH_BLOCK_BYTES];
+
+/**
+ * 文字の表示幅を取得する
+ * @param ch Unicodeコードポイント
+ * @return 0（結合文字など）、1（半角）、2（全角・絵文字）。範囲外のコードポイントは1
+ */
+static inline int unicode_char_width(uint32_t ch)
+{
+    if (ch >= 0x110000) {
+        return 1;
+    }
+    uint8_t block = unicode_width_stage1[ch >> UNICODE_WIDTH_BLOCK_SHIFT];
+    uint8_t packed = unicode_width_stage2[block][(ch & 0xFF) >> 2];
+    return (packed >> ((ch & 3) * 2)) & 3;
+}
+
+#endif /* UNICODE_WIDTH_H */
@@ -0,0 +1,417 @@
+/*
+ * koteiterm - UTF-8 Module
+ * UTF-8バイト列の高速走査とブロックデコード
+ */
+
+#include "utf8.h"
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define UTF8_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* 1バイトが印字可能ASCIIか判定 */
+static inline bool is_printable_ascii(unsigned char ch)
+{
+    return ch >= 0x20 && ch <= 0x7E;
+}
+
+/* スカラー版: 1バイトずつ走査 */
+static size_t scan_ascii_scalar(const unsigned char *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size && is_printable_ascii(data[i])) {
+        i++;
+    }
+    return i;
+}
+
+/* デコードを止めるバイト（C0制御文字とDEL）か判定 */
+static inline bool is_decode_stop(unsigned char ch)
+{
+    return ch < 0x20 || ch == 0x7F;
+}
+
+/*
+ * 1文字分をデコードする（Unicode 表3-7 の well-formed 判定に従う）
+ * 不正な部分列は U+FFFD として、その部分列の長さだけ消費する
+ * @return 消費したバイト数、シーケンスがデータ末尾で途切れている場合0
+ */
+static int decode_one(const unsigned char *p, size_t len, uint32_t *cp)
+{
+    unsigned char b0 = p[0];
+    int need;
+    unsigned char lo = 0x80, hi = 0xBF;
+
+    if (b0 < 0x80) {
+        *cp = b0;
+        return 1;
+    }
+
+    if (b0 < 0xC2) {
+        /* 継続バイト単独、または冗長な2バイト表現 */
+        *cp = UTF8_REPLACEMENT_CHAR;
+        return 1;
+    } else if (b0 < 0xE0) {
+        need = 2;
+    } else if (b0 < 0xF0) {
+        need = 3;
+        if (b0 == 0xE0) lo = 0xA0;  /* 冗長表現を除外 */
+        if (b0 == 0xED) hi = 0x9F;  /* サロゲートを除外 */
+    } else if (b0 < 0xF5) {
+        need = 4;
+        if (b0 == 0xF0) lo = 0x90;  /* 冗長表現を除外 */
+        if (b0 == 0xF4) hi = 0x8F;  /* U+10FFFF超を除外 */
+    } else {
+        *cp = UTF8_REPLACEMENT_CHAR;
+        return 1;
+    }
+
+    if (len < 2) {
+        return 0;
+    }
+    if (p[1] < lo || p[1] > hi) {
+        *cp = UTF8_REPLACEMENT_CHAR;
+        return 1;
+    }
+
+    for (int k = 2; k < need; k++) {
+        if ((size_t)k >= len) {
+            return 0;
+        }
+        if ((p[k] & 0xC0) != 0x80) {
+            *cp = UTF8_REPLACEMENT_CHAR;
+            return k;
+        }
+    }
+
+    switch (need) {
+        case 2:
+            *cp = ((uint32_t)(b0 & 0x1F) << 6) | (p[1] & 0x3F);
+            break;
+        case 3:
+            *cp = ((uint32_t)(b0 & 0x0F) << 12) | ((uint32_t)(p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            break;
+        default:
+            *cp = ((uint32_t)(b0 & 0x07) << 18) | ((uint32_t)(p[1] & 0x3F) << 12) |
+                  ((uint32_t)(p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+            break;
+    }
+    return need;
+}
+
+/*
+ * 前回途切れたシーケンスの続きを処理する
+ * @return dataから消費したバイト数（出力したコードポイント数は *emitted）
+ */
+static size_t resume_pending(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                             uint32_t *out, size_t *emitted)
+{
+    unsigned char tmp[4];
+    size_t have = (size_t)dec->pending_len;
+    size_t take = 4 - have;
+    if (take > size) {
+        take = size;
+    }
+
+    memcpy(tmp, dec->pending, have);
+    memcpy(tmp + have, data, take);
+
+    uint32_t cp;
+    int used = decode_one(tmp, have + take, &cp);
+    if (used == 0) {
+        /* まだ途切れている（継続バイトしか来ていない） */
+        memcpy(dec->pending + have, data, take);
+        dec->pending_len = (int)(have + take);
+        *emitted = 0;
+        return take;
+    }
+
+    dec->pending_len = 0;
+    out[0] = cp;
+    *emitted = 1;
+    /* 不正な場合でも保持していたバイトは全て妥当な前置部なので used >= have */
+    return (size_t)used - have;
+}
+
+/* 末尾で途切れたシーケンスを保持する */
+static void save_pending(Utf8Decoder *dec, const unsigned char *p, size_t len)
+{
+    memcpy(dec->pending, p, len);
+    dec->pending_len = (int)len;
+}
+
+/* スカラー版ブロックデコード（未完了シーケンスの処理後に呼ばれる） */
+static size_t decode_block_scalar(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                                  uint32_t *out, size_t out_cap, size_t *out_len)
+{
+    size_t i = 0;
+    size_t n = 0;
+
+    while (i < size && n < out_cap && !is_decode_stop(data[i])) {
+        if (data[i] < 0x80) {
+            out[n++] = data[i++];
+            continue;
+        }
+
+        uint32_t cp;
+        int used = decode_one(data + i, size - i, &cp);
+        if (used == 0) {
+            save_pending(dec, data + i, size - i);
+            i = size;
+            break;
+        }
+        out[n++] = cp;
+        i += (size_t)used;
+    }
+
+    *out_len = n;
+    return i;
+}
+
+#ifdef UTF8_HAVE_X86_SIMD
+
+/*
+ * 印字可能ASCII判定（ベクトル版）
+ * 符号付き比較で 0x20-0x7F を抽出し（0x80以上は負数になる）、DEL(0x7F)を除外する
+ */
+
+/* SSE2版: 16バイトずつ走査 */
+static size_t scan_ascii_sse2(const unsigned char *data, size_t size)
+{
+    const __m128i limit = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+
+    while (i + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, limit));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(ok);
+        if (mask != 0xFFFF) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+        i += 16;
+    }
+
+    return i + scan_ascii_scalar(data + i, size - i);
+}
+
+/* AVX2版: 32バイトずつ走査 */
+__attribute__((target("avx2")))
+static size_t scan_ascii_avx2(const unsigned char *data, size_t size)
+{
+    const __m256i limit = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+
+    while (i + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, limit));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(ok);
+        if (mask != 0xFFFFFFFFu) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+        i += 32;
+    }
+
+    return i + scan_ascii_sse2(data + i, size - i);
+}
+
+/*
+ * SSSE3版ブロックデコード
+ * 16バイト単位で「全て印字可能ASCII」または「3バイト文字4つ（12バイト）」を判定し、
+ * 該当すればまとめて変換する。それ以外は1文字ずつスカラー版で処理する。
+ */
+__attribute__((target("ssse3")))
+static size_t decode_block_ssse3(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                                 uint32_t *out, size_t out_cap, size_t *out_len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    /* 3バイト文字4つ: 先頭バイトは 1110xxxx、継続バイトは 10xxxxxx */
+    const __m128i mask3 = _mm_setr_epi8((char)0xF0, (char)0xC0, (char)0xC0, (char)0xF0, (char)0xC0, (char)0xC0,
+                                        (char)0xF0, (char)0xC0, (char)0xC0, (char)0xF0, (char)0xC0, (char)0xC0,
+                                        0, 0, 0, 0);
+    const __m128i expect3 = _mm_setr_epi8((char)0xE0, (char)0x80, (char)0x80, (char)0xE0, (char)0x80, (char)0x80,
+                                          (char)0xE0, (char)0x80, (char)0x80, (char)0xE0, (char)0x80, (char)0x80,
+                                          0, 0, 0, 0);
+    /* 各32bitレーンに (b0 << 16) | (b1 << 8) | b2 を並べる */
+    const __m128i gather3 = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i m3f = _mm_set1_epi32(0x3F);
+    const __m128i mfc0 = _mm_set1_epi32(0xFC0);
+    const __m128i mf000 = _mm_set1_epi32(0xF000);
+    const __m128i min3 = _mm_set1_epi32(0x800);
+    const __m128i msurr = _mm_set1_epi32(0xF800);
+    const __m128i surr = _mm_set1_epi32(0xD800);
+
+    size_t i = 0;
+    size_t n = 0;
+
+    while (i < size && n < out_cap && !is_decode_stop(data[i])) {
+        if (i + 16 <= size && n + 16 <= out_cap) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+
+            /* 全て印字可能ASCII: ゼロ拡張して16コードポイントを書き出す */
+            __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, limit));
+            if (_mm_movemask_epi8(ok) == 0xFFFF) {
+                __m128i lo16 = _mm_unpacklo_epi8(v, zero);
+                __m128i hi16 = _mm_unpackhi_epi8(v, zero);
+                _mm_storeu_si128((__m128i *)(out + n), _mm_unpacklo_epi16(lo16, zero));
+                _mm_storeu_si128((__m128i *)(out + n + 4), _mm_unpackhi_epi16(lo16, zero));
+                _mm_storeu_si128((__m128i *)(out + n + 8), _mm_unpacklo_epi16(hi16, zero));
+                _mm_storeu_si128((__m128i *)(out + n + 12), _mm_unpackhi_epi16(hi16, zero));
+                i += 16;
+                n += 16;
+                continue;
+            }
+
+            /* 3バイト文字（かな・漢字など）4つ */
+            __m128i shape = _mm_cmpeq_epi8(_mm_and_si128(v, mask3), expect3);
+            if (_mm_movemask_epi8(shape) == 0xFFFF) {
+                __m128i lanes = _mm_shuffle_epi8(v, gather3);
+                __m128i cp = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(lanes, m3f),
+                                 _mm_and_si128(_mm_srli_epi32(lanes, 2), mfc0)),
+                    _mm_and_si128(_mm_srli_epi32(lanes, 4), mf000));
+                /* 冗長表現（U+0800未満）とサロゲートはスカラー版でU+FFFDにする */
+                __m128i bad = _mm_or_si128(_mm_cmplt_epi32(cp, min3),
+                                           _mm_cmpeq_epi32(_mm_and_si128(cp, msurr), surr));
+                if (_mm_movemask_epi8(bad) == 0) {
+                    _mm_storeu_si128((__m128i *)(out + n), cp);
+                    i += 12;
+                    n += 4;
+                    continue;
+                }
+            }
+        }
+
+        if (data[i] < 0x80) {
+            out[n++] = data[i++];
+            continue;
+        }
+
+        uint32_t cp;
+        int used = decode_one(data + i, size - i, &cp);
+        if (used == 0) {
+            save_pending(dec, data + i, size - i);
+            i = size;
+            break;
+        }
+        out[n++] = cp;
+        i += (size_t)used;
+    }
+
+    *out_len = n;
+    return i;
+}
+
+#endif /* UTF8_HAVE_X86_SIMD */
+
+/* 実行時に選択した走査関数 */
+static size_t (*scan_ascii_impl)(const unsigned char *data, size_t size) = NULL;
+
+/* 実行時に選択したブロックデコード関数 */
+static size_t (*decode_block_impl)(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                                   uint32_t *out, size_t out_cap, size_t *out_len) = NULL;
+
+/* CPU機能を調べて走査・デコード関数を選択する */
+static void select_impl(void)
+{
+#ifdef UTF8_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_ascii_impl = scan_ascii_avx2;
+    } else {
+        scan_ascii_impl = scan_ascii_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        decode_block_impl = decode_block_ssse3;
+    } else {
+        decode_block_impl = decode_block_scalar;
+    }
+#else
+    scan_ascii_impl = scan_ascii_scalar;
+    decode_block_impl = decode_block_scalar;
+#endif
+}
+
+/**
+ * 先頭から連続する印字可能ASCIIのバイト数を返す
+ */
+size_t utf8_scan_ascii(const unsigned char *data, size_t size)
+{
+    /* 短い断片（プロンプトの1文字入力など）はSIMDの立ち上げコストが見合わない */
+    if (size < 16) {
+        return scan_ascii_scalar(data, size);
+    }
+
+    if (!scan_ascii_impl) {
+        select_impl();
+    }
+
+    return scan_ascii_impl(data, size);
+}
+
+/**
+ * UTF-8バイト列をコードポイント列にまとめてデコードする
+ */
+size_t utf8_decode_block(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                         uint32_t *out, size_t out_cap, size_t *out_len)
+{
+    size_t used = 0;
+    size_t n = 0;
+
+    if (!decode_block_impl) {
+        select_impl();
+    }
+
+    /* 前回途切れたシーケンスの続き */
+    if (dec->pending_len > 0) {
+        if (size == 0) {
+            *out_len = 0;
+            return 0;
+        }
+        used = resume_pending(dec, data, size, out, &n);
+        if (dec->pending_len > 0 || n >= out_cap) {
+            *out_len = n;
+            return used;
+        }
+    }
+
+    size_t m = 0;
+    used += decode_block_impl(dec, data + used, size - used, out + n, out_cap - n, &m);
+    *out_len = n + m;
+    return used;
+}
+
+/**
+ * コードポイントを1文字分のUTF-8にエンコードする
+ */
+int utf8_encode(uint32_t ch, char *out)
+{
+    if (ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF)) {
+        ch = UTF8_REPLACEMENT_CHAR;
+    }
+    if (ch < 0x80) {
+        out[0] = (char)ch;
+        return 1;
+    }
+    if (ch < 0x800) {
+        out[0] = (char)(0xC0 | (ch >> 6));
+        out[1] = (char)(0x80 | (ch & 0x3F));
+        return 2;
+    }
+    if (ch < 0x10000) {
+        out[0] = (char)(0xE0 | (ch >> 12));
+        out[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (ch & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (ch >> 18));
+    out[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (ch & 0x3F));
+    return 4;
+}
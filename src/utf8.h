@@ -0,0 +1,63 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* U+FFFD REPLACEMENT CHARACTER（不正なバイト列の置換文字） */
+#define UTF8_REPLACEMENT_CHAR 0xFFFD
+
+/* ブロックデコーダの状態（呼び出しをまたいで途切れたシーケンスを保持） */
+typedef struct {
+    unsigned char pending[4];   /* 未完了のシーケンス */
+    int pending_len;            /* 未完了シーケンスのバイト数 */
+} Utf8Decoder;
+
+/* 関数プロトタイプ */
+
+/**
+ * 先頭から連続する印字可能ASCII（0x20-0x7E）のバイト数を返す
+ * SSE2/AVX2が使える環境ではベクトル命令で16/32バイトずつ走査する
+ * @param data データ
+ * @param size データサイズ
+ * @return 印字可能ASCIIが続くバイト数（0の場合は先頭が印字可能ASCIIではない）
+ */
+size_t utf8_scan_ascii(const unsigned char *data, size_t size);
+
+/**
+ * UTF-8バイト列をコードポイント列にまとめてデコードする
+ * 不正なバイト列はU+FFFDに置き換える（不正な部分列ごとに1文字）。
+ * データ末尾で途切れたシーケンスはデコーダに保持し、次回の呼び出しで続きを処理する。
+ * C0制御文字（0x00-0x1F）とDEL（0x7F）の手前でデコードを止める。
+ * @param dec デコーダ状態
+ * @param data データ
+ * @param size データサイズ
+ * @param out コードポイントの出力先
+ * @param out_cap 出力先の容量（1以上）
+ * @param out_len 出力したコードポイント数を格納する変数へのポインタ
+ * @return 消費したバイト数
+ */
+size_t utf8_decode_block(Utf8Decoder *dec, const unsigned char *data, size_t size,
+                         uint32_t *out, size_t out_cap, size_t *out_len);
+
+/**
+ * コードポイントを1文字分のUTF-8にエンコードする
+ * Unicodeの範囲外とサロゲートはU+FFFDに置き換える。
+ * @param ch コードポイント
+ * @param out 出力先（4バイト以上）
+ * @return 書き込んだバイト数
+ */
+int utf8_encode(uint32_t ch, char *out);
+
+/**
+ * デコーダに未完了のシーケンスが残っているか
+ * @param dec デコーダ状態
+ * @return 残っていればtrue
+ */
+static inline bool utf8_decoder_pending(const Utf8Decoder *dec)
+{
+    return dec->pending_len > 0;
+}
+
+#endif /* UTF8_H */
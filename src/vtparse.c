@@ -0,0 +1,374 @@
+/*
+ * koteiterm - VT Parser Module
+ * DEC互換VTパーサーの状態遷移表
+ */
+
+#include "vtparse.h"
+#include <stdio.h>
+
+/* 遷移表の要素を作る */
+#define T(action, state) (uint8_t)((VT_ACTION_##action << 4) | VT_STATE_##state)
+
+/* どの状態からでも有効な遷移（CAN/SUBで中断、ESCで新しいシーケンス開始） */
+#define ANYWHERE \
+    [VT_CLASS_CAN] = T(EXECUTE, GROUND), \
+    [VT_CLASS_ESC] = T(NONE, ESCAPE)
+
+/* 終端文字（0x40-0x7E）の全クラス */
+#define FINALS(t) \
+    [VT_CLASS_DCS] = (t), [VT_CLASS_SOS] = (t), [VT_CLASS_CSI] = (t), \
+    [VT_CLASS_OSC] = (t), [VT_CLASS_FINAL] = (t)
+
+/* バイト → バイトクラス */
+const uint8_t vt_byte_class[256] = {
+    [0x00 ... 0x06] = VT_CLASS_C0,
+    [0x07]          = VT_CLASS_BEL,
+    [0x08 ... 0x17] = VT_CLASS_C0,
+    [0x18]          = VT_CLASS_CAN,
+    [0x19]          = VT_CLASS_C0,
+    [0x1A]          = VT_CLASS_CAN,
+    [0x1B]          = VT_CLASS_ESC,
+    [0x1C ... 0x1F] = VT_CLASS_C0,
+    [0x20 ... 0x2F] = VT_CLASS_INTERMEDIATE,
+    [0x30 ... 0x39] = VT_CLASS_DIGIT,
+    [0x3A]          = VT_CLASS_COLON,
+    [0x3B]          = VT_CLASS_SEMICOLON,
+    [0x3C ... 0x3F] = VT_CLASS_PRIVATE,
+    [0x40 ... 0x4F] = VT_CLASS_FINAL,
+    [0x50]          = VT_CLASS_DCS,
+    [0x51 ... 0x57] = VT_CLASS_FINAL,
+    [0x58]          = VT_CLASS_SOS,
+    [0x59 ... 0x5A] = VT_CLASS_FINAL,
+    [0x5B]          = VT_CLASS_CSI,
+    [0x5C]          = VT_CLASS_FINAL,
+    [0x5D]          = VT_CLASS_OSC,
+    [0x5E ... 0x5F] = VT_CLASS_SOS,
+    [0x60 ... 0x7E] = VT_CLASS_FINAL,
+    [0x7F]          = VT_CLASS_DEL,
+    [0x80 ... 0xFF] = VT_CLASS_HIGH,
+};
+
+/* 状態 × バイトクラス → (アクション, 次の状態) */
+const uint8_t vt_transitions[VT_STATE_COUNT][VT_CLASS_COUNT] = {
+    [VT_STATE_GROUND] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, GROUND),
+        [VT_CLASS_BEL]          = T(EXECUTE, GROUND),
+        [VT_CLASS_INTERMEDIATE] = T(PRINT, GROUND),
+        [VT_CLASS_DIGIT]        = T(PRINT, GROUND),
+        [VT_CLASS_COLON]        = T(PRINT, GROUND),
+        [VT_CLASS_SEMICOLON]    = T(PRINT, GROUND),
+        [VT_CLASS_PRIVATE]      = T(PRINT, GROUND),
+        FINALS(T(PRINT, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, GROUND),
+        [VT_CLASS_HIGH]         = T(PRINT, GROUND),
+    },
+    [VT_STATE_ESCAPE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, ESCAPE),
+        [VT_CLASS_BEL]          = T(EXECUTE, ESCAPE),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, ESCAPE_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_COLON]        = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_SEMICOLON]    = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_PRIVATE]      = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_DCS]          = T(NONE, DCS_ENTRY),
+        [VT_CLASS_SOS]          = T(NONE, SOS_PM_APC_STRING),
+        [VT_CLASS_CSI]          = T(NONE, CSI_ENTRY),
+        [VT_CLASS_OSC]          = T(NONE, OSC_STRING),
+        [VT_CLASS_FINAL]        = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_DEL]          = T(IGNORE, ESCAPE),
+        [VT_CLASS_HIGH]         = T(IGNORE, ESCAPE),
+    },
+    [VT_STATE_ESCAPE_INTERMEDIATE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, ESCAPE_INTERMEDIATE),
+        [VT_CLASS_BEL]          = T(EXECUTE, ESCAPE_INTERMEDIATE),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, ESCAPE_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_COLON]        = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_SEMICOLON]    = T(ESC_DISPATCH, GROUND),
+        [VT_CLASS_PRIVATE]      = T(ESC_DISPATCH, GROUND),
+        FINALS(T(ESC_DISPATCH, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, ESCAPE_INTERMEDIATE),
+        [VT_CLASS_HIGH]         = T(IGNORE, ESCAPE_INTERMEDIATE),
+    },
+    [VT_STATE_CSI_ENTRY] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, CSI_ENTRY),
+        [VT_CLASS_BEL]          = T(EXECUTE, CSI_ENTRY),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, CSI_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(PARAM, CSI_PARAM),
+        [VT_CLASS_COLON]        = T(PARAM, CSI_PARAM),
+        [VT_CLASS_SEMICOLON]    = T(PARAM, CSI_PARAM),
+        [VT_CLASS_PRIVATE]      = T(COLLECT, CSI_PARAM),
+        FINALS(T(CSI_DISPATCH, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, CSI_ENTRY),
+        [VT_CLASS_HIGH]         = T(IGNORE, CSI_ENTRY),
+    },
+    [VT_STATE_CSI_PARAM] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, CSI_PARAM),
+        [VT_CLASS_BEL]          = T(EXECUTE, CSI_PARAM),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, CSI_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(PARAM, CSI_PARAM),
+        [VT_CLASS_COLON]        = T(PARAM, CSI_PARAM),
+        [VT_CLASS_SEMICOLON]    = T(PARAM, CSI_PARAM),
+        [VT_CLASS_PRIVATE]      = T(NONE, CSI_IGNORE),
+        FINALS(T(CSI_DISPATCH, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, CSI_PARAM),
+        [VT_CLASS_HIGH]         = T(IGNORE, CSI_PARAM),
+    },
+    [VT_STATE_CSI_INTERMEDIATE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, CSI_INTERMEDIATE),
+        [VT_CLASS_BEL]          = T(EXECUTE, CSI_INTERMEDIATE),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, CSI_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(NONE, CSI_IGNORE),
+        [VT_CLASS_COLON]        = T(NONE, CSI_IGNORE),
+        [VT_CLASS_SEMICOLON]    = T(NONE, CSI_IGNORE),
+        [VT_CLASS_PRIVATE]      = T(NONE, CSI_IGNORE),
+        FINALS(T(CSI_DISPATCH, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, CSI_INTERMEDIATE),
+        [VT_CLASS_HIGH]         = T(IGNORE, CSI_INTERMEDIATE),
+    },
+    [VT_STATE_CSI_IGNORE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(EXECUTE, CSI_IGNORE),
+        [VT_CLASS_BEL]          = T(EXECUTE, CSI_IGNORE),
+        [VT_CLASS_INTERMEDIATE] = T(IGNORE, CSI_IGNORE),
+        [VT_CLASS_DIGIT]        = T(IGNORE, CSI_IGNORE),
+        [VT_CLASS_COLON]        = T(IGNORE, CSI_IGNORE),
+        [VT_CLASS_SEMICOLON]    = T(IGNORE, CSI_IGNORE),
+        [VT_CLASS_PRIVATE]      = T(IGNORE, CSI_IGNORE),
+        FINALS(T(NONE, GROUND)),
+        [VT_CLASS_DEL]          = T(IGNORE, CSI_IGNORE),
+        [VT_CLASS_HIGH]         = T(IGNORE, CSI_IGNORE),
+    },
+    [VT_STATE_DCS_ENTRY] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, DCS_ENTRY),
+        [VT_CLASS_BEL]          = T(IGNORE, DCS_ENTRY),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, DCS_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(PARAM, DCS_PARAM),
+        [VT_CLASS_COLON]        = T(PARAM, DCS_PARAM),
+        [VT_CLASS_SEMICOLON]    = T(PARAM, DCS_PARAM),
+        [VT_CLASS_PRIVATE]      = T(COLLECT, DCS_PARAM),
+        FINALS(T(NONE, DCS_PASSTHROUGH)),
+        [VT_CLASS_DEL]          = T(IGNORE, DCS_ENTRY),
+        [VT_CLASS_HIGH]         = T(IGNORE, DCS_ENTRY),
+    },
+    [VT_STATE_DCS_PARAM] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, DCS_PARAM),
+        [VT_CLASS_BEL]          = T(IGNORE, DCS_PARAM),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, DCS_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(PARAM, DCS_PARAM),
+        [VT_CLASS_COLON]        = T(PARAM, DCS_PARAM),
+        [VT_CLASS_SEMICOLON]    = T(PARAM, DCS_PARAM),
+        [VT_CLASS_PRIVATE]      = T(NONE, DCS_IGNORE),
+        FINALS(T(NONE, DCS_PASSTHROUGH)),
+        [VT_CLASS_DEL]          = T(IGNORE, DCS_PARAM),
+        [VT_CLASS_HIGH]         = T(IGNORE, DCS_PARAM),
+    },
+    [VT_STATE_DCS_INTERMEDIATE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, DCS_INTERMEDIATE),
+        [VT_CLASS_BEL]          = T(IGNORE, DCS_INTERMEDIATE),
+        [VT_CLASS_INTERMEDIATE] = T(COLLECT, DCS_INTERMEDIATE),
+        [VT_CLASS_DIGIT]        = T(NONE, DCS_IGNORE),
+        [VT_CLASS_COLON]        = T(NONE, DCS_IGNORE),
+        [VT_CLASS_SEMICOLON]    = T(NONE, DCS_IGNORE),
+        [VT_CLASS_PRIVATE]      = T(NONE, DCS_IGNORE),
+        FINALS(T(NONE, DCS_PASSTHROUGH)),
+        [VT_CLASS_DEL]          = T(IGNORE, DCS_INTERMEDIATE),
+        [VT_CLASS_HIGH]         = T(IGNORE, DCS_INTERMEDIATE),
+    },
+    [VT_STATE_DCS_PASSTHROUGH] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_BEL]          = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_INTERMEDIATE] = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_DIGIT]        = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_COLON]        = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_SEMICOLON]    = T(PUT, DCS_PASSTHROUGH),
+        [VT_CLASS_PRIVATE]      = T(PUT, DCS_PASSTHROUGH),
+        FINALS(T(PUT, DCS_PASSTHROUGH)),
+        [VT_CLASS_DEL]          = T(IGNORE, DCS_PASSTHROUGH),
+        [VT_CLASS_HIGH]         = T(PUT, DCS_PASSTHROUGH),
+    },
+    [VT_STATE_DCS_IGNORE] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_BEL]          = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_INTERMEDIATE] = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_DIGIT]        = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_COLON]        = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_SEMICOLON]    = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_PRIVATE]      = T(IGNORE, DCS_IGNORE),
+        FINALS(T(IGNORE, DCS_IGNORE)),
+        [VT_CLASS_DEL]          = T(IGNORE, DCS_IGNORE),
+        [VT_CLASS_HIGH]         = T(IGNORE, DCS_IGNORE),
+    },
+    [VT_STATE_OSC_STRING] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, OSC_STRING),
+        [VT_CLASS_BEL]          = T(NONE, GROUND),  /* xterm互換: BELでも終了 */
+        [VT_CLASS_INTERMEDIATE] = T(OSC_PUT, OSC_STRING),
+        [VT_CLASS_DIGIT]        = T(OSC_PUT, OSC_STRING),
+        [VT_CLASS_COLON]        = T(OSC_PUT, OSC_STRING),
+        [VT_CLASS_SEMICOLON]    = T(OSC_PUT, OSC_STRING),
+        [VT_CLASS_PRIVATE]      = T(OSC_PUT, OSC_STRING),
+        FINALS(T(OSC_PUT, OSC_STRING)),
+        [VT_CLASS_DEL]          = T(IGNORE, OSC_STRING),
+        [VT_CLASS_HIGH]         = T(OSC_PUT, OSC_STRING),
+    },
+    [VT_STATE_SOS_PM_APC_STRING] = {
+        ANYWHERE,
+        [VT_CLASS_C0]           = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_BEL]          = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_INTERMEDIATE] = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_DIGIT]        = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_COLON]        = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_SEMICOLON]    = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_PRIVATE]      = T(IGNORE, SOS_PM_APC_STRING),
+        FINALS(T(IGNORE, SOS_PM_APC_STRING)),
+        [VT_CLASS_DEL]          = T(IGNORE, SOS_PM_APC_STRING),
+        [VT_CLASS_HIGH]         = T(IGNORE, SOS_PM_APC_STRING),
+    },
+};
+
+/* 状態に入るときのアクション */
+const uint8_t vt_entry_actions[VT_STATE_COUNT] = {
+    [VT_STATE_ESCAPE]          = VT_ACTION_CLEAR,
+    [VT_STATE_CSI_ENTRY]       = VT_ACTION_CLEAR,
+    [VT_STATE_DCS_ENTRY]       = VT_ACTION_CLEAR,
+    [VT_STATE_DCS_PASSTHROUGH] = VT_ACTION_HOOK,
+    [VT_STATE_OSC_STRING]      = VT_ACTION_OSC_START,
+};
+
+/* 状態から出るときのアクション */
+const uint8_t vt_exit_actions[VT_STATE_COUNT] = {
+    [VT_STATE_DCS_PASSTHROUGH] = VT_ACTION_UNHOOK,
+    [VT_STATE_OSC_STRING]      = VT_ACTION_OSC_END,
+};
+
+/**
+ * パーサーを初期状態に戻す
+ */
+void vtparse_reset(VtParser *parser)
+{
+    parser->state = VT_STATE_GROUND;
+    vtparse_clear(parser);
+    parser->osc_len = 0;
+}
+
+/**
+ * 状態とバイトから遷移表の要素を引く
+ */
+uint8_t vtparse_lookup(VtState state, unsigned char ch)
+{
+    return vt_transitions[state][vt_byte_class[ch]];
+}
+
+/**
+ * パラメータ・中間文字をクリアする
+ */
+void vtparse_clear(VtParser *parser)
+{
+    parser->private_marker = 0;
+    parser->intermediate_count = 0;
+    parser->collect_overflow = false;
+    parser->param_count = 0;
+    parser->subparam_mask = 0;
+    parser->param_overflow = false;
+}
+
+/**
+ * 中間文字・プライベートマーカーを記録する
+ */
+void vtparse_collect(VtParser *parser, unsigned char ch)
+{
+    if (ch >= 0x3C && ch <= 0x3F) {
+        /* プライベートマーカー（パラメータの先頭のみ） */
+        parser->private_marker = (char)ch;
+        return;
+    }
+
+    if (parser->intermediate_count < VT_MAX_INTERMEDIATES) {
+        parser->intermediates[parser->intermediate_count++] = (char)ch;
+    } else {
+        parser->collect_overflow = true;
+    }
+}
+
+/**
+ * パラメータ文字を整数パラメータに積算する
+ */
+void vtparse_param(VtParser *parser, unsigned char ch)
+{
+    if (parser->param_overflow) {
+        return;
+    }
+
+    /* 最初のパラメータ文字で1つ目のパラメータを開始 */
+    if (parser->param_count == 0) {
+        parser->params[0] = 0;
+        parser->param_count = 1;
+    }
+
+    if (ch >= '0' && ch <= '9') {
+        int *value = &parser->params[parser->param_count - 1];
+        *value = *value * 10 + (ch - '0');
+        if (*value > VT_MAX_PARAM_VALUE) {
+            *value = VT_MAX_PARAM_VALUE;
+        }
+        return;
+    }
+
+    /* ';' または ':' で次のパラメータへ */
+    if (parser->param_count >= VT_MAX_PARAMS) {
+        parser->param_overflow = true;
+        return;
+    }
+    if (ch == ':') {
+        parser->subparam_mask |= 1u << parser->param_count;
+    }
+    parser->params[parser->param_count++] = 0;
+}
+
+/**
+ * パラメータをデバッグ出力用の文字列に戻す
+ */
+void vtparse_format_params(const VtParser *parser, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < parser->param_count && len < size; i++) {
+        const char *sep = (i == 0) ? "" : (vtparse_is_subparam(parser, i) ? ":" : ";");
+        int n = snprintf(buf + len, size - len, "%s%d", sep, parser->params[i]);
+        if (n < 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+}
+
+/**
+ * OSC文字列を開始する
+ */
+void vtparse_osc_start(VtParser *parser)
+{
+    parser->osc_len = 0;
+}
+
+/**
+ * OSC文字列に1バイト追加する
+ */
+void vtparse_osc_put(VtParser *parser, unsigned char ch)
+{
+    if (parser->osc_len < VT_MAX_OSC - 1) {
+        parser->osc_buf[parser->osc_len++] = (char)ch;
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef VTPARSE_H
+#define VTPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * DEC互換のVTパーサー（VT500系の状態遷移図に準拠）
+ * 状態とバイトクラスで引く遷移表で、次の状態と実行するアクションを決める。
+ * C1制御文字（0x80-0x9F）はUTF-8の継続バイトと衝突するため解釈しない。
+ */
+
+/* パーサー状態 */
+typedef enum {
+    VT_STATE_GROUND,                /* 通常（文字の印字） */
+    VT_STATE_ESCAPE,                /* ESC受信直後 */
+    VT_STATE_ESCAPE_INTERMEDIATE,   /* ESC + 中間文字 */
+    VT_STATE_CSI_ENTRY,             /* ESC [ 受信直後 */
+    VT_STATE_CSI_PARAM,             /* CSIパラメータ */
+    VT_STATE_CSI_INTERMEDIATE,      /* CSI中間文字 */
+    VT_STATE_CSI_IGNORE,            /* 不正なCSI（終端文字まで読み捨て） */
+    VT_STATE_DCS_ENTRY,             /* ESC P 受信直後 */
+    VT_STATE_DCS_PARAM,             /* DCSパラメータ */
+    VT_STATE_DCS_INTERMEDIATE,      /* DCS中間文字 */
+    VT_STATE_DCS_PASSTHROUGH,       /* DCSデータ本体 */
+    VT_STATE_DCS_IGNORE,            /* 不正なDCS（STまで読み捨て） */
+    VT_STATE_OSC_STRING,            /* OSC文字列 */
+    VT_STATE_SOS_PM_APC_STRING,     /* SOS/PM/APC文字列（読み捨て） */
+    VT_STATE_COUNT
+} VtState;
+
+/* アクション */
+typedef enum {
+    VT_ACTION_NONE,
+    VT_ACTION_PRINT,         /* 文字を印字 */
+    VT_ACTION_EXECUTE,       /* C0制御文字を実行 */
+    VT_ACTION_CLEAR,         /* パラメータ・中間文字をクリア */
+    VT_ACTION_COLLECT,       /* 中間文字・プライベートマーカーを記録 */
+    VT_ACTION_PARAM,         /* パラメータ文字を記録 */
+    VT_ACTION_ESC_DISPATCH,  /* ESCシーケンスを実行 */
+    VT_ACTION_CSI_DISPATCH,  /* CSIシーケンスを実行 */
+    VT_ACTION_HOOK,          /* DCS開始 */
+    VT_ACTION_PUT,           /* DCSデータ */
+    VT_ACTION_UNHOOK,        /* DCS終了 */
+    VT_ACTION_OSC_START,     /* OSC開始 */
+    VT_ACTION_OSC_PUT,       /* OSC文字列 */
+    VT_ACTION_OSC_END,       /* OSC終了 */
+    VT_ACTION_IGNORE         /* 読み捨て */
+} VtAction;
+
+/* バイトクラス（遷移表の列） */
+typedef enum {
+    VT_CLASS_C0,             /* 0x00-0x17, 0x19, 0x1C-0x1F（BEL以外） */
+    VT_CLASS_BEL,            /* 0x07 */
+    VT_CLASS_CAN,            /* 0x18 CAN, 0x1A SUB */
+    VT_CLASS_ESC,            /* 0x1B */
+    VT_CLASS_INTERMEDIATE,   /* 0x20-0x2F */
+    VT_CLASS_DIGIT,          /* 0x30-0x39 */
+    VT_CLASS_COLON,          /* 0x3A */
+    VT_CLASS_SEMICOLON,      /* 0x3B */
+    VT_CLASS_PRIVATE,        /* 0x3C-0x3F */
+    VT_CLASS_DCS,            /* 0x50 'P' */
+    VT_CLASS_SOS,            /* 0x58 'X', 0x5E '^', 0x5F '_' */
+    VT_CLASS_CSI,            /* 0x5B '[' */
+    VT_CLASS_OSC,            /* 0x5D ']' */
+    VT_CLASS_FINAL,          /* その他の 0x40-0x7E */
+    VT_CLASS_DEL,            /* 0x7F */
+    VT_CLASS_HIGH,           /* 0x80-0xFF（UTF-8） */
+    VT_CLASS_COUNT
+} VtByteClass;
+
+/* 遷移表の要素: 上位4bitがアクション、下位4bitが次の状態 */
+#define VT_TRANSITION_ACTION(t) ((VtAction)((t) >> 4))
+#define VT_TRANSITION_STATE(t)  ((VtState)((t) & 0x0F))
+
+/* 上限 */
+#define VT_MAX_PARAMS        32   /* パラメータの最大数（サブパラメータを含む） */
+#define VT_MAX_PARAM_VALUE   99999 /* パラメータ値の上限（これを超える値は切り詰める） */
+#define VT_MAX_INTERMEDIATES 2    /* 中間文字の最大数 */
+#define VT_MAX_OSC           512  /* OSC文字列の最大長 */
+
+/* パーサー状態 */
+typedef struct {
+    VtState state;                          /* 現在の状態 */
+    char private_marker;                    /* プライベートマーカー（'?', '>' など、なければ0） */
+    char intermediates[VT_MAX_INTERMEDIATES]; /* 中間文字 */
+    int intermediate_count;                 /* 中間文字数 */
+    bool collect_overflow;                  /* 中間文字が多すぎる（シーケンスを無視する） */
+    int params[VT_MAX_PARAMS];              /* パラメータ（省略されたものは0） */
+    int param_count;                        /* パラメータ数（パラメータなしなら0） */
+    uint32_t subparam_mask;                 /* bit i: params[i]が':'区切りのサブパラメータ */
+    bool param_overflow;                    /* パラメータが多すぎる（以降を読み捨てる） */
+    char osc_buf[VT_MAX_OSC];               /* OSC文字列 */
+    int osc_len;                            /* OSC文字列の長さ */
+} VtParser;
+
+/* 遷移表 */
+extern const uint8_t vt_byte_class[256];
+extern const uint8_t vt_transitions[VT_STATE_COUNT][VT_CLASS_COUNT];
+extern const uint8_t vt_entry_actions[VT_STATE_COUNT];
+extern const uint8_t vt_exit_actions[VT_STATE_COUNT];
+
+/* 関数プロトタイプ */
+
+/**
+ * パーサーを初期状態に戻す
+ * @param parser パーサー
+ */
+void vtparse_reset(VtParser *parser);
+
+/**
+ * 状態とバイトから遷移表の要素を引く
+ * @param state 現在の状態
+ * @param ch 入力バイト
+ * @return 遷移表の要素（VT_TRANSITION_ACTION/VT_TRANSITION_STATEで分解）
+ */
+uint8_t vtparse_lookup(VtState state, unsigned char ch);
+
+/**
+ * パラメータ・中間文字をクリアする（clearアクション）
+ * @param parser パーサー
+ */
+void vtparse_clear(VtParser *parser);
+
+/**
+ * 中間文字・プライベートマーカーを記録する（collectアクション）
+ * @param parser パーサー
+ * @param ch 入力バイト
+ */
+void vtparse_collect(VtParser *parser, unsigned char ch);
+
+/**
+ * パラメータ文字を整数パラメータに積算する（paramアクション）
+ * 数字は現在のパラメータに加え、';'は次のパラメータ、':'は次のサブパラメータを開始する。
+ * @param parser パーサー
+ * @param ch 入力バイト（'0'-'9', ';', ':'）
+ */
+void vtparse_param(VtParser *parser, unsigned char ch);
+
+/**
+ * パラメータがサブパラメータ（':'区切り）か
+ * @param parser パーサー
+ * @param index パラメータのインデックス
+ * @return サブパラメータならtrue
+ */
+static inline bool vtparse_is_subparam(const VtParser *parser, int index)
+{
+    return (parser->subparam_mask >> index) & 1;
+}
+
+/**
+ * パラメータをデバッグ出力用の文字列に戻す
+ * @param parser パーサー
+ * @param buf 出力先
+ * @param size 出力先のサイズ
+ */
+void vtparse_format_params(const VtParser *parser, char *buf, size_t size);
+
+/**
+ * OSC文字列を開始する（osc_startアクション）
+ * @param parser パーサー
+ */
+void vtparse_osc_start(VtParser *parser);
+
+/**
+ * OSC文字列に1バイト追加する（osc_putアクション）
+ * @param parser パーサー
+ * @param ch 入力バイト
+ */
+void vtparse_osc_put(VtParser *parser, unsigned char ch);
+
+#endif /* VTPARSE_H */
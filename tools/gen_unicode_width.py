@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""
+koteiterm - 文字幅テーブル生成スクリプト
+
+Unicodeデータから src/unicode_width_table.c（2段テーブル）を生成する。
+
+使い方:
+    tools/gen_unicode_width.py [UCDディレクトリ] > src/unicode_width_table.c
+
+UCDディレクトリに UnicodeData.txt, EastAsianWidth.txt, emoji-data.txt があれば
+それを使う。省略した場合はPython標準のunicodedataモジュールのデータを使う。
+通常は make unicode-width でダウンロードから生成までを行う。
+
+幅の決め方:
+    0: 結合文字（Mn, Me）、書式制御文字（Cf、ただしSOFT HYPHENを除く）、
+       ハングル中声・終声字母（U+1160-U+11FF, U+D7B0-U+D7FF）
+    2: East Asian Width が W または F、Emoji_Presentation=Yes
+    1: その他（未割り当て・制御文字を含む）
+"""
+
+import os
+import sys
+import unicodedata
+
+MAX_CODEPOINT = 0x110000
+BLOCK_SHIFT = 8
+BLOCK_SIZE = 1 << BLOCK_SHIFT
+WIDTHS_PER_BYTE = 4  # 1文字2bit
+
+# EastAsianWidth.txtで明示されていない範囲の既定値（W）
+DEFAULT_WIDE_RANGES = [
+    (0x3400, 0x4DBF),    # CJK統合漢字拡張A
+    (0x4E00, 0x9FFF),    # CJK統合漢字
+    (0xF900, 0xFAFF),    # CJK互換漢字
+    (0x20000, 0x2FFFD),  # 第2面
+    (0x30000, 0x3FFFD),  # 第3面
+]
+
+# 幅0として扱うハングル字母（先頭子音と組み合わせて1文字になる）
+HANGUL_JAMO_ZERO = [
+    (0x1160, 0x11FF),
+    (0xD7B0, 0xD7FF),
+]
+
+
+def parse_ucd_ranges(path):
+    """UCD形式のファイル（"XXXX..YYYY ; 値 # コメント"）を読む"""
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = [x.strip() for x in line.split(';')]
+            if '..' in fields[0]:
+                first, last = fields[0].split('..')
+            else:
+                first = last = fields[0]
+            yield int(first, 16), int(last, 16), fields[1]
+
+
+def load_categories_ucd(ucd_dir):
+    """UnicodeData.txtから一般カテゴリを読む（範囲指定の First/Last に対応）"""
+    categories = {}
+    range_start = None
+    with open(os.path.join(ucd_dir, 'UnicodeData.txt'), encoding='utf-8') as f:
+        for line in f:
+            fields = line.split(';')
+            cp = int(fields[0], 16)
+            name = fields[1]
+            category = fields[2]
+            if name.endswith(', First>'):
+                range_start = cp
+                continue
+            if name.endswith(', Last>') and range_start is not None:
+                for c in range(range_start, cp + 1):
+                    categories[c] = category
+                range_start = None
+                continue
+            categories[cp] = category
+    return categories
+
+
+def build_widths(ucd_dir):
+    widths = [1] * MAX_CODEPOINT
+
+    if ucd_dir:
+        eaw_path = os.path.join(ucd_dir, 'EastAsianWidth.txt')
+        with open(eaw_path, encoding='utf-8') as f:
+            # 先頭行は "# EastAsianWidth-15.1.0.txt" の形式
+            version = f.readline().lstrip('#').strip() or eaw_path
+        categories = load_categories_ucd(ucd_dir)
+
+        def category(cp):
+            return categories.get(cp, 'Cn')
+
+        for first, last in DEFAULT_WIDE_RANGES:
+            for cp in range(first, last + 1):
+                widths[cp] = 2
+        for first, last, value in parse_ucd_ranges(eaw_path):
+            for cp in range(first, last + 1):
+                widths[cp] = 2 if value in ('W', 'F') else 1
+        emoji_path = os.path.join(ucd_dir, 'emoji-data.txt')
+        if os.path.exists(emoji_path):
+            for first, last, value in parse_ucd_ranges(emoji_path):
+                if value == 'Emoji_Presentation':
+                    for cp in range(first, last + 1):
+                        widths[cp] = 2
+    else:
+        version = 'Python unicodedata {}'.format(unicodedata.unidata_version)
+
+        def category(cp):
+            return unicodedata.category(chr(cp))
+
+        for cp in range(MAX_CODEPOINT):
+            if unicodedata.east_asian_width(chr(cp)) in ('W', 'F'):
+                widths[cp] = 2
+        for first, last in DEFAULT_WIDE_RANGES:
+            for cp in range(first, last + 1):
+                widths[cp] = 2
+
+    for cp in range(MAX_CODEPOINT):
+        cat = category(cp)
+        if cat in ('Mn', 'Me') or (cat == 'Cf' and cp != 0x00AD):
+            widths[cp] = 0
+    for first, last in HANGUL_JAMO_ZERO:
+        for cp in range(first, last + 1):
+            widths[cp] = 0
+
+    return widths, version
+
+
+def pack_block(widths, start):
+    data = bytearray(BLOCK_SIZE // WIDTHS_PER_BYTE)
+    for i in range(BLOCK_SIZE):
+        data[i // WIDTHS_PER_BYTE] |= widths[start + i] << (2 * (i % WIDTHS_PER_BYTE))
+    return bytes(data)
+
+
+def main():
+    ucd_dir = sys.argv[1] if len(sys.argv) > 1 else None
+    widths, version = build_widths(ucd_dir)
+
+    # 同じ内容のブロックをまとめる
+    blocks = []
+    block_index = {}
+    stage1 = []
+    for start in range(0, MAX_CODEPOINT, BLOCK_SIZE):
+        packed = pack_block(widths, start)
+        if packed not in block_index:
+            block_index[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(block_index[packed])
+
+    if len(blocks) > 256:
+        sys.exit('ブロック数が多すぎます: {}'.format(len(blocks)))
+
+    out = sys.stdout
+    out.write('/*\n')
+    out.write(' * koteiterm - Unicode Width Table\n')
+    out.write(' * tools/gen_unicode_width.py で生成（直接編集しないこと）\n')
+    out.write(' * データ: {}\n'.format(version))
+    out.write(' */\n\n')
+    out.write('#include "unicode_width.h"\n\n')
+
+    out.write('/* 1段目: コードポイントの上位ビット → ブロック番号 */\n')
+    out.write('const uint8_t unicode_width_stage1[UNICODE_WIDTH_STAGE1_SIZE] = {\n')
+    for i in range(0, len(stage1), 16):
+        out.write('    ' + ', '.join('{:3d}'.format(x) for x in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('/* 2段目: ブロック内の幅（1文字2bit、{}ブロック） */\n'.format(len(blocks)))
+    out.write('const uint8_t unicode_width_stage2[][UNICODE_WIDTH_BLOCK_BYTES] = {\n')
+    for n, block in enumerate(blocks):
+        out.write('    {{ /* {} */\n'.format(n))
+        for i in range(0, len(block), 16):
+            out.write('        ' + ', '.join('0x{:02x}'.format(x) for x in block[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()